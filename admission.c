@@ -0,0 +1,126 @@
+#include <glib.h>
+#include <sys/time.h>
+
+#include "admission.h"
+#include "kodama.h"
+#include "util.h"
+
+extern globals_t globals;
+extern stats_t stats;
+G_LOCK_EXTERN(stats);
+
+/// Conversations admitted and not yet released
+static volatile gint live = 0;
+/// Most conversations we admit. 0 until init_admission() - no limit
+static volatile gint capacity = 0;
+
+/* Only touched by init_admission() and admission_update() */
+static double budget = 0;            /**< Cycles per second we may spend */
+static double calibrated_cost = 0;   /**< Cycles per second a conversation
+                                          took during calibration */
+static double conv_cost = 0;         /**< Current estimate of the same */
+static uint64_t last_cycles = 0;     /**< stats.total_cycles last update */
+static struct timeval last_update;
+
+static void update_capacity(void);
+
+void init_admission(void)
+{
+    G_LOCK(stats);
+    double cpu_mips = stats.cpu_mips;
+    double ec_per_core = stats.ec_per_core;
+    int num_cpus = stats.num_cpus;
+    last_cycles = stats.total_cycles;
+    G_UNLOCK(stats);
+
+    gettimeofday(&last_update, NULL);
+
+    if (cpu_mips <= 0 || ec_per_core <= 0)
+    {
+        g_warning("Calibration didn't give us a cost - admitting every "
+            "conversation");
+        return;
+    }
+
+    /* One echo canceler per side */
+    budget = cpu_mips * 1E6 * num_cpus * ADMISSION_HEADROOM;
+    calibrated_cost = 2 * (cpu_mips / ec_per_core) * 1E6;
+    conv_cost = calibrated_cost;
+
+    update_capacity();
+    g_debug("Admitting up to %d conversations",
+        g_atomic_int_get(&capacity));
+}
+
+gboolean admission_admit(void)
+{
+    while (TRUE)
+    {
+        gint n = g_atomic_int_get(&live);
+        gint cap = g_atomic_int_get(&capacity);
+
+        if (cap && n >= cap)
+        {
+            return FALSE;
+        }
+        if (g_atomic_int_compare_and_exchange(&live, n, n + 1))
+        {
+            return TRUE;
+        }
+    }
+}
+
+void admission_release(void)
+{
+    g_atomic_int_add(&live, -1);
+}
+
+void admission_update(void)
+{
+    struct timeval now;
+
+    if (!budget)
+    {
+        return;
+    }
+
+    G_LOCK(stats);
+    uint64_t cycles_now = stats.total_cycles;
+    G_UNLOCK(stats);
+
+    gettimeofday(&now, NULL);
+    double secs = delta(&last_update, &now) / 1E6;
+    gint n = g_atomic_int_get(&live);
+
+    /* total_cycles goes backwards if stats were reset - skip a beat */
+    if (n > 0 && secs > 0 && cycles_now > last_cycles)
+    {
+        double measured = (cycles_now - last_cycles) / secs / n;
+        measured = CLAMP(measured, calibrated_cost * ADMISSION_MIN_COST,
+            calibrated_cost * ADMISSION_MAX_COST);
+
+        conv_cost = (1 - ADMISSION_SMOOTHING) * conv_cost +
+            ADMISSION_SMOOTHING * measured;
+        update_capacity();
+    }
+
+    last_cycles = cycles_now;
+    last_update = now;
+}
+
+gchar *admission_describe(void)
+{
+    gint n = g_atomic_int_get(&live);
+    gint cap = g_atomic_int_get(&capacity);
+
+    return g_strdup_printf("conversations=%d;capacity=%d;load=%.2f", n, cap,
+        cap ? (float)n / cap : 0.);
+}
+
+/* This may drop below the number of live conversations. We don't end calls -
+ * we just stop taking new ones until enough of them end on their own */
+static void update_capacity(void)
+{
+    int cap = budget / conv_cost;
+    g_atomic_int_set(&capacity, MAX(cap, 1));
+}
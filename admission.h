@@ -0,0 +1,61 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <glib.h>
+
+/// Share of the calibrated CPU budget we fill with conversations. The rest
+/// absorbs bursts, and everything that isn't audio processing
+#define ADMISSION_HEADROOM (0.8)
+
+/// How much each second's measurement moves our estimate of what a
+/// conversation costs
+#define ADMISSION_SMOOTHING (0.1)
+
+/// Measured costs are kept within these multiples of the calibrated cost, so a
+/// shard full of silent (or stuck) conversations doesn't admit far more than
+/// it could run once they all start talking
+#define ADMISSION_MIN_COST (0.5)
+#define ADMISSION_MAX_COST (4.0)
+
+/// Seconds between load reports to wowza
+#define ADMISSION_REPORT_INTERVAL (5)
+
+/**
+ * Size the shard from the results of calibrate(). Until this is called, every
+ * conversation is admitted - calibration needs one of its own.
+ */
+void init_admission(void);
+
+/**
+ * Reserve room for a new conversation.
+ *
+ * @return TRUE if there's room. The caller must call admission_release() once
+ * the conversation ends, or if it isn't created after all.
+ */
+gboolean admission_admit(void);
+
+/**
+ * Give back the room reserved by admission_admit().
+ */
+void admission_release(void);
+
+/**
+ * Re-estimate what a conversation costs from the cycles spent processing audio
+ * since the last call, and resize the shard to match. Call about once a
+ * second, from one thread.
+ */
+void admission_update(void);
+
+/**
+ * Describe the shard's current load as "key=value" pairs separated by ';' -
+ * the body of 'L' and 'R' messages:
+ *
+ * conversations=N;capacity=N;load=F
+ *
+ * where load is conversations / capacity.
+ *
+ * @return The description. Caller must g_free() it.
+ */
+gchar *admission_describe(void);
+
+#endif
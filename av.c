@@ -18,7 +18,6 @@ static int local_get_audio_flags(AVCodecContext *enc);
 void init_av(void)
 {
     av_register_all();
-    flv_init();
 }
 
 /* TODO: we should be able to handle > 1 speex frame per packet. It looks like
@@ -80,12 +79,12 @@ int setup_decode_context(FLVStream *flv, unsigned char formatByte)
 
     /* Determine if we need to resample. Base it off the codec context's
      * sample rate, since the format byte often lies */
-    if (flv->d_codec_ctx->sample_rate != globals.sample_rate)
+    if (flv->d_codec_ctx->sample_rate != flv->sample_rate)
     {
         FLV_LOG("Creating decode resample context: %d -> %d\n",
-            flv->d_codec_ctx->sample_rate, globals.sample_rate);
+            flv->d_codec_ctx->sample_rate, flv->sample_rate);
         flv->d_resample_ctx = av_audio_resample_init(1, channels,
-            globals.sample_rate, flv->d_codec_ctx->sample_rate,
+            flv->sample_rate, flv->d_codec_ctx->sample_rate,
             SAMPLE_FMT_S16, SAMPLE_FMT_S16,
             16, //TODO: How many taps do we need?
             10, 0, .8); /* TODO: fix these */
@@ -110,22 +109,24 @@ int setup_decode_context(FLVStream *flv, unsigned char formatByte)
     return 0;
 }
 
-int setup_encode_context(FLVStream *flv)
+int setup_encode_context(FLVStream *flv, unsigned char formatByte)
 {
     /* This should match the decode context as closely as possible - use the
-     * format byte that we cached */
+     * format byte the samples were decoded from */
 
     int flv_codecid, sampleRate, channels, sampleSize, flags_size;
     int ret;
-    ret = decode_format_byte(flv->d_format_byte, &flv_codecid, &sampleRate,
+    ret = decode_format_byte(formatByte, &flv_codecid, &sampleRate,
         &channels, &sampleSize, &flags_size);
     if (ret)
     {
         g_warning("Error decoding format byte %.02x for encoding",
-                flv->d_format_byte);
+                formatByte);
         return ret;
     }
 
+    flv->e_format_byte = formatByte;
+
     flv->e_codec_ctx->sample_rate = sampleRate;
     flv->e_codec_ctx->codec_id = flv_codecid;
     local_flv_set_audio_codec(flv->e_codec_ctx, flv_codecid);
@@ -144,7 +145,8 @@ int setup_encode_context(FLVStream *flv)
     {
         FLV_LOG("Not setting QSCALE flag: flv_codecid = %d\n", flv_codecid);
         flv->e_codec_ctx->bit_rate = 20600; /* The default in actionscript */
-        flv->e_codec_ctx->compression_level = 4; /* Higher = better quality */
+        /* Higher = better quality, and more CPU. Set by the governor */
+        flv->e_codec_ctx->compression_level = flv->e_complexity;
     }
 
     /* Load the codec */
@@ -170,12 +172,12 @@ int setup_encode_context(FLVStream *flv)
 
     /* Resample back to the original sample rate, if we downsampled for echo
      * cancellation */
-    if (flv->e_codec_ctx->sample_rate != globals.sample_rate)
+    if (flv->e_codec_ctx->sample_rate != flv->sample_rate)
     {
         FLV_LOG("Creating encode resample context: %d -> %d\n",
-                globals.sample_rate, flv->d_codec_ctx->sample_rate);
+                flv->sample_rate, flv->e_codec_ctx->sample_rate);
         flv->e_resample_ctx = av_audio_resample_init(1, channels,
-            flv->e_codec_ctx->sample_rate, globals.sample_rate,
+            flv->e_codec_ctx->sample_rate, flv->sample_rate,
             SAMPLE_FMT_S16, SAMPLE_FMT_S16,
             16,  // TODO: again, how many taps do we need?
             10, 0, .8);
@@ -188,10 +190,10 @@ int setup_encode_context(FLVStream *flv)
     /* This should match the incoming format byte */
     int flags = local_get_audio_flags(flv->e_codec_ctx);
 
-    if (flags != flv->d_format_byte)
+    if (flags != formatByte)
     {
         g_warning("Calculated encode format byte != decode format byte");
-        g_warning("%.2X\t%.2X", flags, flv->d_format_byte);
+        g_warning("%.2X\t%.2X", flags, formatByte);
         return -1;
     }
     else
@@ -202,6 +204,57 @@ int setup_encode_context(FLVStream *flv)
     return 0;
 }
 
+int set_encode_complexity(FLVStream *flv, int complexity)
+{
+    AVCodecContext *ctx = flv->e_codec_ctx;
+    AVCodec *codec = ctx->codec;
+
+    flv->e_complexity = complexity;
+
+    if (ctx->codec_id != CODEC_ID_SPEEX || !codec)
+    {
+        return 0;
+    }
+
+    /* libavcodec's Speex encoder only reads compression_level when it's
+     * opened, so reopen it. That resets the encoder's state, which costs a
+     * little quality on the next frame - the governor changes level rarely */
+    avcodec_close(ctx);
+    ctx->compression_level = complexity;
+    if (avcodec_open(ctx, codec) < 0)
+    {
+        g_warning("Failed to reopen codec id %d at complexity %d",
+            ctx->codec_id, complexity);
+        flv->e_format_byte = '\0';
+        return -1;
+    }
+
+    return 0;
+}
+
+int get_codec_sample_rate(const unsigned char formatByte)
+{
+    int codecid, sampleRate, channels, sampleSize, flags_size;
+
+    if (decode_format_byte(formatByte, &codecid, &sampleRate, &channels,
+            &sampleSize, &flags_size))
+    {
+        return -1;
+    }
+
+    /* Same special cases as local_flv_set_audio_codec - the format byte
+     * doesn't tell the whole story */
+    switch (codecid)
+    {
+    case FLV_CODECID_SPEEX:
+        return 16000;
+    case FLV_CODECID_NELLYMOSER_8KHZ_MONO:
+        return 8000;
+    default:
+        return sampleRate;
+    }
+}
+
 static int decode_format_byte(const unsigned char formatByte, int *codecid,
         int *sampleRate, int *channels, int *sampleSize, int *flags_size)
 {
@@ -9,6 +9,29 @@ struct FLVStream;
 
 void init_av(void);
 int setup_decode_context(struct FLVStream *flv, unsigned char formatByte);
-int setup_encode_context(struct FLVStream *flv);
+int setup_encode_context(struct FLVStream *flv, unsigned char formatByte);
+
+/**
+ * Change the compression level of a stream's encoder, which must already be
+ * set up. Only Speex is changed - other codecs just record the level.
+ *
+ * @param flv The stream.
+ * @param complexity The new compression level.
+ *
+ * @return Zero on success. On failure the encoder is left closed, and will be
+ * set up again for the stream's next packet.
+ */
+int set_encode_complexity(struct FLVStream *flv, int complexity);
+
+/**
+ * Determine the rate a codec actually runs at from an FLV audio format
+ * byte. Unlike the rate field of the format byte, this accounts for codecs like
+ * Speex, which always report 11025 Hz.
+ *
+ * @param formatByte The format byte from an FLV audio tag.
+ *
+ * @return The codec's sample rate, or -1 if the format byte is invalid.
+ */
+int get_codec_sample_rate(const unsigned char formatByte);
 
 #endif
@@ -0,0 +1,549 @@
+/* Benchmark for the connection to wowza. Stands in for wowza on loopback:
+ * waits for one shard to connect (run it with --server 127.0.0.1:port, and
+ * --io-uring or not), starts a number of conversations, then keeps a window of
+ * audio messages in flight across them for a while. Prints the replies we got
+ * per second, and how long they took to come back.
+ *
+ * Run the shard with --dummy to measure the I/O path alone, rather than echo
+ * cancellation. Pass handles as 1 to ask for stream handles, and send audio
+ * as 'd' messages once we have them. Pass batch to send audio in 'B' messages
+ * of up to that many packets. Pass pcm as 1 to send 20ms of raw PCM in each
+ * packet rather than a speex tag, for streams the shard accepts it for.
+ *
+ * Usage: bench_io [port] [conversations] [seconds] [window] [handles] [batch]
+ *                 [pcm]
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "imo_message.h"
+#include "kodama.h"
+#include "pcm.h"
+
+#define DEFAULT_CONVERSATIONS (100)
+#define DEFAULT_SECONDS (10)
+/// Audio messages sent and not yet replied to
+#define DEFAULT_WINDOW (256)
+
+/// Longest we wait for the shard to accept the conversations
+#define START_TIMEOUT_SECS (10)
+
+/// Round trip times we can tell apart, in microseconds. Anything slower lands
+/// in the last bucket
+#define RTT_BUCKETS (100000)
+
+/// A speex packet in an FLV tag, as calibrate() uses
+#define FLV_PACKET_LEN (68)
+/// Packets of raw PCM carry this much audio
+#define PCM_PACKET_MS (20)
+
+static unsigned char flv_packet[FLV_PACKET_LEN + IMO_INPUT_PADDING] = "\x08\x00\x00\x35\x00\x1A\x27\x00\x00\x00\x00\xB6\x2B\x42\x48\xD4\x16\x8C\xE2\x47\x04\x49\x9C\x01\x18\xC5\xDD\xA7\x16\x95\x38\xB6\xFD\xA2\x57\x8F\xEC\x75\xDA\xA1\x53\x11\xBC\xE9\x7E\x84\xA9\xC9\x20\x2A\x9C\x60\x17\xB3\x80\x3D\xAD\x62\x38\xA0\xC0\x03\x60\xB7\x00\x00\x00\x40";
+
+typedef struct bench_stream {
+    gchar *name;
+    gboolean accepted;
+    guint32 handle;             /**< From the shard's 'H' message, or 0 */
+    int pcm_rate;               /**< From the shard's 'P' message, or 0 to
+                                     send speex */
+    GQueue sent;                /**< When each unanswered packet went out, as
+                                     gint64 microseconds. Replies to a stream
+                                     come back in order */
+} bench_stream;
+
+static int fd = -1;
+static GByteArray *in = NULL;   /**< Bytes read but not yet framed */
+static GByteArray *out = NULL;  /**< Bytes queued but not yet written */
+
+static bench_stream *streams = NULL;
+static int num_streams = 0;
+static GHashTable *stream_by_name = NULL;
+static GHashTable *stream_by_handle = NULL;
+static int accepted = 0;
+static int with_handles = 0;
+static int with_pcm = 0;
+static int batch_size = 0;
+static GByteArray *batch_out = NULL; /**< Entries for the next 'B' message */
+
+static int in_flight = 0;
+static long replies = 0;
+static long other_replies = 0;
+static guint32 *rtt_counts = NULL;
+
+static gint64 now_us(void);
+static int accept_shard(int port);
+static void queue_out(char type, const char *stream_name,
+    unsigned char *body, int body_len);
+static unsigned char *make_body(bench_stream *s, int *len);
+static void queue_audio(bench_stream *s, GByteArray *to);
+static void queue_batch(void);
+static int flush_out(void);
+static int read_in(void);
+static void handle_reply(imo_message *msg);
+static void send_audio(int count);
+static long rtt_percentile(double p);
+
+static gint64 now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (gint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int accept_shard(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (listen_fd < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(listen_fd, 1))
+    {
+        perror("bind/listen");
+        exit(1);
+    }
+
+    printf("Waiting for a shard on 127.0.0.1:%d\n", port);
+    int shard_fd = accept(listen_fd, NULL, NULL);
+    if (shard_fd < 0)
+    {
+        perror("accept");
+        exit(1);
+    }
+    close(listen_fd);
+
+    setsockopt(shard_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(shard_fd, F_SETFL, O_NONBLOCK);
+
+    return shard_fd;
+}
+
+static void queue_out(char type, const char *stream_name,
+    unsigned char *body, int body_len)
+{
+    imo_message *msg = create_imo_message(type, stream_name, body, body_len);
+    g_byte_array_append(out, msg->text, msg->length);
+    imo_message_destroy(msg);
+}
+
+/* An audio body for s, from imo_body_alloc() - raw PCM if the shard accepted
+ * it, or the speex tag */
+static unsigned char *make_body(bench_stream *s, int *len)
+{
+    if (!s->pcm_rate)
+    {
+        *len = FLV_PACKET_LEN;
+        unsigned char *body = imo_body_alloc(*len);
+        memcpy(body, flv_packet, *len);
+        return body;
+    }
+
+    int count = s->pcm_rate * PCM_PACKET_MS / 1000;
+    *len = PCM_HEADER_LEN + count * 2;
+    unsigned char *body = imo_body_alloc(*len);
+
+    guint32 pts_be = htonl((guint32)(now_us() / 1000));
+    body[0] = PCM_TAG;
+    memcpy(body + 1, &pts_be, 4);
+
+    /* Something other than silence, in case that's cheaper to cancel */
+    unsigned char *p = body + PCM_HEADER_LEN;
+    for (int i = 0; i < count; i++)
+    {
+        gint16 sample = ((i * 37) & 0x3ff) - 512;
+        *p++ = sample & 0xff;
+        *p++ = (sample >> 8) & 0xff;
+    }
+
+    return body;
+}
+
+/* Queue an audio packet for s - by handle, if the shard gave us one */
+static void queue_audio(bench_stream *s, GByteArray *to)
+{
+    int len;
+    unsigned char *body = make_body(s, &len);
+
+    imo_message *msg = s->handle ?
+        create_imo_message_around_handle('d', s->handle, body, len) :
+        create_imo_message_around('D', s->name, body, len);
+    g_byte_array_append(to, msg->text, msg->length);
+    imo_message_destroy(msg);
+}
+
+/* Queue the entries gathered so far as one 'B' message */
+static void queue_batch(void)
+{
+    if (batch_out->len)
+    {
+        queue_out('B', "", batch_out->data, batch_out->len);
+        g_byte_array_set_size(batch_out, 0);
+    }
+}
+
+/* Write as much as the socket will take. Returns -1 if the shard hung up */
+static int flush_out(void)
+{
+    while (out->len)
+    {
+        ssize_t n = write(fd, out->data, out->len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN)
+        {
+            return 0;
+        }
+        if (n <= 0)
+        {
+            perror("write");
+            return -1;
+        }
+        g_byte_array_remove_range(out, 0, n);
+    }
+
+    return 0;
+}
+
+/* Read what's waiting, and handle every complete message. Returns -1 if the
+ * shard hung up */
+static int read_in(void)
+{
+    unsigned char buf[65536];
+
+    while (TRUE)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        g_byte_array_append(in, buf, n);
+    }
+
+    guint offset = 0;
+    while (in->len - offset >= 4)
+    {
+        guint32 len_be;
+        memcpy(&len_be, in->data + offset, 4);
+        guint32 len = ntohl(len_be);
+
+        if (len < 6)
+        {
+            fprintf(stderr, "Bad message length %u\n", len);
+            return -1;
+        }
+        if (in->len - offset < len)
+        {
+            break;
+        }
+
+        unsigned char *text = malloc(len);
+        memcpy(text, in->data + offset, len);
+        offset += len;
+
+        imo_message *msg = create_imo_message_from_text(text, len);
+        handle_reply(msg);
+        imo_message_destroy(msg);
+    }
+    g_byte_array_remove_range(in, 0, offset);
+
+    return 0;
+}
+
+static void handle_reply(imo_message *msg)
+{
+    char type;
+    const char *name;
+    int name_len;
+    const unsigned char *body;
+    int body_len;
+
+    if (imo_message_peek(msg, &type, &name, &name_len, &body, &body_len))
+    {
+        fprintf(stderr, "Malformed message from the shard\n");
+        return;
+    }
+
+    bench_stream *s;
+    if (type == 'B')
+    {
+        imo_message entry;
+        int offset = 0;
+
+        while (imo_batch_next(msg, &offset, &entry) == 0)
+        {
+            handle_reply(&entry);
+        }
+        return;
+    }
+
+    if (type == 'd')
+    {
+        s = g_hash_table_lookup(stream_by_handle,
+            GUINT_TO_POINTER(imo_message_handle(msg)));
+    }
+    else
+    {
+        gchar *key = g_strndup(name, name_len);
+        s = g_hash_table_lookup(stream_by_name, key);
+        g_free(key);
+    }
+
+    if (!s)
+    {
+        /* Load reports, and the like */
+        other_replies++;
+        return;
+    }
+
+    if (type == 'S' && !s->accepted)
+    {
+        s->accepted = TRUE;
+        accepted++;
+    }
+    else if (type == 'R')
+    {
+        fprintf(stderr, "The shard turned %s down - start it with fewer "
+            "conversations, or without a shard number\n", s->name);
+        exit(1);
+    }
+    else if (type == 'H' && body_len == IMO_HANDLE_LEN)
+    {
+        guint32 handle_be;
+        memcpy(&handle_be, body, IMO_HANDLE_LEN);
+        s->handle = ntohl(handle_be);
+        g_hash_table_insert(stream_by_handle, GUINT_TO_POINTER(s->handle), s);
+    }
+    else if (type == 'P')
+    {
+        imo_start_params params;
+        decode_start_params(body, body_len, &params);
+        s->pcm_rate = params.sample_rate;
+    }
+    else if ((type == 'D' || type == 'd') && !g_queue_is_empty(&s->sent))
+    {
+        gint64 *sent = g_queue_pop_head(&s->sent);
+        long rtt = now_us() - *sent;
+        g_slice_free(gint64, sent);
+
+        rtt_counts[CLAMP(rtt, 0, RTT_BUCKETS - 1)]++;
+        replies++;
+        in_flight--;
+    }
+    else
+    {
+        other_replies++;
+    }
+}
+
+/* Send count packets, spread round robin over the streams */
+static void send_audio(int count)
+{
+    static int next = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        bench_stream *s = &streams[next];
+        next = (next + 1) % num_streams;
+
+        gint64 *sent = g_slice_new(gint64);
+        *sent = now_us();
+        g_queue_push_tail(&s->sent, sent);
+
+        if (batch_size)
+        {
+            queue_audio(s, batch_out);
+            if ((i + 1) % batch_size == 0)
+            {
+                queue_batch();
+            }
+        }
+        else
+        {
+            queue_audio(s, out);
+        }
+        in_flight++;
+    }
+
+    queue_batch();
+}
+
+static long rtt_percentile(double p)
+{
+    long target = replies * p;
+    long seen = 0;
+
+    for (int i = 0; i < RTT_BUCKETS; i++)
+    {
+        seen += rtt_counts[i];
+        if (seen > target)
+        {
+            return i;
+        }
+    }
+
+    return RTT_BUCKETS;
+}
+
+int main(int argc, char *argv[])
+{
+    int port = argc > 1 ? atoi(argv[1]) : PORTNUM;
+    int num_convs = argc > 2 ? atoi(argv[2]) : DEFAULT_CONVERSATIONS;
+    int seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+    int window = argc > 4 ? atoi(argv[4]) : DEFAULT_WINDOW;
+    with_handles = argc > 5 ? atoi(argv[5]) : 0;
+    batch_size = argc > 6 ? atoi(argv[6]) : 0;
+    with_pcm = argc > 7 ? atoi(argv[7]) : 0;
+
+    if (num_convs < 1 || seconds < 1 || window < 1)
+    {
+        fprintf(stderr, "Usage: %s [port] [conversations] [seconds] "
+            "[window] [handles] [batch] [pcm]\n", argv[0]);
+        return 1;
+    }
+
+    in = g_byte_array_new();
+    out = g_byte_array_new();
+    batch_out = g_byte_array_new();
+    rtt_counts = calloc(RTT_BUCKETS, sizeof(guint32));
+
+    fd = accept_shard(port);
+
+    /* Both sides of each conversation */
+    num_streams = num_convs * 2;
+    streams = calloc(num_streams, sizeof(bench_stream));
+    stream_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    stream_by_handle = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gchar *start_params = g_strdup_printf("%s%s",
+        with_handles ? "handles=1;" : "", with_pcm ? "pcm=1;" : "");
+    for (int i = 0; i < num_streams; i++)
+    {
+        bench_stream *s = &streams[i];
+        s->name = g_strdup_printf("bench%06d:%d", i / 2, i % 2);
+        g_queue_init(&s->sent);
+        g_hash_table_insert(stream_by_name, s->name, s);
+        queue_out('S', s->name, (unsigned char *)start_params,
+            strlen(start_params));
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+
+    gint64 start = now_us();
+    while (accepted < num_streams)
+    {
+        pfd.events = POLLIN | (out->len ? POLLOUT : 0);
+        if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return 1;
+        }
+        if (flush_out() || read_in())
+        {
+            fprintf(stderr, "The shard hung up\n");
+            return 1;
+        }
+        if (now_us() - start > START_TIMEOUT_SECS * 1000000LL)
+        {
+            fprintf(stderr, "Only %d of %d streams were accepted\n", accepted,
+                num_streams);
+            return 1;
+        }
+    }
+    printf("%d conversations started - sending audio for %d seconds, %d "
+        "packets in flight\n", num_convs, seconds, window);
+    if (with_handles)
+    {
+        printf("%u of %d streams got handles\n",
+            g_hash_table_size(stream_by_handle), num_streams);
+    }
+    if (with_pcm)
+    {
+        int pcm_streams = 0;
+        for (int i = 0; i < num_streams; i++)
+        {
+            pcm_streams += streams[i].pcm_rate ? 1 : 0;
+        }
+        printf("%d of %d streams send PCM\n", pcm_streams, num_streams);
+    }
+
+    start = now_us();
+    gint64 end = start + seconds * 1000000LL;
+    while (now_us() < end)
+    {
+        if (in_flight < window)
+        {
+            send_audio(window - in_flight);
+        }
+
+        pfd.events = POLLIN | (out->len ? POLLOUT : 0);
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return 1;
+        }
+        if (flush_out() || read_in())
+        {
+            fprintf(stderr, "The shard hung up\n");
+            return 1;
+        }
+    }
+    double elapsed = (now_us() - start) / 1E6;
+
+    printf("%ld replies in %.1fs: %.0f/s\n", replies, elapsed,
+        replies / elapsed);
+    if (replies)
+    {
+        printf("round trip (us): p50 %ld, p90 %ld, p99 %ld, p99.9 %ld\n",
+            rtt_percentile(0.5), rtt_percentile(0.9), rtt_percentile(0.99),
+            rtt_percentile(0.999));
+    }
+    if (other_replies)
+    {
+        printf("%ld other messages\n", other_replies);
+    }
+
+    /* Leave the shard as we found it */
+    for (int i = 0; i < num_streams; i++)
+    {
+        queue_out('E', streams[i].name, (unsigned char *)"", 0);
+    }
+    fcntl(fd, F_SETFL, 0);
+    flush_out();
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+/* Microbenchmark for the queues between the I/O and worker threads. Compares
+ * the lock-free ring with spin-then-park waiting against GAsyncQueue, for the
+ * return path (many producers, one consumer) and the work path (many producers,
+ * many consumers).
+ *
+ * Usage: bench_queue [messages per producer]
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "ring.h"
+
+#define DEFAULT_MESSAGES (200000)
+#define MAX_THREADS (64)
+#define RING_SIZE (65536)
+
+/// Pushed once per consumer when the producers are done
+#define STOP ((gpointer)(gsize)-1)
+
+typedef enum {
+    QUEUE_ASYNC,
+    QUEUE_RING
+} queue_kind;
+
+typedef struct bench {
+    queue_kind kind;
+    int num_producers;
+    int num_consumers;
+    int messages;               /**< Per producer */
+
+    GAsyncQueue *async;
+    ring *r;
+    parker parkers[MAX_THREADS];
+    volatile gint num_parked;
+} bench;
+
+typedef struct consumer {
+    bench *b;
+    parker *p;
+} consumer;
+
+static void bench_push(bench *b, gpointer item);
+static gpointer bench_pop(bench *b, parker *p);
+static gpointer producer_loop(gpointer data);
+static gpointer consumer_loop(gpointer data);
+static double run(queue_kind kind, int num_producers, int num_consumers,
+    int messages);
+
+static void bench_push(bench *b, gpointer item)
+{
+    if (b->kind == QUEUE_ASYNC)
+    {
+        g_async_queue_push(b->async, item);
+        return;
+    }
+
+    /* Full - let the consumers catch up */
+    while (!ring_push(b->r, item))
+    {
+        g_thread_yield();
+    }
+
+    /* Same as the workers - only go looking for a sleeper if there is one */
+    __sync_synchronize();
+    if (g_atomic_int_get(&b->num_parked))
+    {
+        for (int i = 0; i < b->num_consumers; i++)
+        {
+            if (parker_is_parked(&b->parkers[i]) &&
+                parker_unpark(&b->parkers[i]))
+            {
+                break;
+            }
+        }
+    }
+}
+
+static gpointer bench_pop(bench *b, parker *p)
+{
+    gpointer item;
+
+    if (b->kind == QUEUE_ASYNC)
+    {
+        return g_async_queue_pop(b->async);
+    }
+
+    while (TRUE)
+    {
+        for (int i = 0; i < p->spin_limit; i++)
+        {
+            if ((item = ring_pop(b->r)))
+            {
+                parker_adapt(p, TRUE);
+                return item;
+            }
+            cpu_relax();
+        }
+
+        parker_prepare(p);
+        g_atomic_int_inc(&b->num_parked);
+        if ((item = ring_pop(b->r)))
+        {
+            g_atomic_int_add(&b->num_parked, -1);
+            parker_cancel(p);
+            return item;
+        }
+        parker_adapt(p, FALSE);
+        parker_park(p);
+        g_atomic_int_add(&b->num_parked, -1);
+    }
+}
+
+static gpointer producer_loop(gpointer data)
+{
+    bench *b = data;
+
+    for (int i = 1; i <= b->messages; i++)
+    {
+        bench_push(b, GINT_TO_POINTER(i));
+    }
+
+    return NULL;
+}
+
+static gpointer consumer_loop(gpointer data)
+{
+    consumer *c = data;
+
+    while (bench_pop(c->b, c->p) != STOP)
+        ;
+
+    return NULL;
+}
+
+/* Returns millions of messages per second */
+static double run(queue_kind kind, int num_producers, int num_consumers,
+    int messages)
+{
+    bench b;
+    consumer consumers[MAX_THREADS];
+    GThread *producers[MAX_THREADS], *consumer_threads[MAX_THREADS];
+    struct timeval start, end;
+
+    b.kind = kind;
+    b.num_producers = num_producers;
+    b.num_consumers = num_consumers;
+    b.messages = messages;
+    b.async = g_async_queue_new();
+    b.r = ring_new(RING_SIZE);
+    b.num_parked = 0;
+
+    gettimeofday(&start, NULL);
+
+    for (int i = 0; i < num_consumers; i++)
+    {
+        parker_init(&b.parkers[i]);
+        consumers[i].b = &b;
+        consumers[i].p = &b.parkers[i];
+        consumer_threads[i] = g_thread_create(consumer_loop, &consumers[i],
+            TRUE, NULL);
+    }
+    for (int i = 0; i < num_producers; i++)
+    {
+        producers[i] = g_thread_create(producer_loop, &b, TRUE, NULL);
+    }
+
+    for (int i = 0; i < num_producers; i++)
+    {
+        g_thread_join(producers[i]);
+    }
+    for (int i = 0; i < num_consumers; i++)
+    {
+        bench_push(&b, STOP);
+    }
+    for (int i = 0; i < num_consumers; i++)
+    {
+        g_thread_join(consumer_threads[i]);
+    }
+
+    gettimeofday(&end, NULL);
+
+    double secs = (end.tv_sec - start.tv_sec) +
+        (end.tv_usec - start.tv_usec) / 1e6;
+
+    g_async_queue_unref(b.async);
+    ring_free(b.r);
+
+    return ((double)num_producers * messages) / secs / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    int messages = DEFAULT_MESSAGES;
+
+    g_thread_init(NULL);
+
+    if (argc > 1)
+    {
+        messages = atoi(argv[1]);
+    }
+    if (messages <= 0)
+    {
+        fprintf(stderr, "Usage: %s [messages per producer]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%d messages per producer, Mmsg/s\n\n", messages);
+
+    printf("Return path (N producers, 1 consumer)\n");
+    printf("%8s %12s %12s\n", "threads", "GAsyncQueue", "ring");
+    for (int n = 1; n <= MAX_THREADS; n *= 2)
+    {
+        printf("%8d %12.2f %12.2f\n", n,
+            run(QUEUE_ASYNC, n, 1, messages),
+            run(QUEUE_RING, n, 1, messages));
+    }
+
+    printf("\nWork path (N producers, N consumers)\n");
+    printf("%8s %12s %12s\n", "threads", "GAsyncQueue", "ring");
+    for (int n = 1; n <= MAX_THREADS; n *= 2)
+    {
+        printf("%8d %12.2f %12.2f\n", n,
+            run(QUEUE_ASYNC, n, n, messages),
+            run(QUEUE_RING, n, n, messages));
+    }
+
+    return 0;
+}
@@ -5,6 +5,7 @@
 
 #include "cbuffer.h"
 #include "kodama.h"
+#include "ring.h"
 
 CBuffer *cbuffer_init(size_t capacity)
 {
@@ -137,6 +138,89 @@ void cbuffer_push_bulk(CBuffer *cb, SAMPLE_BLOCK *sb)
     }
 }
 
+SampleRing *sample_ring_init(size_t capacity)
+{
+    SampleRing *r = malloc(sizeof(SampleRing));
+    size_t size = 2;
+
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    r->buf = malloc(size * sizeof(SAMPLE));
+    r->mask = size - 1;
+    r->head = 0;
+    r->tail = 0;
+
+    return r;
+}
+
+void sample_ring_destroy(SampleRing *r)
+{
+    g_return_if_fail(r != NULL);
+
+    free(r->buf);
+    free(r);
+}
+
+/* Returns the number of samples pushed - fewer than sb->count if the consumer
+ * has fallen too far behind */
+size_t sample_ring_push_bulk(SampleRing *r, const SAMPLE_BLOCK *sb)
+{
+    size_t head = r->head;
+    size_t tail = r->tail;
+    ACQUIRE_BARRIER();
+
+    size_t free_count = (r->mask + 1) - (head - tail);
+    size_t count = MIN(sb->count, free_count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        r->buf[(head + i) & r->mask] = sb->s[i];
+    }
+
+    /* Samples must be in place before the consumer can see them */
+    RELEASE_BARRIER();
+    r->head = head + count;
+
+    return count;
+}
+
+size_t sample_ring_get_count(SampleRing *r)
+{
+    size_t head = r->head;
+    ACQUIRE_BARRIER();
+
+    return head - r->tail;
+}
+
+/* Returns the number of samples copied to out */
+size_t sample_ring_read(SampleRing *r, SAMPLE *out, size_t count)
+{
+    size_t tail = r->tail;
+    count = MIN(count, sample_ring_get_count(r));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = r->buf[(tail + i) & r->mask];
+    }
+
+    /* Done reading before the producer can reuse the space */
+    RELEASE_BARRIER();
+    r->tail = tail + count;
+
+    return count;
+}
+
+void sample_ring_skip(SampleRing *r, size_t count)
+{
+    count = MIN(count, sample_ring_get_count(r));
+
+    RELEASE_BARRIER();
+    r->tail += count;
+}
+
 SAMPLE_BLOCK *sample_block_create(size_t count)
 {
     SAMPLE_BLOCK *sb = malloc(sizeof(SAMPLE_BLOCK));
@@ -17,6 +17,19 @@ typedef struct CBuffer
 } CBuffer;
 
 
+/// Lock-free queue of samples from exactly one producer thread to exactly one
+/// consumer thread. Unlike a CBuffer, a full ring drops the newest samples -
+/// the producer can't move the consumer's tail.
+typedef struct SampleRing
+{
+    SAMPLE *buf;
+    size_t mask;                /**< capacity - 1 */
+    volatile size_t head;       /**< Written only by the producer */
+    char pad[64];               /**< Keep head and tail on separate lines */
+    volatile size_t tail;       /**< Written only by the consumer */
+} SampleRing;
+
+
 /// Holds a block of samples and associated context information.
 typedef struct SAMPLE_BLOCK
 {
@@ -40,6 +53,18 @@ void cbuffer_push_bulk(CBuffer *cb, SAMPLE_BLOCK *sb);
 SAMPLE_BLOCK *cbuffer_get_samples(CBuffer *cb, size_t count);
 SAMPLE_BLOCK *cbuffer_peek_samples(CBuffer *cb, size_t count);
 
+/* SampleRing methods */
+SampleRing *sample_ring_init(size_t capacity);
+void sample_ring_destroy(SampleRing *r);
+
+/* Producer only */
+size_t sample_ring_push_bulk(SampleRing *r, const SAMPLE_BLOCK *sb);
+
+/* Consumer only */
+size_t sample_ring_get_count(SampleRing *r);
+size_t sample_ring_read(SampleRing *r, SAMPLE *out, size_t count);
+void sample_ring_skip(SampleRing *r, size_t count);
+
 /* SAMPLE_BLOCK methods */
 SAMPLE_BLOCK *sample_block_create(size_t count);
 void sample_block_destroy(SAMPLE_BLOCK *sb);
@@ -1,69 +1,153 @@
 #include <glib.h>
+#include <string.h>
 #include <sys/time.h>
 
+#include "admission.h"
 #include "cbuffer.h"
 #include "conversation.h"
+#include "echo.h"
+#include "epoch.h"
 #include "flv.h"
 #include "hybrid.h"
+#include "imo_message.h"
 #include "kodama.h"
+#include "pcm.h"
 #include "util.h"
 
-GHashTable *id_to_conv = NULL;
+/// Number of chains in the stream table. It never resizes, so readers can
+/// walk it without a lock
+#define STREAM_TABLE_SIZE (8192)
+
+#define STREAM_HANDLE_SLOT_MASK (MAX_STREAMS - 1)
+
+/// The format of a packet which came as raw PCM. Not a byte, so it's never
+/// mistaken for an FLV format byte
+#define FORMAT_PCM (0x100)
+
+/// Stream sides by full stream name. Readers walk the chains inside an epoch
+/// critical section; a conversation is freed only after every reader has left
+static ConvSide *volatile stream_table[STREAM_TABLE_SIZE];
+
+/// What each stream handle's slot currently holds
+typedef struct stream_slot {
+    ConvSide *volatile side;     /**< NULL if free */
+    guint generation;            /**< Bumped each time the slot is reused */
+} stream_slot;
+
+static stream_slot stream_slots[MAX_STREAMS];
+/// Slots not in use. Protected by the stream_table lock
+static int free_slots[MAX_STREAMS];
+static int num_free_slots = 0;
+
+/// Runs the stages of pipelined packets. NULL unless --pipeline is on
+static GThreadPool *stage_pool = NULL;
+
+/// A packet on its way through the pipeline. Holds a reference on its
+/// conversation until it's done
+typedef struct stage_job {
+    ConvSide *side;
+    const unsigned char *flv_data;
+    int flv_len;
+    int format;                  /**< Format the samples were decoded from -
+                                      an FLV format byte, or FORMAT_PCM */
+    SAMPLE_BLOCK *sb;
+    long busy_us;                /**< Time spent in stages so far */
+    uint64_t busy_cycles;        /**< Cycles spent in stages so far */
+    conversation_done_fn done;
+    gpointer item;
+} stage_job;
+
 /// Messages arriving for these aren't necessarily an error
 GHashTable *closed_conversations = NULL;
 
 extern globals_t globals;
 extern stats_t stats;
 
-GStaticRWLock id_to_conv_rwlock = G_STATIC_RW_LOCK_INIT;
-
+/// Serializes changes to stream_table and stream_slots - readers never take it
+G_LOCK_DEFINE_STATIC(stream_table);
 G_LOCK_DEFINE(closed_conversations); /* TODO: make this a rwlock */
 G_LOCK_EXTERN(stats);
 
-static Conversation *conversation_create(void);
+static Conversation *conversation_create(const char *id);
 static void conversation_destroy(Conversation *c);
+static void conversation_reclaim(gpointer data);
+static void conversation_unref(Conversation *c);
+static guint stream_name_hash(const char *name, size_t name_len);
+static ConvSide *stream_table_lookup(const char *name, size_t name_len);
+static void stream_table_insert(ConvSide *side);
+static void stream_table_remove(ConvSide *side);
+static gboolean stream_handle_assign(ConvSide *side);
+static void stream_handle_release(ConvSide *side);
+static ConvSide *stream_handle_resolve(stream_handle h);
+static int choose_sample_rate(int codec_rate);
+static void conversation_set_sample_rate(Conversation *c, int sample_rate);
+static int conversation_decode(ConvSide *side, const unsigned char *flv_data,
+    int flv_len, SAMPLE_BLOCK **sb, int *format);
+static int conversation_encode(ConvSide *side, int format, SAMPLE_BLOCK *sb,
+    unsigned char **packet, int *packet_len);
 static void conversation_process_samples(Conversation *c, int conv_side,
     SAMPLE_BLOCK *sb);
-static Conversation *find_conv_for_stream(const char *stream_name,
-        int *conv_side);
-static Conversation *find_conv_for_stream_nolock(const char *stream_name,
-        int *conv_side);
-static gboolean conv_is_closed(const char *stream_name);
+static void stage_pool_func(gpointer data, gpointer user_data);
+static void stage_decode(gpointer item);
+static void stage_cancel(gpointer item);
+static void stage_encode(gpointer item);
+static void stage_finish(stage_job *job, int ret, unsigned char *flv_packet,
+    int flv_len);
+static gboolean conv_is_closed(const char *stream_name, size_t name_len);
 
 void init_conversations(void)
 {
-    g_static_rw_lock_writer_lock(&id_to_conv_rwlock);
-    id_to_conv = g_hash_table_new_full(g_str_hash, g_str_equal,
-            g_free,
-            /* We don't put the destroy function here - explained below */
-            NULL);
-    g_static_rw_lock_writer_unlock(&id_to_conv_rwlock);
-
     G_LOCK(closed_conversations);
     closed_conversations = g_hash_table_new_full(g_str_hash, g_str_equal,
             g_free, NULL);
     G_UNLOCK(closed_conversations);
+
+    G_LOCK(stream_table);
+    /* Hand out low slots first */
+    for (int i = 0; i < MAX_STREAMS; i++)
+    {
+        stream_slots[i].side = NULL;
+        stream_slots[i].generation = 0;
+        free_slots[i] = MAX_STREAMS - 1 - i;
+    }
+    num_free_slots = MAX_STREAMS;
+    G_UNLOCK(stream_table);
 }
 
-static Conversation *conversation_create(void)
+static Conversation *conversation_create(const char *id)
 {
     Conversation *c = malloc(sizeof(Conversation));
 
-    c->h0 = hybrid_new();
-    c->h1 = hybrid_new();
+    c->id = g_strdup(id);
+    c->hash = imo_conversation_hash(id, strlen(id));
 
-    hybrid_setup_echo_cancel(c->h0);
-    hybrid_setup_echo_cancel(c->h1);
+    for (int i = 0; i < 2; i++)
+    {
+        ConvSide *side = &c->sides[i];
+
+        side->conv = c;
+        side->side = i;
+        side->stream_name = g_strdup_printf("%s:%d", id, i);
+        side->name_len = strlen(side->stream_name);
+        side->handle = STREAM_HANDLE_NONE;
+        side->pcm = FALSE;
+        side->strand = strand_new();
+        side->decode_strand = strand_new();
+        side->encode_strand = strand_new();
+        side->next = NULL;
+
+        flv_start_stream(&side->flv);
+    }
 
-    c->h0->tx_cb_fn = NULL;
-    c->h0->rx_cb_fn = NULL;
+    /* The hybrids (and their echo cancelers) are sized by sample rate, which
+     * we may not know until the first audio packet arrives */
+    c->h0 = NULL;
+    c->h1 = NULL;
+    c->sample_rate = 0;
 
-    c->h1->tx_cb_fn = NULL;
-    c->h1->rx_cb_fn = NULL;
+    c->rate_mutex = g_mutex_new();
 
-    c->c0_mutex = g_mutex_new();
-    c->c1_mutex = g_mutex_new();
-    c->echo_mutex = g_mutex_new();
+    c->refs = 1;
 
     return c;
 }
@@ -72,206 +156,633 @@ static void conversation_destroy(Conversation *c)
 {
     g_return_if_fail(c != NULL);
 
-    hybrid_destroy(c->h0);
-    hybrid_destroy(c->h1);
+    if (c->h0)
+    {
+        hybrid_destroy(c->h0);
+        hybrid_destroy(c->h1);
+    }
 
-    g_mutex_free(c->c0_mutex);
-    g_mutex_free(c->c1_mutex);
-    g_mutex_free(c->echo_mutex);
+    for (int i = 0; i < 2; i++)
+    {
+        flv_end_stream(&c->sides[i].flv);
+        strand_free(c->sides[i].strand);
+        strand_free(c->sides[i].decode_strand);
+        strand_free(c->sides[i].encode_strand);
+        g_free(c->sides[i].stream_name);
+    }
+    g_mutex_free(c->rate_mutex);
 
+    g_free(c->id);
     free(c);
 }
 
-void conversation_start(const char *stream_name)
+/* Tear down a conversation once no reader can still be using it */
+static void conversation_reclaim(gpointer data)
+{
+    conversation_destroy(data);
+}
+
+/* Drop a reference. The last one hands the conversation to the epoch code,
+ * since readers which found it before it ended may still be using it */
+static void conversation_unref(Conversation *c)
 {
-    gchar **conv_and_num = g_strsplit(stream_name, ":", 2);
+    if (g_atomic_int_dec_and_test(&c->refs))
+    {
+        epoch_defer(conversation_reclaim, c);
+    }
+}
 
-    g_static_rw_lock_writer_lock(&id_to_conv_rwlock);
-    Conversation *c = g_hash_table_lookup(id_to_conv, conv_and_num[0]);
+/* Same as g_str_hash, but over the first name_len bytes only */
+static guint stream_name_hash(const char *name, size_t name_len)
+{
+    guint h = 5381;
 
-    /* This will be called once per participant in a conversation -- only create
-     * one the first time */
-    if (!c)
+    for (size_t i = 0; i < name_len; i++)
     {
-        c = conversation_create();
+        h = (h << 5) + h + (unsigned char)name[i];
+    }
 
-        gchar *stream_name_0, *stream_name_1;
+    return h;
+}
 
-        stream_name_0 = g_strdup_printf("%s:%d", conv_and_num[0], 0);
-        stream_name_1 = g_strdup_printf("%s:%d", conv_and_num[0], 1);
+/* Must be called inside an epoch critical section, or holding the
+ * stream_table lock */
+static ConvSide *stream_table_lookup(const char *name, size_t name_len)
+{
+    ConvSide *side = g_atomic_pointer_get(
+        &stream_table[stream_name_hash(name, name_len) % STREAM_TABLE_SIZE]);
 
-        hybrid_set_name(c->h0, stream_name_0);
-        hybrid_set_name(c->h1, stream_name_1);
+    for (; side; side = g_atomic_pointer_get(&side->next))
+    {
+        if (side->name_len == name_len &&
+            memcmp(side->stream_name, name, name_len) == 0)
+        {
+            return side;
+        }
+    }
 
-        /* Debugging only - shortcircuit audio directly to hardware */
-        /* c->h0->tx_cb_fn = shortcircuit_tx_to_rx; */
-        /* setup_hw_out(c->h0); */
+    return NULL;
+}
 
-        flv_start_stream(stream_name_0);
-        flv_start_stream(stream_name_1);
+/* Must be called holding the stream_table lock. The conversation must be fully
+ * constructed - readers can find it as soon as it's linked in */
+static void stream_table_insert(ConvSide *side)
+{
+    ConvSide *volatile *head = &stream_table[stream_name_hash(
+        side->stream_name, side->name_len) % STREAM_TABLE_SIZE];
 
-        g_free(stream_name_0);
-        g_free(stream_name_1);
+    side->next = *head;
+    g_atomic_pointer_set(head, side);
+}
+
+/* Must be called holding the stream_table lock. Readers already walking the
+ * chain may still reach the removed side, so it can't be freed until they're
+ * done - see epoch_defer() */
+static void stream_table_remove(ConvSide *side)
+{
+    ConvSide *volatile *prev = &stream_table[stream_name_hash(
+        side->stream_name, side->name_len) % STREAM_TABLE_SIZE];
 
-        g_hash_table_insert(id_to_conv, g_strdup(conv_and_num[0]), c);
+    for (ConvSide *s = *prev; s; prev = &s->next, s = s->next)
+    {
+        if (s == side)
+        {
+            /* Leave side->next alone - a reader on side still needs it to get
+             * to the rest of the chain */
+            g_atomic_pointer_set(prev, side->next);
+            return;
+        }
     }
-    g_static_rw_lock_writer_unlock(&id_to_conv_rwlock);
+}
 
-    g_strfreev(conv_and_num);
+/* Must be called holding the stream_table lock */
+static gboolean stream_handle_assign(ConvSide *side)
+{
+    if (!num_free_slots)
+    {
+        return FALSE;
+    }
+
+    int slot = free_slots[--num_free_slots];
+    stream_slot *s = &stream_slots[slot];
+
+    /* Generation 0 would let the handle come out as STREAM_HANDLE_NONE */
+    s->generation = (s->generation + 1) &
+        (G_MAXUINT32 >> STREAM_HANDLE_SLOT_BITS);
+    if (!s->generation)
+    {
+        s->generation = 1;
+    }
+
+    side->handle = (s->generation << STREAM_HANDLE_SLOT_BITS) | slot;
+    g_atomic_pointer_set(&s->side, side);
+
+    return TRUE;
 }
 
-void conversation_end(const char *stream_name)
+/* Must be called holding the stream_table lock. Old handles stop resolving
+ * right away, but the slot may be reused at once - the new owner's handle has
+ * a different generation */
+static void stream_handle_release(ConvSide *side)
 {
-    gchar **conv_and_num = g_strsplit(stream_name, ":", 2);
+    int slot = side->handle & STREAM_HANDLE_SLOT_MASK;
+
+    g_atomic_pointer_set(&stream_slots[slot].side, NULL);
+    free_slots[num_free_slots++] = slot;
+}
 
-    /* TODO: fix these comments to deal with separate mutexes */
+/* Must be called inside an epoch critical section */
+static ConvSide *stream_handle_resolve(stream_handle h)
+{
+    ConvSide *side = g_atomic_pointer_get(
+        &stream_slots[h & STREAM_HANDLE_SLOT_MASK].side);
 
-    /* If one side of the conversation is processing samples, and we try to
-     * destroy the conversation via other side, we free the mutex while another
-     * thread holds it. This is bad.
-     *
-     * So instead, we remove the conversation from the hash table so no other
-     * thread can find it, including another 'E' message. We then acquire and
-     * release its lock. Once we do, we can immediately free it without worrying
-     * that another thread will grab it again */
+    /* The handle is stale if the slot has moved on to another stream. The
+     * side can't be freed while we're in the critical section, so reading its
+     * handle is safe even if it has just been released */
+    if (!side || side->handle != h)
+    {
+        return NULL;
+    }
 
-    g_static_rw_lock_writer_lock(&id_to_conv_rwlock);
-    Conversation *c = g_hash_table_lookup(id_to_conv, conv_and_num[0]);
-    g_hash_table_remove(id_to_conv, conv_and_num[0]);
-    g_static_rw_lock_writer_unlock(&id_to_conv_rwlock);
+    return side;
+}
 
-    if(c)
+/* Pick the rate to echo-cancel at, given the native rate of a client's
+ * codec. If the codec runs slower than our default, cancel at its rate - we
+ * need fewer taps, and both resampling passes go away. */
+static int choose_sample_rate(int codec_rate)
+{
+    if (codec_rate > 0 && codec_rate < globals.sample_rate &&
+        echo_params_valid(codec_rate, globals.echo_path))
+    {
+        return codec_rate;
+    }
+
+    return globals.sample_rate;
+}
+
+/* Set up the echo-cancellation side of a conversation once we know which rate
+ * to run at. Only the first call has any effect. */
+static void conversation_set_sample_rate(Conversation *c, int sample_rate)
+{
+    /* Both sides feed each other's echo cancelers, so they have to agree on a
+     * rate - whichever side gets here first decides */
+    g_mutex_lock(c->rate_mutex);
+
+    if (!c->sample_rate)
+    {
+        VERBOSE_LOG("Conversation %s will echo-cancel at %d Hz\n", c->id,
+            sample_rate);
+
+        c->h0 = hybrid_new(sample_rate);
+        c->h1 = hybrid_new(sample_rate);
+
+        hybrid_set_name(c->h0, c->sides[0].stream_name);
+        hybrid_set_name(c->h1, c->sides[1].stream_name);
+
+        hybrid_setup_echo_cancel(c->h0);
+        hybrid_setup_echo_cancel(c->h1);
+
+        c->h0->tx_cb_fn = NULL;
+        c->h0->rx_cb_fn = NULL;
+
+        c->h1->tx_cb_fn = NULL;
+        c->h1->rx_cb_fn = NULL;
+
+        /* Neither side can have decoded any audio yet, since they'd have had
+         * to come through here first - so it's safe to touch the other side's
+         * FLVStream from off its strand. Publishing sample_rate below makes
+         * this visible before that side decodes anything */
+        flv_set_sample_rate(&c->sides[0].flv, sample_rate);
+        flv_set_sample_rate(&c->sides[1].flv, sample_rate);
+
+        /* Publish this last - r() checks it without holding rate_mutex */
+        g_atomic_int_set(&c->sample_rate, sample_rate);
+    }
+
+    g_mutex_unlock(c->rate_mutex);
+}
+
+int conversation_start(const char *stream_name, int sample_rate)
+{
+    size_t id_len = strcspn(stream_name, ":");
+    gchar *id = g_strndup(stream_name, id_len);
+    gchar *stream_name_0 = g_strdup_printf("%s:%d", id, 0);
+
+    epoch_enter();
+    ConvSide *side = stream_table_lookup(stream_name_0, strlen(stream_name_0));
+    Conversation *c = side ? side->conv : NULL;
+
+    /* This will be called once per participant in a conversation -- only create
+     * one the first time. Build it before taking the table lock, so starting a
+     * conversation never holds anyone up */
+    if (!c && !admission_admit())
+    {
+        /* Only a new conversation costs us anything */
+        g_debug("No room for conversation %s", id);
+    }
+    else if (!c)
+    {
+        Conversation *fresh = conversation_create(id);
+
+        /* Debugging only - shortcircuit audio directly to hardware */
+        /* c->h0->tx_cb_fn = shortcircuit_tx_to_rx; */
+        /* setup_hw_out(c->h0); */
+
+        G_LOCK(stream_table);
+        side = stream_table_lookup(stream_name_0, strlen(stream_name_0));
+        c = side ? side->conv : NULL;
+        if (!c)
+        {
+            if (stream_handle_assign(&fresh->sides[0]))
+            {
+                if (stream_handle_assign(&fresh->sides[1]))
+                {
+                    stream_table_insert(&fresh->sides[0]);
+                    stream_table_insert(&fresh->sides[1]);
+                    c = fresh;
+                    fresh = NULL;
+                }
+                else
+                {
+                    stream_handle_release(&fresh->sides[0]);
+                }
+            }
+        }
+        G_UNLOCK(stream_table);
+
+        /* Either someone beat us to it, or we're out of handles. Nobody else
+         * has seen ours, so we can free it right away */
+        if (fresh)
+        {
+            if (!c)
+            {
+                g_warning("Too many streams - not starting conversation %s",
+                    id);
+            }
+            conversation_destroy(fresh);
+            admission_release();
+        }
+    }
+
+    /* The client told us its rate up front - no need to wait for audio */
+    if (c && sample_rate > 0)
     {
-        gchar *stream_name_0, *stream_name_1;
+        conversation_set_sample_rate(c, choose_sample_rate(sample_rate));
+    }
+    epoch_exit();
+
+    g_free(stream_name_0);
+    g_free(id);
 
-        stream_name_0 = g_strdup_printf("%s:%d", conv_and_num[0], 0);
-        stream_name_1 = g_strdup_printf("%s:%d", conv_and_num[0], 1);
+    return c ? 0 : -1;
+}
 
-        g_mutex_lock(c->c0_mutex);
-        g_mutex_lock(c->c1_mutex);
+int conversation_use_pcm(const char *stream_name)
+{
+    int sample_rate = 0;
 
-        /* TODO: do we need to acquire the echo mutex? Probably not, since it
-         * can't be held without holding c0 or c1 */
+    epoch_enter();
+    ConvSide *side = stream_table_lookup(stream_name, strlen(stream_name));
+    if (side)
+    {
+        /* The client has to know the rate before it sends anything. If the
+         * conversation has one already, this does nothing */
+        conversation_set_sample_rate(side->conv, globals.sample_rate);
+        sample_rate = g_atomic_int_get(&side->conv->sample_rate);
+        g_atomic_int_set(&side->pcm, TRUE);
+    }
+    epoch_exit();
 
-        g_mutex_unlock(c->c1_mutex);
-        g_mutex_unlock(c->c0_mutex);
+    return sample_rate;
+}
 
-        flv_end_stream(stream_name_0);
-        flv_end_stream(stream_name_1);
+void conversation_end(const char *stream_name)
+{
+    size_t id_len = strcspn(stream_name, ":");
 
-        g_free(stream_name_0);
-        g_free(stream_name_1);
+    /* If one side of the conversation is processing samples, and we try to
+     * destroy the conversation via other side, we free it out from under the
+     * thread running that side's strand. This is bad.
+     *
+     * So instead, we remove the conversation from the table so no other
+     * thread can find it, including another 'E' message, and retire its
+     * handles. Anyone who found it before that is inside an epoch critical
+     * section until they're done with it - including everything queued on its
+     * strands - so we leave freeing it to the epoch code, once they've all
+     * left. Pipelined packets hold a reference instead, since they wait
+     * between stages outside any critical section. Anything submitted after
+     * this fails to find the conversation, and is reflected */
+
+    G_LOCK(stream_table);
+    ConvSide *side = stream_table_lookup(stream_name, strlen(stream_name));
+    Conversation *c = side ? side->conv : NULL;
+    if (c)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            stream_table_remove(&c->sides[i]);
+            stream_handle_release(&c->sides[i]);
+        }
+    }
+    G_UNLOCK(stream_table);
 
-        conversation_destroy(c);
+    if(c)
+    {
+        /* The stream table's reference */
+        conversation_unref(c);
+        admission_release();
 
         /* If c still existed, this must be the first 'E' message for the
          * conversation. Mark the conversation as closed so further messages
          * about this conversation don't cause error messages */
         G_LOCK(closed_conversations);
-        g_hash_table_insert(closed_conversations, g_strdup(conv_and_num[0]),
-                NULL);
+        g_hash_table_insert(closed_conversations,
+                g_strndup(stream_name, id_len), NULL);
         G_UNLOCK(closed_conversations);
     }
     else
     {
         /* No conversation existed - this is most likely the second 'E' message
          * for this conversation. Remove it from closed_conversations */
+        gchar *id = g_strndup(stream_name, id_len);
         G_LOCK(closed_conversations);
-        gboolean found = g_hash_table_remove(closed_conversations,
-                conv_and_num[0]);
+        gboolean found = g_hash_table_remove(closed_conversations, id);
         G_UNLOCK(closed_conversations);
         if (!found)
         {
-            g_warning("Received a second 'E' message for %s, but conv not found in closed_conversations", conv_and_num[0]);
+            g_warning("Received a second 'E' message for %s, but conv not found in closed_conversations", id);
         }
+        g_free(id);
     }
-    g_strfreev(conv_and_num);
 }
 
-int r(const char *stream_name, const unsigned char *flv_data, int flv_len,
-    unsigned char **return_flv_packet, int *return_flv_len)
+stream_handle conversation_find_stream(const char *stream_name, int name_len)
 {
-    struct timeval start, end;
-    struct timeval t1, t2;
-    uint64_t before_cycles, end_cycles;
-    long d_us;
+    epoch_enter();
+    ConvSide *side = stream_table_lookup(stream_name, name_len);
+    stream_handle h = side ? side->handle : STREAM_HANDLE_NONE;
+    epoch_exit();
+
+    /* Maybe the conversation was recently closed. Otherwise its 'S' was
+     * turned away, or never came - either way, one note a packet is plenty,
+     * and the drop is counted */
+    if (h == STREAM_HANDLE_NONE && !conv_is_closed(stream_name, name_len))
+    {
+        g_debug("Conversation not found for stream %.*s", name_len,
+            stream_name);
+    }
 
-    SAMPLE_BLOCK *sb = NULL;
+    return h;
+}
 
-    gettimeofday(&start, NULL);
-    before_cycles = cycles();
+int conversation_submit(stream_handle h, strand_fn fn, gpointer item)
+{
+    epoch_enter();
 
-    int conv_side;
+    /* No warning - the conversation just ended since the handle was looked
+     * up */
+    ConvSide *side = stream_handle_resolve(h);
+    if (!side)
+    {
+        epoch_exit();
+        return -1;
+    }
 
-    gettimeofday(&t1, NULL);
-    g_static_rw_lock_reader_lock(&id_to_conv_rwlock);
-    gettimeofday(&t2, NULL);
+    /* Stay in the critical section while we run the strand - the conversation
+     * can't be freed until we leave it. If we queue behind another thread
+     * instead, that thread is in its own critical section until it has run our
+     * item */
+    if (strand_enqueue(side->strand, fn, item))
+    {
+        strand_run(side->strand, fn, item);
+    }
 
-    d_us = delta(&t1, &t2);
+    epoch_exit();
 
-    Conversation *c = find_conv_for_stream_nolock(stream_name, &conv_side);
+    return 0;
+}
 
-    /* This log message comes after find_conv_for_stream_nolock just so
-     * conv_side is set properly - that call isn't included in the timing
-     * data */
-    /* VERBOSE_LOG("C: Time to acquire id_to_conv rwlock (reader) for side %d: %li\n", */
-    /*         conv_side, d_us); */
-    if (!c)
+void conversation_start_pipeline(int num_threads)
+{
+    if (stage_pool)
     {
-        g_static_rw_lock_reader_unlock(&id_to_conv_rwlock);
+        return;
+    }
 
-        /* Maybe the conversation was recently closed */
-        if (!conv_is_closed(stream_name))
-        {
-            g_warning("Conversation not found for stream %s", stream_name);
-        }
+    g_debug("Running decode, cancel and encode stages on %d threads",
+        num_threads);
+    stage_pool = g_thread_pool_new(stage_pool_func, NULL, num_threads, TRUE,
+        NULL);
+}
+
+void conversation_resize_pipeline(int num_threads)
+{
+    g_return_if_fail(stage_pool != NULL);
+
+    g_thread_pool_set_max_threads(stage_pool, num_threads, NULL);
+}
+
+int conversation_pipeline(stream_handle h, const unsigned char *flv_data,
+    int flv_len, conversation_done_fn done, gpointer item)
+{
+    g_return_val_if_fail(stage_pool != NULL, -1);
+
+    epoch_enter();
+
+    ConvSide *side = stream_handle_resolve(h);
+    if (!side)
+    {
+        epoch_exit();
         return -1;
     }
 
-    /* Try for a mutex for just our side of the conversation for now */
-    GMutex *conv_side_mutex = (conv_side == 0) ? c->c0_mutex : c->c1_mutex;
+    /* The conversation can't have been reclaimed yet, since we're in the
+     * critical section, so its count is still above zero. Once we leave, this
+     * reference keeps it alive until the packet is done */
+    g_atomic_int_inc(&side->conv->refs);
+
+    stage_job *job = g_slice_new(stage_job);
+    job->side = side;
+    job->flv_data = flv_data;
+    job->flv_len = flv_len;
+    job->format = 0;
+    job->sb = NULL;
+    job->busy_us = 0;
+    job->busy_cycles = 0;
+    job->done = done;
+    job->item = item;
+
+    strand_post(side->decode_strand, stage_decode, job, stage_pool);
+
+    epoch_exit();
+
+    return 0;
+}
+
+/* Stages run inside an epoch critical section. A stage which drops the last
+ * reference on its conversation is still running on one of its strands, and
+ * strand_run() touches the strand once the stage returns */
+static void stage_pool_func(gpointer data, gpointer user_data)
+{
+    epoch_enter();
+    strand_pool_func(data, user_data);
+    epoch_exit();
+}
+
+/* Runs on the side's decode strand */
+static void stage_decode(gpointer item)
+{
+    stage_job *job = item;
+    ConvSide *side = job->side;
+    struct timeval start, end;
+
+    gettimeofday(&start, NULL);
+    uint64_t before_cycles = cycles();
+    /* The format is read now - by the time we get to encoding, the next
+     * packet may have changed the stream's */
+    int ret = conversation_decode(side, job->flv_data, job->flv_len, &job->sb,
+        &job->format);
+    job->busy_cycles += cycles() - before_cycles;
+    gettimeofday(&end, NULL);
+    job->busy_us += delta(&start, &end);
+
+    if (ret)
+    {
+        stage_finish(job, ret, NULL, 0);
+        return;
+    }
+
+    strand_post(side->strand, stage_cancel, job, stage_pool);
+}
+
+/* Runs on the side's strand - the only stage that touches echo state */
+static void stage_cancel(gpointer item)
+{
+    stage_job *job = item;
+    ConvSide *side = job->side;
+    struct timeval start, end;
+
+    gettimeofday(&start, NULL);
+    uint64_t before_cycles = cycles();
+    conversation_process_samples(side->conv, side->side, job->sb);
+    job->busy_cycles += cycles() - before_cycles;
+    gettimeofday(&end, NULL);
+    job->busy_us += delta(&start, &end);
+
+    strand_post(side->encode_strand, stage_encode, job, stage_pool);
+}
+
+/* Runs on the side's encode strand */
+static void stage_encode(gpointer item)
+{
+    stage_job *job = item;
+    ConvSide *side = job->side;
+    struct timeval start, end;
+    unsigned char *flv_packet = NULL;
+    int flv_len = 0;
 
-    gboolean got_lock = g_mutex_trylock(conv_side_mutex);
-    g_static_rw_lock_reader_unlock(&id_to_conv_rwlock);
+    gettimeofday(&start, NULL);
+    uint64_t before_cycles = cycles();
+    int ret = conversation_encode(side, job->format, job->sb, &flv_packet,
+        &flv_len);
+    job->busy_cycles += cycles() - before_cycles;
+    gettimeofday(&end, NULL);
+    job->busy_us += delta(&start, &end);
 
-    if (!got_lock)
+    if (ret)
     {
-        /* TODO: fix these comments to deal with the new 2-mutex system */
+        imo_body_free(flv_packet);
+        flv_packet = NULL;
+        flv_len = 0;
+    }
+    else
+    {
+        G_LOCK(stats);
+        stats.samples_processed += job->sb->count;
+        stats.total_samples_processed += job->sb->count;
+        stats.total_us += job->busy_us;
+        stats.total_cycles += job->busy_cycles;
+        G_UNLOCK(stats);
+    }
+
+    stage_finish(job, ret, flv_packet, flv_len);
+}
+
+static void stage_finish(stage_job *job, int ret, unsigned char *flv_packet,
+    int flv_len)
+{
+    Conversation *c = job->side->conv;
+
+    sample_block_destroy(job->sb);
+    job->done(job->item, ret, flv_packet, flv_len);
+    g_slice_free(stage_job, job);
+
+    conversation_unref(c);
+}
 
-        /* c exists, but we couldn't immediately get its mutex. Someone else is
-         * using c, possibly deleting it. If they're deleting it, we don't want
-         * to wait around for its mutex to become free, so we tell our caller to
-         * try again -- next time they try, c might be free or not exist */
+guint conversation_hash(stream_handle h)
+{
+    epoch_enter();
+    ConvSide *side = stream_handle_resolve(h);
+    guint hash = side ? side->conv->hash : 0;
+    epoch_exit();
 
-        /* TODO: if the thread holding this lock crashes for some reason, c will
-         * never become available, and all threads might eventually end up
-         * waiting on it. If no thread can make progress towards acquiring
-         * c->mutex for some amount of time, we might want to forcibly remove
-         * c */
-        /* VERBOSE_LOG("C: Failed to get conv lock for side %d\n", conv_side); */
-        return LOCK_FAILURE;
+    return hash;
+}
+
+gchar *conversation_stream_name(stream_handle h)
+{
+    /* Copied before we leave the critical section - the conversation may be
+     * ended and freed as soon as we do */
+    epoch_enter();
+    ConvSide *side = stream_handle_resolve(h);
+    gchar *stream_name = side ? g_strdup(side->stream_name) : NULL;
+    epoch_exit();
+
+    return stream_name;
+}
+
+int r(stream_handle h, const unsigned char *flv_data, int flv_len,
+    unsigned char **return_flv_packet, int *return_flv_len)
+{
+    struct timeval start, end;
+    struct timeval t1, t2;
+    uint64_t before_cycles, end_cycles;
+    long d_us;
+
+    SAMPLE_BLOCK *sb = NULL;
+    int format;
+
+    gettimeofday(&start, NULL);
+    before_cycles = cycles();
+
+    /* Normally we're already inside one from conversation_submit(), but we may
+     * be called directly */
+    epoch_enter();
+
+    ConvSide *side = stream_handle_resolve(h);
+    if (!side)
+    {
+        epoch_exit();
+        return -1;
     }
 
-    /* c still exists, and we got its mutex successfully. */
+    Conversation *c = side->conv;
+    int conv_side = side->side;
+
+    /* The caller holds our side's strand, so nothing else is working on this
+     * side, and c can't be freed until we leave the critical section */
 
     gettimeofday(&t1, NULL);
     d_us = delta(&start, &t1);
 
-    /* VERBOSE_LOG("C: Time to acquire conversation lock: %li\n", d_us); */
+    /* VERBOSE_LOG("C: Time to find conversation: %li\n", d_us); */
 
-    int ret = flv_parse_tag(flv_data, flv_len, stream_name, &sb);
+    int ret = conversation_decode(side, flv_data, flv_len, &sb, &format);
     if (ret)
     {
-        /* TODO: We often get errors from libspeex after parsing exactly 84 bits
-         * of the stream - mode (m) is set to 11, which isn't a valid
-         * mode. Figure out why. */
-
-        /* Valid modes:
-           http://www.speex.org/docs/manual/speex-manual/node10.html
-        */
-        char *hex = hexify(flv_data, flv_len);
-        g_debug("Error parsing tag: %s", hex);
-        free(hex);
         goto exit;
     }
 
@@ -296,7 +807,8 @@ int r(const char *stream_name, const unsigned char *flv_data, int flv_len,
 
     *return_flv_packet = NULL;
     *return_flv_len = 0;
-    ret = flv_create_tag(return_flv_packet, return_flv_len, stream_name, sb);
+    ret = conversation_encode(side, format, sb, return_flv_packet,
+        return_flv_len);
     if (ret)
     {
         goto free_sample_block;
@@ -313,7 +825,7 @@ int r(const char *stream_name, const unsigned char *flv_data, int flv_len,
     d_us = delta(&start, &end);
 
     float mips_cpu = (end_cycles - before_cycles) / (d_us);
-    float secs_of_speech = (float)(sb->count)/globals.sample_rate;
+    float secs_of_speech = (float)(sb->count)/c->sample_rate;
     float mips_per_ec = mips_cpu / ((secs_of_speech*1E6)/d_us);
 
     /* VERBOSE_LOG("CPU executes %5.2f MIPS\n", mips_cpu); */
@@ -327,6 +839,7 @@ int r(const char *stream_name, const unsigned char *flv_data, int flv_len,
     stats.samples_processed += sb->count;
     stats.total_samples_processed += sb->count;
     stats.total_us += d_us;
+    stats.total_cycles += end_cycles - before_cycles;
 
     float total_secs_of_speech = (float)(stats.total_samples_processed) / \
         globals.sample_rate;
@@ -342,73 +855,223 @@ free_sample_block:
     sample_block_destroy(sb);
 
 exit:
-    g_mutex_unlock(conv_side_mutex);
+    epoch_exit();
     return ret;
 }
 
-/* This should be called with a lock held on c */
-static void conversation_process_samples(Conversation *c, int conv_side,
-        SAMPLE_BLOCK *sb)
+int r_batch(stream_handle h, audio_packet *packets, int count)
 {
-    hybrid *hl = (conv_side == 0) ? c->h0 : c->h1;
-    hybrid *hr = (conv_side == 0) ? c->h1 : c->h0;
+    struct timeval start, end;
+    SAMPLE_BLOCK *sbs[R_BATCH_MAX];
+    int formats[R_BATCH_MAX];
+    size_t total = 0;
 
-    /* Only one thread can update samples at a time, since it affects both
-     * sides */
-    g_mutex_lock(c->echo_mutex);
+    g_return_val_if_fail(count > 0 && count <= R_BATCH_MAX, -1);
 
-    /* TODO: use sb->pts to determine a) if these samples are too old for us to
-     * care about, and b) if we need to insert them other than at the head of
-     * the queue */
+    gettimeofday(&start, NULL);
+    uint64_t before_cycles = cycles();
 
-    /* Let the left-side hybrid see these samples and echo-cancel them */
-    hybrid_put_tx_samples(hl, sb);
+    epoch_enter();
 
-    /* Now that the samples have been echo-canceled, let the right-side hybrid
-     * see them */
-    hybrid_put_rx_samples(hr, sb);
+    ConvSide *side = stream_handle_resolve(h);
+    if (!side)
+    {
+        epoch_exit();
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        audio_packet *p = &packets[i];
+
+        p->return_flv_data = NULL;
+        p->return_flv_len = 0;
+        sbs[i] = NULL;
+        /* The format may change part way through the batch */
+        p->ret = conversation_decode(side, p->flv_data, p->flv_len, &sbs[i],
+            &formats[i]);
+        if (!p->ret)
+        {
+            total += sbs[i]->count;
+        }
+    }
+
+    /* The packets are contiguous in time, so the echo canceler can take them
+     * as one block. Split the result back up so each reply keeps its own
+     * pts */
+    if (total)
+    {
+        SAMPLE_BLOCK *block = sample_block_create(total);
+        size_t offset = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (!packets[i].ret)
+            {
+                memcpy(block->s + offset, sbs[i]->s,
+                    sbs[i]->count * sizeof(SAMPLE));
+                offset += sbs[i]->count;
+            }
+        }
+
+        conversation_process_samples(side->conv, side->side, block);
+
+        offset = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (!packets[i].ret)
+            {
+                memcpy(sbs[i]->s, block->s + offset,
+                    sbs[i]->count * sizeof(SAMPLE));
+                offset += sbs[i]->count;
+            }
+        }
+
+        sample_block_destroy(block);
+    }
+
+    size_t processed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        audio_packet *p = &packets[i];
+
+        if (!p->ret)
+        {
+            p->ret = conversation_encode(side, formats[i], sbs[i],
+                &p->return_flv_data, &p->return_flv_len);
+            if (p->ret)
+            {
+                imo_body_free(p->return_flv_data);
+                p->return_flv_data = NULL;
+                p->return_flv_len = 0;
+            }
+            else
+            {
+                processed += sbs[i]->count;
+            }
+        }
+
+        sample_block_destroy(sbs[i]);
+    }
+
+    epoch_exit();
+
+    uint64_t end_cycles = cycles();
+    gettimeofday(&end, NULL);
 
-    g_mutex_unlock(c->echo_mutex);
+    G_LOCK(stats);
+    stats.samples_processed += processed;
+    stats.total_samples_processed += processed;
+    stats.total_us += delta(&start, &end);
+    stats.total_cycles += end_cycles - before_cycles;
+    G_UNLOCK(stats);
+
+    return 0;
 }
 
-/* Called when not holding the lock on id_to_conv */
-static Conversation *find_conv_for_stream(const char *stream_name,
-        int *conv_side)
+/* Decode an FLV packet for a side, picking the conversation's sample rate first
+ * if nobody has yet - or read the samples out of a raw PCM body, if the side
+ * asked to send those. Sets *format to what the reply should be encoded as.
+ * Must be called from the side's strand, or its decode strand when
+ * pipelining */
+static int conversation_decode(ConvSide *side, const unsigned char *flv_data,
+    int flv_len, SAMPLE_BLOCK **sb, int *format)
 {
-    gchar **conv_and_num = g_strsplit(stream_name, ":", 2);
-    g_static_rw_lock_reader_lock(&id_to_conv_rwlock);
-    Conversation *c = g_hash_table_lookup(id_to_conv, conv_and_num[0]);
-    g_static_rw_lock_reader_unlock(&id_to_conv_rwlock);
-    *conv_side = atoi(conv_and_num[1]);
+    Conversation *c = side->conv;
+
+    if (flv_len > 0 && flv_data[0] == PCM_TAG)
+    {
+        /* Without the rate agreed up front, we'd have nothing to check the
+         * samples against */
+        if (!g_atomic_int_get(&side->pcm))
+        {
+            g_debug("PCM audio from %s, which didn't ask to send it",
+                side->stream_name);
+            return -1;
+        }
 
-    g_strfreev(conv_and_num);
+        *format = FORMAT_PCM;
+        return pcm_parse_body(flv_data, flv_len, sb);
+    }
 
-    return c;
+    /* The first audio packet of a conversation determines the rate we run at,
+     * unless the 'S' message already did */
+    if (!g_atomic_int_get(&c->sample_rate))
+    {
+        conversation_set_sample_rate(c,
+            choose_sample_rate(flv_get_audio_sample_rate(flv_data, flv_len)));
+    }
+
+    int ret = flv_parse_tag(flv_data, flv_len, &side->flv, sb);
+    *format = side->flv.d_format_byte;
+    if (ret)
+    {
+        /* TODO: We often get errors from libspeex after parsing exactly 84 bits
+         * of the stream - mode (m) is set to 11, which isn't a valid
+         * mode. Figure out why. */
+
+        /* Valid modes:
+           http://www.speex.org/docs/manual/speex-manual/node10.html
+        */
+        char *hex = hexify(flv_data, flv_len);
+        g_debug("Error parsing tag: %s", hex);
+        free(hex);
+    }
+
+    return ret;
 }
 
-/* Assumes the lock is held externally */
-static Conversation *find_conv_for_stream_nolock(const char *stream_name,
-        int *conv_side)
+/* Encode echo-canceled samples for a side, in the format they came in. Must
+ * be called from the side's strand, or its encode strand when pipelining */
+static int conversation_encode(ConvSide *side, int format, SAMPLE_BLOCK *sb,
+    unsigned char **packet, int *packet_len)
 {
-    gchar **conv_and_num = g_strsplit(stream_name, ":", 2);
-    Conversation *c = g_hash_table_lookup(id_to_conv, conv_and_num[0]);
-    *conv_side = atoi(conv_and_num[1]);
+    if (format == FORMAT_PCM)
+    {
+        return pcm_create_body(packet, packet_len, sb);
+    }
 
-    g_strfreev(conv_and_num);
+    return flv_create_tag(packet, packet_len, &side->flv,
+        (unsigned char)format, sb);
+}
 
-    return c;
+/* This should be called from conv_side's strand. The other side's strand may
+ * be in here at the same time - each side only updates its own echo state, and
+ * hands its samples to the other side's echo canceler through a lock-free
+ * queue */
+static void conversation_process_samples(Conversation *c, int conv_side,
+        SAMPLE_BLOCK *sb)
+{
+    hybrid *hl = (conv_side == 0) ? c->h0 : c->h1;
+    hybrid *hr = (conv_side == 0) ? c->h1 : c->h0;
+
+    /* TODO: use sb->pts to determine a) if these samples are too old for us to
+     * care about, and b) if we need to insert them other than at the head of
+     * the queue */
+
+    /* Let the left-side hybrid see these samples and echo-cancel them */
+    hybrid_put_tx_samples(hl, sb);
+
+    /* Now that the samples have been echo-canceled, let the right-side hybrid
+     * see them. Only this side ever puts rx samples into hr */
+    hybrid_put_rx_samples(hr, sb);
 }
 
-static gboolean conv_is_closed(const char *stream_name)
+static gboolean conv_is_closed(const char *stream_name, size_t name_len)
 {
-    gchar **conv_and_num = g_strsplit(stream_name, ":", 2);
+    /* Stream names are at most 255 bytes, since their length is sent in one */
+    char id[256];
+    const char *colon = memchr(stream_name, ':', name_len);
+    size_t id_len = colon ? (size_t)(colon - stream_name) : name_len;
+    id_len = MIN(id_len, sizeof(id) - 1);
+
+    memcpy(id, stream_name, id_len);
+    id[id_len] = '\0';
 
     G_LOCK(closed_conversations);
     gboolean found = g_hash_table_lookup_extended(closed_conversations,
-            conv_and_num[0], NULL, NULL);
+            id, NULL, NULL);
     G_UNLOCK(closed_conversations);
 
-    g_strfreev(conv_and_num);
-
     return found;
 }
@@ -1,31 +1,201 @@
 #ifndef _CONVERSATION_H_
 #define _CONVERSATION_H_
 
+#include "flv.h"
+#include "strand.h"
+
+/// Compact name for one side of a conversation, handed out when the
+/// conversation starts. Resolving one is an array index, not a string lookup.
+/// The low bits pick a slot, and the high bits are a generation count, so a
+/// handle for a conversation which has ended never resolves to a newer one
+/// that reused its slot.
+typedef guint32 stream_handle;
+
+/// Never a valid handle
+#define STREAM_HANDLE_NONE (0)
+
+/// Bits of a stream_handle used for the slot index
+#define STREAM_HANDLE_SLOT_BITS (16)
+/// Most streams which can exist at once - two per conversation
+#define MAX_STREAMS (1 << STREAM_HANDLE_SLOT_BITS)
+
+struct Conversation;
+
+/// One participant's side of a conversation, and everything needed to process
+/// the stream they send us.
+typedef struct ConvSide {
+    struct Conversation *conv;   /// Conversation we're part of
+    int side;                    /// 0 or 1
+    gchar *stream_name;          /// Full stream name, id:side
+    size_t name_len;             /// strlen(stream_name) - names looked up
+                                 /// off the wire may have NULs in them
+    stream_handle handle;        /// Our handle - fixed for our lifetime
+    volatile gint pcm;           /// May send raw PCM rather than FLV - see
+                                 /// conversation_use_pcm()
+
+    struct strand *strand;       /// Serializes processing for this side
+    /// With --pipeline, strand only echo-cancels, and these serialize decoding
+    /// and encoding. Unused otherwise
+    struct strand *decode_strand;
+    struct strand *encode_strand;
+    FLVStream flv;               /// Codec state - only used on our strands
+
+    struct ConvSide *next;       /// Next in this stream table chain
+} ConvSide;
+
 /// Holds information about a single 2-party conversation.
 typedef struct Conversation {
+    gchar *id;                   /// Conversation id, without the side suffix
+    guint hash;                  /// imo_conversation_hash() of id
+
+    ConvSide sides[2];
+
+    /// Hybrids for each side. NULL until the sample rate is chosen
     struct hybrid *h0, *h1;
+    /// Rate both sides echo-cancel at, or 0 if not chosen yet. Set once.
+    int sample_rate;
 
-    GMutex *c0_mutex, *c1_mutex; /// Mutexes for each side of the conversation
-    GMutex *echo_mutex;          /// Mutex for the conversation as a whole
+    GMutex *rate_mutex;          /// Serializes choosing sample_rate
+
+    /// One for the stream table, plus one per pipelined packet in flight. The
+    /// conversation is reclaimed once it ends and this drops to zero
+    volatile gint refs;
 } Conversation;
 
-#define LOCK_FAILURE (-20)
+/**
+ * Called once a pipelined packet has been through every stage, or failed one.
+ *
+ * @param item As passed to conversation_pipeline().
+ * @param ret Zero on success, non-zero if the packet couldn't be processed.
+ * @param flv_packet The echo-canceled FLV packet, or NULL on failure. The
+ * callback must free it.
+ * @param flv_len Length of flv_packet.
+ */
+typedef void (*conversation_done_fn)(gpointer item, int ret,
+    unsigned char *flv_packet, int flv_len);
 
 /**
  * Must be called before using any of the functions in conversation.c.
  *
  */
 void init_conversations(void);
-void conversation_start(const char *stream_name);
+
+/**
+ * Create the conversation a stream belongs to, if it doesn't exist yet. A new
+ * conversation has to get past admission control first (see admission.h).
+ *
+ * @param stream_name Name of the stream which sent us an 'S' message.
+ * @param sample_rate Rate the client asked us to echo-cancel at, or 0 to pick
+ * one from the codec of the first audio packet we see.
+ *
+ * @return Zero if the conversation exists now, non-zero if we had no room for
+ * it.
+ */
+int conversation_start(const char *stream_name, int sample_rate);
 void conversation_end(const char *stream_name);
 
+/**
+ * Let a stream send raw PCM bodies (see pcm.h) instead of FLV tags, and get
+ * its replies the same way. There's no resampling, so the samples have to be
+ * at the conversation's rate - picked now, if neither side has yet.
+ *
+ * @param stream_name Name of a stream whose conversation has started.
+ *
+ * @return The rate the stream's samples must be at, or 0 if there's no such
+ * stream.
+ */
+int conversation_use_pcm(const char *stream_name);
+
+/**
+ * Find the handle for a stream. One hash lookup, and no allocation - this is
+ * meant to be called on every packet, straight from the message bytes. Logs a
+ * warning if there's no such stream and its conversation didn't just end.
+ *
+ * @param stream_name Name of the stream - need not be NUL-terminated.
+ * @param name_len Length of stream_name.
+ *
+ * @return The handle, or STREAM_HANDLE_NONE if there's no such stream.
+ */
+stream_handle conversation_find_stream(const char *stream_name, int name_len);
+
+/**
+ * Run fn(item) on the strand for a stream's side of its conversation. Items for
+ * one side run one at a time, in the order they were submitted. If the side is
+ * idle, fn runs on the calling thread before this returns. If not, the item is
+ * queued and run by the thread currently busy with that side.
+ *
+ * @param h Handle of the stream the item belongs to.
+ * @param fn Function to run - it will typically call r().
+ * @param item Passed to fn.
+ *
+ * @return Zero if fn was or will be run, non-zero if the conversation has
+ * ended.
+ */
+int conversation_submit(stream_handle h, strand_fn fn, gpointer item);
+
+/**
+ * Start the threads which run pipelined packets. Must be called before
+ * conversation_pipeline().
+ *
+ * @param num_threads Most threads to run stages on at once.
+ */
+void conversation_start_pipeline(int num_threads);
+
+/**
+ * Change how many threads run pipelined packets, as the worker pool is
+ * resized.
+ */
+void conversation_resize_pipeline(int num_threads);
+
+/**
+ * Process an audio packet in three stages - decode, echo-cancel, encode - each
+ * on its own strand for the stream's side, run by the stage threads. Only the
+ * echo-cancel stage touches echo state, so while one packet is being canceled
+ * the next can be decoded and the previous one encoded. Packets of one stream
+ * still go through each stage in the order they were submitted. Never runs
+ * anything on the calling thread.
+ *
+ * @param h Handle of the stream which sent the packet.
+ * @param flv_data The FLV packet. Must stay valid until done is called.
+ * @param flv_len Length of flv_data.
+ * @param done Called from a stage thread with the result. The conversation
+ * won't be freed until it returns.
+ * @param item Passed to done.
+ *
+ * @return Zero if done will be called, non-zero if the conversation has ended.
+ */
+int conversation_pipeline(stream_handle h, const unsigned char *flv_data,
+    int flv_len, conversation_done_fn done, gpointer item);
+
+/**
+ * Get the hash of a stream's conversation id from its handle - the same as
+ * imo_message_conversation_hash() of a message naming the stream. No string
+ * is touched.
+ *
+ * @return The hash, or 0 if the conversation has ended.
+ */
+guint conversation_hash(stream_handle h);
+
+/**
+ * Get the name of a stream from its handle.
+ *
+ * @return A copy of the name, which the caller must g_free(), or NULL if the
+ * conversation has ended.
+ */
+gchar *conversation_stream_name(stream_handle h);
+
 /**
  * Handles the audio processing for a message - decodes FLV, resampling if
  * necessary, cancels echo, and if all goes well, creates a new FLV packet to be
  * encapsulated into an imo message and sent back to wowza
  *
- * @param stream_name Name of the stream which sent us this message.
- * @param flv_data The FLV data containing our audio samples.
+ * \note Must be called from the stream's strand (see conversation_submit()), or
+ * while nothing else can be processing the conversation.
+ *
+ * @param h Handle of the stream which sent us this message.
+ * @param flv_data The FLV data containing our audio samples - or a raw PCM
+ * body, if the stream asked to send those (see conversation_use_pcm()). The
+ * reply is in the same format.
  * @param flv_len Length of the FLV packet.
  * @param return_flv_data Address of a pointer to hold the return FLV packet,
  * if any
@@ -33,7 +203,37 @@ void conversation_end(const char *stream_name);
  *
  * @return Zero on success, non-zero on failure.
  */
-int r(const char *stream_name, const unsigned char *flv_data, int flv_len,
+int r(stream_handle h, const unsigned char *flv_data, int flv_len,
     unsigned char **return_flv_data, int *return_flv_len);
 
+/// Most packets r_batch() takes at once
+#define R_BATCH_MAX (16)
+
+/// One packet of a batch passed to r_batch()
+typedef struct audio_packet {
+    const unsigned char *flv_data;   /// In - the FLV packet
+    int flv_len;
+    unsigned char *return_flv_data;  /// Out - caller frees. NULL on failure
+    int return_flv_len;
+    int ret;                         /// Out - zero on success
+} audio_packet;
+
+/**
+ * Same as r(), for several consecutive packets from one stream. They're
+ * decoded back to back, echo-canceled as one block, then encoded into one
+ * reply each. Resolving the stream, the hop onto its strand, one
+ * echo_update_tx() for the whole block and updating stats happen once for the
+ * batch, not once per packet.
+ *
+ * \note Must be called from the stream's strand, like r().
+ *
+ * @param h Handle of the stream which sent the packets.
+ * @param packets The packets, in the order they arrived.
+ * @param count Number of packets - at most R_BATCH_MAX.
+ *
+ * @return Zero if the stream was found, in which case each packet has its own
+ * result. Non-zero if not, and none of the packets were processed.
+ */
+int r_batch(stream_handle h, audio_packet *packets, int count);
+
 #endif
@@ -54,30 +54,39 @@ static int geigel_dtd(echo *e, float err, float tx, float rx);
 static int mecc_dtd(echo *e, float err, float tx, float rx);
 
 
-echo *echo_create(hybrid *h)
+echo *echo_create(hybrid *h, int sample_rate, int echo_path)
 {
     echo * restrict e = malloc(sizeof(echo));
 
-    e->rx_buf = cbuffer_init((size_t)globals.nlms_len);
-    e->x  = malloc((globals.nlms_len+NLMS_EXT) * sizeof(float));
-    e->xf = malloc((globals.nlms_len+NLMS_EXT) * sizeof(float));
-    e->w  = malloc(globals.nlms_len * sizeof(float));
+    e->sample_rate = sample_rate;
+    e->nlms_len = echo_path * TAPS_PER_MS(sample_rate);
+    e->dtd_hangover = DTD_HANGOVER_MS * TAPS_PER_MS(sample_rate);
+
+    e->mutex = g_mutex_new();
+
+    /* Leave room for the other side to run ahead of us by a few blocks - we
+     * drop anything older than the echo path when we catch up */
+    e->rx_ring = sample_ring_init(4 * (size_t)e->nlms_len);
+    e->rx_block = malloc(e->nlms_len * sizeof(SAMPLE));
+    e->x  = malloc((e->nlms_len+NLMS_EXT) * sizeof(float));
+    e->xf = malloc((e->nlms_len+NLMS_EXT) * sizeof(float));
+    e->w  = malloc(e->nlms_len * sizeof(float));
 
     e->j  = NLMS_EXT;
 
     int i;
     int j = e->j;
     /* TODO: memset() would be faster */
-    for (i = 0; i < globals.nlms_len; i++)
+    for (i = 0; i < e->nlms_len; i++)
     {
         e->x[j+i] = 0;
-        e->xf[j+i] = 1.0/globals.nlms_len;
-        e->w[i] = 1.0/globals.nlms_len;
+        e->xf[j+i] = 1.0/e->nlms_len;
+        e->w[i] = 1.0/e->nlms_len;
     }
 
     /* Geigel DTD */
-    e->max_x = malloc((globals.nlms_len/DTD_LEN) * sizeof(float));
-    memset(e->max_x, 0, (globals.nlms_len/DTD_LEN) * sizeof(float));
+    e->max_x = malloc((e->nlms_len/DTD_LEN) * sizeof(float));
+    memset(e->max_x, 0, (e->nlms_len/DTD_LEN) * sizeof(float));
     e->max_max_x = 0.0;
     e->dtd_index = 0;
     e->dtd_count = 0;
@@ -124,7 +133,9 @@ void echo_destroy(echo *e)
 
     free(e->max_x);
 
-    cbuffer_destroy(e->rx_buf);
+    sample_ring_destroy(e->rx_ring);
+    free(e->rx_block);
+    g_mutex_free(e->mutex);
 
     hp_fir_destroy(e->hp);
     iir_destroy(e->Fx);
@@ -134,83 +145,120 @@ void echo_destroy(echo *e)
     free(e);
 }
 
+int echo_params_valid(int sample_rate, int echo_path)
+{
+    if (sample_rate <= 0 || sample_rate % 1000)
+    {
+        return 0;
+    }
+
+    return ((echo_path * TAPS_PER_MS(sample_rate)) % DTD_LEN) == 0;
+}
+
 void echo_update_tx(echo *e, SAMPLE_BLOCK *sb)
 {
     /* VERBOSE_LOG("%s\n", e->h->name); */
 
     g_return_if_fail(sb != NULL);
 
+    g_mutex_lock(e->mutex);
+
+    /* Reference samples older than the echo path can't be in this block. If
+     * the other side has got that far ahead, skip them. A block longer than
+     * the echo path - a batch of packets - lines up with as many reference
+     * samples as it has */
+    size_t keep = MAX(sb->count, (size_t)e->nlms_len);
+    size_t backlog = sample_ring_get_count(e->rx_ring);
+    if (backlog > keep)
+    {
+        sample_ring_skip(e->rx_ring, backlog - keep);
+    }
+
     size_t i;
     int any_doubletalk = 0;
-    for (i=0; i<sb->count; i++)
+
+    /* rx_block holds one echo path's worth of reference samples, so take long
+     * blocks a piece at a time */
+    for (size_t done = 0; done < sb->count; done += e->nlms_len)
     {
-        SAMPLE rx_s, tx_s;
-        float tx, rx;
+        SAMPLE *tx_block = sb->s + done;
 
-        /* TODO: these values are for debugging - remove them later */
-        float tx_fir, tx_nlms_pw;
+        /* TODO: temporary. Don't attempt echo cancellation past the rx samples
+         * we have */
+        size_t rx_count = sample_ring_read(e->rx_ring, e->rx_block,
+            MIN(sb->count - done, (size_t)e->nlms_len));
 
-        /* TODO: temporary. Don't attempt echo cancellation if we have no rx
-         * samples */
-        if (!cbuffer_get_count(e->rx_buf))
+        for (i=0; i<rx_count; i++)
         {
-            break;
-        }
+            SAMPLE rx_s, tx_s;
+            float tx, rx;
 
-        rx_s = cbuffer_pop(e->rx_buf);
-        tx_s = sb->s[i];
+            /* TODO: these values are for debugging - remove them later */
+            float tx_fir, tx_nlms_pw;
 
-        tx = (float)tx_s;
-        rx = (float)rx_s;
+            rx_s = e->rx_block[i];
+            tx_s = tx_block[i];
 
-        /* High-pass filter - filter out sub-300Hz signals */
-        tx = update_fir(e->hp, tx);
-        tx_fir = tx;
+            tx = (float)tx_s;
+            rx = (float)rx_s;
 
-        /* Speaker high-pass filter - remove DC */
-        rx = iirdc_highpass(e->iir_dc, rx);
+            /* High-pass filter - filter out sub-300Hz signals */
+            tx = update_fir(e->hp, tx);
+            tx_fir = tx;
 
-        int update;
+            /* Speaker high-pass filter - remove DC */
+            rx = iirdc_highpass(e->iir_dc, rx);
 
-        /* These used to be done in nlms_pw, but at least one DTD needs access
-         * to err */
-        float dotp_w_x = dotp(e->w, e->x+e->j, globals.nlms_len);
-        float err = tx - dotp_w_x;
+            int update;
 
-        /* DTD - assumes the dtd_fn field is properly set */
-        update = !e->dtd_fn(e, err, tx, rx);
+            /* These used to be done in nlms_pw, but at least one DTD needs
+             * access to err */
+            float dotp_w_x = dotp(e->w, e->x+e->j, e->nlms_len);
+            float err = tx - dotp_w_x;
 
-        /* nlms-pw */
-        tx = nlms_pw(e, err, rx, update);
-        tx_nlms_pw = tx;
+            /* DTD - assumes the dtd_fn field is properly set */
+            update = !e->dtd_fn(e, err, tx, rx);
 
-        /* If we're not talking, let's attenuate our signal */
-        if (update)
-        {
-            tx *= M12dB;
-        }
-        else
-        {
-            any_doubletalk = 1;
-        }
+            /* nlms-pw */
+            tx = nlms_pw(e, err, rx, update);
+            tx_nlms_pw = tx;
 
-        /* clipping */
-        tx = clip(tx);
+            /* If we're not talking, let's attenuate our signal */
+            if (update)
+            {
+                tx *= M12dB;
+            }
+            else
+            {
+                any_doubletalk = 1;
+            }
 
-        /* HACK: I'd rather diverge for a bit than have that horrible
-         * static. Find out why we get such bad data sometimes */
-        if (fabsf(tx)+10 > MAXPCM)
-        {
-            /* Wipe all the weights. Brutal. */
-            memset(e->w, 0, (globals.nlms_len*sizeof(float)));
+            /* clipping */
+            tx = clip(tx);
 
-            g_debug("Orig: %i  clipped: %f", tx_s, tx);
-            g_debug("tx_fir: %f   tx_nlms_pw: %f", tx_fir, tx_nlms_pw);
+            /* HACK: I'd rather diverge for a bit than have that horrible
+             * static. Find out why we get such bad data sometimes */
+            if (fabsf(tx)+10 > MAXPCM)
+            {
+                /* Wipe all the weights. Brutal. */
+                memset(e->w, 0, (e->nlms_len*sizeof(float)));
+
+                g_debug("Orig: %i  clipped: %f", tx_s, tx);
+                g_debug("tx_fir: %f   tx_nlms_pw: %f", tx_fir, tx_nlms_pw);
+            }
+
+            tx_block[i] = (int)tx;
         }
 
-        sb->s[i] = (int)tx;
+        /* Nothing more to cancel against */
+        if (rx_count < MIN(sb->count - done, (size_t)e->nlms_len))
+        {
+            break;
+        }
     }
 
+    g_mutex_unlock(e->mutex);
+
     /* VERBOSE_LOG("dotp(xf, xf): %f\n", e->dotp_xf_xf); */
 
     /* Indicate which side doubletalk is on */
@@ -231,7 +279,9 @@ void echo_update_rx(echo *e, SAMPLE_BLOCK *sb)
 {
     g_return_if_fail(sb != NULL);
 
-    cbuffer_push_bulk(e->rx_buf, sb);
+    /* If the ring is full, our tx side is so far behind that these would be
+     * skipped anyway */
+    sample_ring_push_bulk(e->rx_ring, sb);
 }
 
 static inline float clip(float in)
@@ -324,10 +374,10 @@ static float nlms_pw(echo *e, float err, float rx, int update)
 #ifdef FAST_DOTP
     /* Iterative update */
     e->dotp_xf_xf += (e->xf[j] * e->xf[j] -
-        e->xf[j+globals.nlms_len-1] * e->xf[j+globals.nlms_len-1]);
+        e->xf[j+e->nlms_len-1] * e->xf[j+e->nlms_len-1]);
 #else
     /* The slow way to do this */
-    e->dotp_xf_xf = dotp(e->xf, e->xf, globals.nlms_len);
+    e->dotp_xf_xf = dotp(e->xf, e->xf, e->nlms_len);
 #endif
 
     /* TODO: find a reasonable value for this */
@@ -343,7 +393,7 @@ static float nlms_pw(echo *e, float err, float rx, int update)
             /* stack_trace(1); */
 
             /* TODO: / HACK: for now, reset the weights to zero */
-            memset(e->w, 0, (globals.nlms_len)*sizeof(float));
+            memset(e->w, 0, (e->nlms_len)*sizeof(float));
         }
 
         /* Update tap weights */
@@ -352,7 +402,7 @@ static float nlms_pw(echo *e, float err, float rx, int update)
         float * restrict weights = e->w;
         float * restrict xf      = e->xf;
 
-        for (i = 0; i < globals.nlms_len; i++)
+        for (i = 0; i < e->nlms_len; i++)
         {
             weights[i] += u_ef*xf[j+i];
         }
@@ -362,8 +412,8 @@ static float nlms_pw(echo *e, float err, float rx, int update)
     if (--e->j < 0)
     {
         e->j = NLMS_EXT;
-        memmove(e->x+e->j+1, e->x, (globals.nlms_len-1)*sizeof(float));
-        memmove(e->xf+e->j+1, e->xf, (globals.nlms_len-1)*sizeof(float));
+        memmove(e->x+e->j+1, e->x, (e->nlms_len-1)*sizeof(float));
+        memmove(e->xf+e->j+1, e->xf, (e->nlms_len-1)*sizeof(float));
     }
 
     return err;
@@ -400,7 +450,7 @@ static int geigel_dtd(echo *e, float err, float tx, float rx)
         e->dtd_count = 0;
         /* Find max of max */
         e->max_max_x = 0;
-        for (i = 0; i< globals.nlms_len/DTD_LEN; i++)
+        for (i = 0; i< e->nlms_len/DTD_LEN; i++)
         {
             if (e->max_x[i] > e->max_max_x)
             {
@@ -408,7 +458,7 @@ static int geigel_dtd(echo *e, float err, float tx, float rx)
             }
         }
         /* Rotate */
-        if (++e->dtd_index >= globals.nlms_len/DTD_LEN)
+        if (++e->dtd_index >= e->nlms_len/DTD_LEN)
         {
             e->dtd_index = 0;
         }
@@ -417,7 +467,7 @@ static int geigel_dtd(echo *e, float err, float tx, float rx)
 
     if (fabsf(tx) > (GeigelThreshold * e->max_max_x))
     {
-        e->holdover = globals.dtd_hangover;
+        e->holdover = e->dtd_hangover;
     }
 
     if (e->holdover)
@@ -442,7 +492,7 @@ static int geigel_dtd(echo *e, float err, float tx, float rx)
     size_t i;
     int j = e->j;
 
-    for (i=0; i<globals.nlms_len-1; i++)
+    for (i=0; i<e->nlms_len-1; i++)
     {
         float rx = fabsf(e->x[j+i+1]); /* e->x[j] hasn't been set yet */
         if (rx > max)
@@ -455,7 +505,7 @@ static int geigel_dtd(echo *e, float err, float tx, float rx)
 
     if (a_tx > (GeigelThreshold * max))
     {
-        e->holdover = globals.dtd_hangover;
+        e->holdover = e->dtd_hangover;
     }
 
     if (e->holdover)
@@ -487,7 +537,7 @@ static int mecc_dtd(echo *e, float err, float tx, float rx)
 
     if (xi < T)
     {
-        e->holdover = globals.dtd_hangover;
+        e->holdover = e->dtd_hangover;
     }
 
     if (e->holdover)
@@ -541,10 +591,10 @@ static void dump_ec_state(echo *e)
 
     DEBUG_LOG("dotp_xf_xf: %f\n", e->dotp_xf_xf);
     DEBUG_LOG("STEPSIZE: %f\n", STEPSIZE);
-    hex = floats_to_text(e->w, globals.nlms_len);
+    hex = floats_to_text(e->w, e->nlms_len);
     DEBUG_LOG("e->w: %s\n", hex);
     free(hex);
-    hex = floats_to_text(e->x+e->j, globals.nlms_len);
+    hex = floats_to_text(e->x+e->j, e->nlms_len);
     DEBUG_LOG("e->x+j: %s\n", hex);
     free(hex);
 }
@@ -54,12 +54,26 @@ typedef struct hp_fir {
 /** Optimize Geigel DTD calculation  */
 #define DTD_LEN (80)
 
-/// Number of taps per millisecond of speech
-#define TAPS_PER_MS (globals.sample_rate / 1000)
+/// Number of taps per millisecond of speech at the given sample rate
+#define TAPS_PER_MS(rate) ((rate) / 1000)
+
+/// DTD hangover time, in ms. TODO: make user-settable
+#define DTD_HANGOVER_MS (30)
 
 /// Context for echo-canceling one side of a conversation.
 typedef struct echo {
-    struct CBuffer *rx_buf;
+    int sample_rate;            ///< rate this instance cancels at
+    int nlms_len;               ///< taps (ms of echo path * TAPS_PER_MS)
+    int dtd_hangover;           ///< DTD hangover time, in taps
+
+    /// Guards the cancellation state below. Only the tx side of the hybrid
+    /// updates it, so this is normally uncontended
+    GMutex *mutex;
+
+    /// Reference (speaker) samples, pushed by the other side of the
+    /// conversation and consumed here - without either side taking a lock
+    struct SampleRing *rx_ring;
+    SAMPLE *rx_block;           ///< Reference samples for one update
 
     /* TODO: is this the same as rx_buf? */
     float *x;                   ///< tap-delayed speaker signal
@@ -95,8 +109,26 @@ typedef struct echo {
 
 struct SAMPLE_BLOCK;
 
-echo *echo_create(struct hybrid *h);
+/**
+ * Create an echo-cancellation context.
+ *
+ * @param h The hybrid this context belongs to.
+ * @param sample_rate Sample rate of the samples we will be given.
+ * @param echo_path Length of the echo path to handle, in ms.
+ *
+ * @return The new context.
+ */
+echo *echo_create(struct hybrid *h, int sample_rate, int echo_path);
 void echo_destroy(echo *e);
+
+/**
+ * Check whether an echo canceler can be built for the given parameters - the
+ * sample rate must be a whole number of taps per ms, and DTD_LEN must divide
+ * evenly into the resulting NLMS length.
+ *
+ * @return Non-zero if the parameters are usable.
+ */
+int echo_params_valid(int sample_rate, int echo_path);
 /**
  * This function is expected to update the samples in sb to remove echo - once
  * it completes, they are ready to go out the tx side of the hybrid.
@@ -108,7 +140,8 @@ void echo_update_tx(echo *e, struct SAMPLE_BLOCK *sb);
 
 /**
  * Just copies samples into the rx part of the echo-cancellation context - no
- * processing is done.
+ * processing is done. May be called from a different thread than
+ * echo_update_tx(), as long as only one thread calls each.
  *
  * @param e Echo-cancellation context.
  * @param sb Samples to copy.
@@ -0,0 +1,163 @@
+#include <glib.h>
+
+#include "epoch.h"
+
+/// Objects deferred in epoch e are freed once the epoch reaches e + 2, so
+/// we only ever need 3 lists
+#define NUM_LIMBO_LISTS (3)
+
+/// Per-thread reader state. Records are never freed - a thread which exits
+/// leaves its record for the next new thread to reuse.
+typedef struct epoch_record {
+    volatile gint active;       /**< In a critical section */
+    volatile gint epoch;        /**< Epoch seen when the section started */
+    int depth;                  /**< Nesting - only touched by the owner */
+    volatile gint in_use;       /**< Owned by a live thread */
+    struct epoch_record *next;
+} epoch_record;
+
+/// Something waiting for readers to move on
+typedef struct epoch_deferred {
+    epoch_free_fn fn;
+    gpointer data;
+} epoch_deferred;
+
+static volatile gint global_epoch = 0;
+static epoch_record *volatile records = NULL;
+static GStaticPrivate thread_record = G_STATIC_PRIVATE_INIT;
+
+/// Protects limbo, and serializes epoch advances with deferrals
+G_LOCK_DEFINE_STATIC(limbo);
+static GSList *limbo[NUM_LIMBO_LISTS] = { NULL, NULL, NULL };
+
+static epoch_record *get_record(void);
+static void release_record(gpointer data);
+
+static epoch_record *get_record(void)
+{
+    epoch_record *rec = g_static_private_get(&thread_record);
+    if (rec)
+    {
+        return rec;
+    }
+
+    /* First time through on this thread - take over a dead thread's record
+     * if there is one */
+    for (rec = records; rec; rec = rec->next)
+    {
+        if (!rec->in_use &&
+            g_atomic_int_compare_and_exchange(&rec->in_use, FALSE, TRUE))
+        {
+            break;
+        }
+    }
+
+    if (!rec)
+    {
+        rec = g_new0(epoch_record, 1);
+        rec->in_use = TRUE;
+        do {
+            rec->next = records;
+        } while (!g_atomic_pointer_compare_and_exchange(&records, rec->next,
+                rec));
+    }
+
+    g_static_private_set(&thread_record, rec, release_record);
+
+    return rec;
+}
+
+/* Called when a thread with a record exits */
+static void release_record(gpointer data)
+{
+    epoch_record *rec = data;
+
+    rec->depth = 0;
+    rec->active = FALSE;
+    g_atomic_int_set(&rec->in_use, FALSE);
+}
+
+void epoch_enter(void)
+{
+    epoch_record *rec = get_record();
+
+    if (rec->depth++)
+    {
+        return;
+    }
+
+    rec->active = TRUE;
+    /* We must be visibly active before we read the epoch or any shared
+     * pointer - see epoch_reclaim() */
+    __sync_synchronize();
+    rec->epoch = global_epoch;
+    __sync_synchronize();
+}
+
+void epoch_exit(void)
+{
+    epoch_record *rec = get_record();
+
+    g_return_if_fail(rec->depth > 0);
+
+    if (--rec->depth)
+    {
+        return;
+    }
+
+    /* Finish our reads before anyone can see us leave */
+    __sync_synchronize();
+    rec->active = FALSE;
+}
+
+void epoch_defer(epoch_free_fn fn, gpointer data)
+{
+    epoch_deferred *d = g_slice_new(epoch_deferred);
+    d->fn = fn;
+    d->data = data;
+
+    G_LOCK(limbo);
+    limbo[global_epoch % NUM_LIMBO_LISTS] =
+        g_slist_prepend(limbo[global_epoch % NUM_LIMBO_LISTS], d);
+    G_UNLOCK(limbo);
+}
+
+int epoch_reclaim(void)
+{
+    G_LOCK(limbo);
+
+    __sync_synchronize();
+    gint e = global_epoch;
+
+    /* Only advance once every reader in a critical section has seen the
+     * current epoch. Anything deferred two epochs ago was unlinked before
+     * they started, so they can't be holding it */
+    for (epoch_record *rec = records; rec; rec = rec->next)
+    {
+        if (rec->active && rec->epoch != e)
+        {
+            G_UNLOCK(limbo);
+            return 0;
+        }
+    }
+
+    g_atomic_int_set(&global_epoch, e + 1);
+
+    GSList *ready = limbo[(e + 2) % NUM_LIMBO_LISTS];
+    limbo[(e + 2) % NUM_LIMBO_LISTS] = NULL;
+
+    G_UNLOCK(limbo);
+
+    /* Free outside the lock - the free functions may take their own */
+    int freed = 0;
+    for (GSList *l = ready; l; l = l->next)
+    {
+        epoch_deferred *d = l->data;
+        d->fn(d->data);
+        g_slice_free(epoch_deferred, d);
+        freed++;
+    }
+    g_slist_free(ready);
+
+    return freed;
+}
@@ -0,0 +1,44 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <glib.h>
+
+/* Epoch-based reclamation. Readers bracket their use of shared objects with
+ * epoch_enter()/epoch_exit() and take no locks. A writer unlinks an object so
+ * no new reader can find it, then hands it to epoch_defer(). It's freed once
+ * every reader which might have seen it has left its critical section.
+ *
+ * Critical sections are cheap - a couple of stores and a barrier - but a
+ * thread which stays inside one holds up every deferred free. */
+
+typedef void (*epoch_free_fn)(gpointer data);
+
+/**
+ * Start a read-side critical section. Nests.
+ */
+void epoch_enter(void);
+
+/**
+ * End a read-side critical section. Anything found inside it must not be used
+ * afterwards.
+ */
+void epoch_exit(void);
+
+/**
+ * Free an object once no reader can still be using it. The object must
+ * already be unreachable for new readers.
+ *
+ * @param fn Called with data from whichever thread calls epoch_reclaim().
+ * @param data The object.
+ */
+void epoch_defer(epoch_free_fn fn, gpointer data);
+
+/**
+ * Advance the epoch if every reader has caught up, and free whatever is now
+ * safe to free. Call periodically - nothing is freed otherwise.
+ *
+ * @return Number of objects freed.
+ */
+int epoch_reclaim(void);
+
+#endif
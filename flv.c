@@ -8,30 +8,21 @@
 #include "av.h"
 #include "cbuffer.h"
 #include "flv.h"
+#include "governor.h"
+#include "imo_message.h"
 #include "kodama.h"
 #include "util.h"
 
 extern globals_t globals;       /* Needed for FLV_LOG */
 
-static FLVStream *create_flv_stream(void);
-static void destroy_flv_stream(FLVStream *flv);
+/* We decode in place - every body we're given must be padded enough */
+#if FF_INPUT_BUFFER_PADDING_SIZE > IMO_INPUT_PADDING
+#error "IMO_INPUT_PADDING must be at least FF_INPUT_BUFFER_PADDING_SIZE"
+#endif
 
-static GHashTable *id_to_flvstream;
-G_LOCK_DEFINE(id_to_flvstream);
-
-void flv_init(void)
-{
-    G_LOCK(id_to_flvstream);
-    id_to_flvstream = g_hash_table_new_full(g_str_hash, g_str_equal,
-            g_free,
-            /* We don't put the destroy function here - explained below */
-            NULL);
-    G_UNLOCK(id_to_flvstream);
-}
-
-static FLVStream *create_flv_stream(void)
+void flv_start_stream(FLVStream *flv)
 {
-    FLVStream *flv = malloc(sizeof(FLVStream));
+    flv->sample_rate = globals.sample_rate;
 
     flv->d_format_byte = '\0';
 
@@ -41,18 +32,15 @@ static FLVStream *create_flv_stream(void)
     flv->d_codec_ctx->codec_id = CODEC_ID_NONE;
     flv->d_resample_ctx = NULL;
 
+    flv->e_format_byte = '\0';
+    flv->e_complexity = 0;
     flv->e_codec_ctx = avcodec_alloc_context2(CODEC_TYPE_AUDIO);
     flv->e_codec_ctx->codec_id = CODEC_ID_NONE;
     flv->e_codec_ctx->sample_fmt = SAMPLE_FMT_S16;
     flv->e_resample_ctx = NULL;
-
-    flv->d_mutex = g_mutex_new();
-    flv->e_mutex = g_mutex_new();
-
-    return flv;
 }
 
-static void destroy_flv_stream(FLVStream *flv)
+void flv_end_stream(FLVStream *flv)
 {
     g_return_if_fail(flv != NULL);
 
@@ -61,11 +49,6 @@ static void destroy_flv_stream(FLVStream *flv)
 
     av_free(flv->e_codec_ctx);
     av_free(flv->e_resample_ctx);
-
-    g_mutex_free(flv->d_mutex);
-    g_mutex_free(flv->e_mutex);
-
-    free(flv);
 }
 
 void flv_parse_header(void)
@@ -73,54 +56,36 @@ void flv_parse_header(void)
     /* TODO: */
 }
 
-void flv_start_stream(const char *stream_name)
+void flv_set_sample_rate(FLVStream *flv, int sample_rate)
 {
-    G_LOCK(id_to_flvstream);
-    FLVStream *flv = g_hash_table_lookup(id_to_flvstream, stream_name);
-    if (flv)
-    {
-        g_warning("FLVStream already exists for stream %s - "
-            "this is suspicious", stream_name);
-    }
-    else
+    g_return_if_fail(flv != NULL);
+
+    if (flv->d_format_byte && flv->sample_rate != sample_rate)
     {
-        FLV_LOG("Creating FLVStream for %s\n", stream_name);
-        flv = create_flv_stream();
-        g_hash_table_insert(id_to_flvstream, g_strdup(stream_name), flv);
+        g_warning("Changing sample rate of a stream after its codec was set "
+            "up - this will probably sound terrible");
     }
-    G_UNLOCK(id_to_flvstream);
+    flv->sample_rate = sample_rate;
 }
 
-void flv_end_stream(const char *stream_name)
+int flv_get_audio_sample_rate(const unsigned char *packet_data,
+    const int packet_len)
 {
-    FLV_LOG("Destroying FLVStream for %s\n", stream_name);
-
-    /* This will be called while holding a lock on the conversation associated
-     * with this FLVStream, so the locking we're doing is probably excessive */
-    /* TODO: is this still correct? Conversations now have a mutex for each
-     * side */
-
-    G_LOCK(id_to_flvstream);
-    FLVStream *flv = g_hash_table_lookup(id_to_flvstream, stream_name);
+    /* Type (1), body length (3), timestamp (4), stream id (3), then the format
+     * byte */
+    const int format_byte_offset = 1 + 3 + 4 + 3;
 
-    /* Ok to call even if the item isn't present */
-    g_hash_table_remove(id_to_flvstream, stream_name);
-
-    G_UNLOCK(id_to_flvstream);
-
-    if (flv)
+    if (packet_len <= format_byte_offset ||
+        packet_data[0] != FLV_TAG_TYPE_AUDIO)
     {
-        g_mutex_lock(flv->d_mutex);
-        g_mutex_lock(flv->e_mutex);
-
-        g_mutex_unlock(flv->e_mutex);
-        g_mutex_unlock(flv->d_mutex);
-        destroy_flv_stream(flv);
+        return -1;
     }
+
+    return get_codec_sample_rate(packet_data[format_byte_offset]);
 }
 
 int flv_parse_tag(const unsigned char *packet_data, const int packet_len,
-    const char *stream_name, SAMPLE_BLOCK **sb)
+    FLVStream *flv, SAMPLE_BLOCK **sb)
 {
     /* For details of this format, see:
        http://osflash.org/flv
@@ -133,28 +98,10 @@ int flv_parse_tag(const unsigned char *packet_data, const int packet_len,
     gettimeofday(&start, NULL);
     gettimeofday(&t1, NULL);
 
-    G_LOCK(id_to_flvstream);
-    FLVStream *flv = g_hash_table_lookup(id_to_flvstream, stream_name);
-    G_UNLOCK(id_to_flvstream);
-
-    if (!flv)
-    {
-        /* We'll require that FLVStreams are only created in response to 'S'
-         * messages for now */
-        g_warning("(%s:%d) No FLVStream found for stream %s - aborting",
-            __FILE__, __LINE__, stream_name);
-        return -1;
-    }
-
-    /* Only one thread should work on this stream at a time */
-
-    /* The locking situation isn't as bad as it is in conversation.c --
-     * FLVStreams are only created/destroyed while holding a lock on the parent
-     * conversation, so they shouldn't be destroyed from under us between
-     * obtaining flv above, and using it below. This probably makes locking flv
-     * unnecessary, but we'll keep it here for now */
+    g_return_val_if_fail(flv != NULL, -1);
 
-    g_mutex_lock(flv->d_mutex);
+    /* No locking - the caller is on the strand for flv's side of its
+     * conversation, which is the only place flv is ever decoded */
 
     unsigned char type_code, type;
     int offset = 0;
@@ -219,33 +166,18 @@ int flv_parse_tag(const unsigned char *packet_data, const int packet_len,
                 goto exit;
             }
 
-            FLV_LOG("Setting up encode context\n");
-            if (setup_encode_context(flv))
-            {
-                FLV_LOG("Error setting up encode context\n");
-                goto exit;
-            }
+            /* The encoder catches up in flv_create_tag() - it may still be
+             * busy with the previous packet */
         }
 
-        /* ffmpeg claims that memory should be 16-byte aligned for decoding, but
-         * it seems to make no difference speed-wise either way */
-        uint8_t *aligned;
-        int pos_ret;
-        pos_ret = posix_memalign((void **)&aligned, 16,
-            bodyLength+FF_INPUT_BUFFER_PADDING_SIZE);
-        if (pos_ret)
-        {
-            g_warning("posix_memalign failed with value %d", pos_ret);
-            goto exit;
-        }
-        memset(aligned, 0, bodyLength+FF_INPUT_BUFFER_PADDING_SIZE);
-        memcpy(aligned, packet_data+offset+flv->d_flags_size,
-            bodyLength-flv->d_flags_size);
-
-        /* The codec context should be set at this point. Convert data */
+        /* Decode straight out of the message. It's followed by the tag's
+         * previous-size field and IMO_INPUT_PADDING more bytes, which covers
+         * the padding ffmpeg asks for below. ffmpeg also claims that memory
+         * should be 16-byte aligned for decoding, but it seems to make no
+         * difference speed-wise either way */
         AVPacket avpkt;
         av_init_packet(&avpkt);
-        avpkt.data = aligned; //packet_data+offset+flv->d_flags_size;
+        avpkt.data = (uint8_t *)packet_data+offset+flv->d_flags_size;
         avpkt.size = bodyLength-flv->d_flags_size;
 
         /* libspeex forces us to use a buffer this large to decode a
@@ -289,8 +221,6 @@ int flv_parse_tag(const unsigned char *packet_data, const int packet_len,
 
         FLV_LOG("Bytes decoded: %d\n", bytesDecoded);
 
-        free(aligned);
-
         if (bytesDecoded > 0)
         {
             int numSamples;
@@ -309,7 +239,7 @@ int flv_parse_tag(const unsigned char *packet_data, const int packet_len,
             {
                 /* Need to resample */
                 FLV_LOG("Resampling from %d to %d Hz\n",
-                    flv->d_codec_ctx->sample_rate, globals.sample_rate);
+                    flv->d_codec_ctx->sample_rate, flv->sample_rate);
 
                 gettimeofday(&t1, NULL);
 
@@ -375,8 +305,6 @@ int flv_parse_tag(const unsigned char *packet_data, const int packet_len,
     }
 
 exit:
-    g_mutex_unlock(flv->d_mutex);
-
     gettimeofday(&end, NULL);
     d_us = delta(&start, &end);
 
@@ -386,7 +314,7 @@ exit:
 }
 
 int flv_create_tag(unsigned char **flv_packet, int *packet_len,
-    const char *stream_name, SAMPLE_BLOCK *sb)
+    FLVStream *flv, unsigned char format_byte, SAMPLE_BLOCK *sb)
 {
     /* This should always only create FLV tags of type 'A' */
 
@@ -395,18 +323,35 @@ int flv_create_tag(unsigned char **flv_packet, int *packet_len,
 
     char *hex;
 
-    G_LOCK(id_to_flvstream);
-    FLVStream *flv = g_hash_table_lookup(id_to_flvstream, stream_name);
-    G_UNLOCK(id_to_flvstream);
-    if (!flv)
+    g_return_val_if_fail(flv != NULL, -1);
+
+    /* No locking, as in flv_parse_tag() */
+
+    /* Complexity only changes between packets, so nothing is encoded half at
+     * one level and half at another */
+    int complexity = governor_complexity();
+
+    if (flv->e_format_byte != format_byte)
     {
-        g_warning("FLVStream not found for stream %s for encoding - aborting",
-            stream_name);
-        return -1;
+        FLV_LOG("Setting up encode context\n");
+        flv->e_complexity = complexity;
+        if (setup_encode_context(flv, format_byte))
+        {
+            FLV_LOG("Error setting up encode context\n");
+            return -1;
+        }
+    }
+    else if (flv->e_complexity != complexity)
+    {
+        FLV_LOG("Changing encoder complexity: %d -> %d\n", flv->e_complexity,
+            complexity);
+        if (set_encode_complexity(flv, complexity))
+        {
+            return -1;
+        }
     }
 
-    /* Only one thread should work on this stream at a time */
-    g_mutex_lock(flv->e_mutex);
+    governor_count_encode(flv->e_complexity);
 
     SAMPLE *sample_buf = sb->s;
     int numSamples = sb->count;
@@ -421,7 +366,7 @@ int flv_create_tag(unsigned char **flv_packet, int *packet_len,
     if (flv->e_resample_ctx)
     {
         FLV_LOG("Resampling from %d to %d Hz\n",
-                globals.sample_rate, flv->d_codec_ctx->sample_rate);
+                flv->sample_rate, flv->e_codec_ctx->sample_rate);
 
         int newrate_num_samples = audio_resample(flv->e_resample_ctx,
                 resampled, sb->s, sb->count);
@@ -458,7 +403,8 @@ int flv_create_tag(unsigned char **flv_packet, int *packet_len,
     /* We have our audio data (Body part of an FLV tag). Time to create the
      * tag. */
     *packet_len = 1 + 3 + 3 + 1 + 3 + bodyLength + 4;
-    *flv_packet = malloc(*packet_len);
+    /* With room for the imo header, so the reply is built around it */
+    *flv_packet = imo_body_alloc(*packet_len);
 
     FLV_LOG("Return flv packet len: %d\n", *packet_len);
 
@@ -481,7 +427,7 @@ int flv_create_tag(unsigned char **flv_packet, int *packet_len,
     *(*flv_packet + offset++) = 0;
 
     /* Format byte */
-    *(*flv_packet + offset++) = flv->d_format_byte;
+    *(*flv_packet + offset++) = flv->e_format_byte;
 
     /* Body */
     memcpy((*flv_packet + offset), encoded_audio, bytesEncoded);
@@ -496,6 +442,5 @@ int flv_create_tag(unsigned char **flv_packet, int *packet_len,
     free(hex);
 
 exit:
-    g_mutex_unlock(flv->e_mutex);
     return 0;
 }
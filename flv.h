@@ -80,6 +80,8 @@ enum {
 
 /// Context for decoding/encoding an FLV stream
 typedef struct FLVStream {
+    int sample_rate;              /**< Rate we echo-cancel this stream at */
+
     /* Decode */
     unsigned char d_format_byte; /**< The last format byte received */
     int d_flags_size;             /**< contained in format byte */
@@ -87,57 +89,93 @@ typedef struct FLVStream {
     struct ReSampleContext *d_resample_ctx; // NULL if not needed
 
     /* Encode */
+    unsigned char e_format_byte; /**< Format byte e_codec_ctx was set up for */
+    int e_complexity;             /**< Compression level it was opened with */
     struct AVCodecContext *e_codec_ctx;
     struct ReSampleContext *e_resample_ctx;
 
-    /** Both libavcodec and libspeex are reentrant, but not
-     * thread-safe. */
-    GMutex *d_mutex, *e_mutex;
+    /* Both libavcodec and libspeex are reentrant, but not thread-safe. An
+     * FLVStream belongs to one side of a conversation, and is only used from
+     * that side's strands, so there's no lock here. Decoding only touches the
+     * d_ fields and encoding only the e_ fields, so the two may run at the
+     * same time on different threads (see --pipeline) */
 } FLVStream;
 
 struct SAMPLE_BLOCK;
 
+void flv_parse_header(void);
+
 /**
- * Must be called before using any of the functions in flv.c.
+ * Set up the codec state for a new stream. The FLVStream lives in whatever
+ * owns the stream - flv.c doesn't keep track of them.
  *
+ * @param flv The stream to set up.
  */
-void flv_init(void);
+void flv_start_stream(FLVStream *flv);
 
-void flv_parse_header(void);
+/**
+ * Free the codec state for a stream. Nothing may be using it.
+ */
+void flv_end_stream(FLVStream *flv);
 
-void flv_start_stream(const char *stream_name);
-void flv_end_stream(const char *stream_name);
+/**
+ * Set the rate samples are decoded to and encoded from for a stream. Must be
+ * called before the first audio tag is parsed for the stream - codec contexts
+ * are not rebuilt.
+ *
+ * @param flv The stream.
+ * @param sample_rate The echo cancellation rate for the stream.
+ */
+void flv_set_sample_rate(FLVStream *flv, int sample_rate);
+
+/**
+ * Find the native sample rate of the codec used by an FLV audio tag, without
+ * decoding it.
+ *
+ * @param packet_data The FLV packet data.
+ * @param packet_len The length of the FLV packet data in bytes.
+ *
+ * @return The codec's sample rate, or -1 if this isn't a usable audio tag.
+ */
+int flv_get_audio_sample_rate(const unsigned char *packet_data,
+    const int packet_len);
 
 /**
  * Given an FLV tag, decode it and create a SAMPLE_BLOCK if possible, possibly
- * resampling in the process.
+ * resampling in the process. The tag is decoded in place.
  *
  * \note Caller must free sb.
  *
- * @param packet_data The FLV packet data.
+ * @param packet_data The FLV packet data, followed by at least
+ * IMO_INPUT_PADDING readable bytes, as messages from wowza are.
  * @param packet_len The length of the FLV packet data in bytes.
- * @param stream_name The name of the stream this packet is associated with.
+ * @param flv The stream this packet is associated with.
  * @param sb The address of a SAMPLE_BLOCK pointer to allocate to contain the
  * decoded samples.
  *
  * @return zero on success, nonzero on failure.
  */int flv_parse_tag(const unsigned char *packet_data, const int packet_len,
-    const char *stream_name, struct SAMPLE_BLOCK **sb);
+    FLVStream *flv, struct SAMPLE_BLOCK **sb);
 
 /**
- * Given a SAMPLE_BLOCK and stream name, create an FLV packet ready to be packed
- * into an imo message.
+ * Given a SAMPLE_BLOCK and stream, create an FLV packet ready to be packed
+ * into an imo message. The encoder is set up (again) whenever format_byte
+ * differs from the one it was last set up for, and reopened at the
+ * complexity the governor asks for when that changes.
  *
- * \note Caller must free flv_packet.
+ * \note Caller must free flv_packet with imo_body_free(), or hand it to
+ * create_imo_message_around().
  *
  * @param flv_packet Address of the packet to create.
  * @param packet_len Will contain the length of the created packet.
- * @param stream_name Used to look up the encoding context.
+ * @param flv The stream to encode for.
+ * @param format_byte Format byte of the tag sb was decoded from - the
+ * stream's d_format_byte right after flv_parse_tag() returned it.
  * @param sb The samples to include in this packet.
  *
  * @return Zero on success, non-zero on failure.
  */
 int flv_create_tag(unsigned char **flv_packet, int *packet_len,
-    const char *stream_name, struct SAMPLE_BLOCK *sb);
+    FLVStream *flv, unsigned char format_byte, struct SAMPLE_BLOCK *sb);
 
 #endif
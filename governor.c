@@ -0,0 +1,115 @@
+#include <glib.h>
+
+#include "governor.h"
+
+/// Complexity encoders should use now
+static volatile gint complexity = GOVERNOR_MAX_COMPLEXITY;
+
+/// Packets encoded at each complexity since the last governor_describe()
+static volatile gint encoded[GOVERNOR_MAX_COMPLEXITY + 1];
+
+/// Packet latencies since the last governor_update()
+G_LOCK_DEFINE_STATIC(latency);
+static gint64 latency_sum = 0;
+static gint latency_count = 0;
+
+/* Only touched by governor_update() */
+static int calm_seconds = 0;
+
+void init_governor(void)
+{
+    g_atomic_int_set(&complexity, GOVERNOR_MAX_COMPLEXITY);
+    for (int i = 0; i <= GOVERNOR_MAX_COMPLEXITY; i++)
+    {
+        g_atomic_int_set(&encoded[i], 0);
+    }
+}
+
+int governor_complexity(void)
+{
+    return g_atomic_int_get(&complexity);
+}
+
+void governor_packet_done(long latency_us)
+{
+    G_LOCK(latency);
+    latency_sum += latency_us;
+    latency_count++;
+    G_UNLOCK(latency);
+}
+
+void governor_count_encode(int level)
+{
+    if (level >= GOVERNOR_MIN_COMPLEXITY && level <= GOVERNOR_MAX_COMPLEXITY)
+    {
+        g_atomic_int_inc(&encoded[level]);
+    }
+}
+
+void governor_update(int queued, int num_workers)
+{
+    G_LOCK(latency);
+    long mean_us = latency_count ? latency_sum / latency_count : 0;
+    latency_sum = 0;
+    latency_count = 0;
+    G_UNLOCK(latency);
+
+    int per_worker = queued / MAX(num_workers, 1);
+    int level = g_atomic_int_get(&complexity);
+
+    if (mean_us > GOVERNOR_HIGH_LATENCY_US || per_worker > GOVERNOR_HIGH_QUEUE)
+    {
+        calm_seconds = 0;
+        if (level > GOVERNOR_MIN_COMPLEXITY)
+        {
+            g_debug("Behind (%ld us, %d queued per worker) - encoder "
+                "complexity %d", mean_us, per_worker, level - 1);
+            g_atomic_int_set(&complexity, level - 1);
+        }
+    }
+    else if (mean_us < GOVERNOR_LOW_LATENCY_US &&
+        per_worker < GOVERNOR_LOW_QUEUE)
+    {
+        if (++calm_seconds >= GOVERNOR_RAISE_AFTER &&
+            level < GOVERNOR_MAX_COMPLEXITY)
+        {
+            g_debug("Caught up - encoder complexity %d", level + 1);
+            g_atomic_int_set(&complexity, level + 1);
+            calm_seconds = 0;
+        }
+    }
+    else
+    {
+        /* In between - stay where we are */
+        calm_seconds = 0;
+    }
+}
+
+gchar *governor_describe(void)
+{
+    /* Take what we report off the counters, as report_stats() does for
+     * drops */
+    int counts[GOVERNOR_MAX_COMPLEXITY + 1];
+    int total = 0;
+    for (int i = GOVERNOR_MIN_COMPLEXITY; i <= GOVERNOR_MAX_COMPLEXITY; i++)
+    {
+        counts[i] = g_atomic_int_get(&encoded[i]);
+        g_atomic_int_add(&encoded[i], -counts[i]);
+        total += counts[i];
+    }
+
+    if (!total)
+    {
+        return NULL;
+    }
+
+    GString *s = g_string_new("");
+    for (int i = GOVERNOR_MAX_COMPLEXITY; i >= GOVERNOR_MIN_COMPLEXITY; i--)
+    {
+        g_string_append_printf(s, "%s%d: %.1f%%",
+            i == GOVERNOR_MAX_COMPLEXITY ? "" : ", ", i,
+            100. * counts[i] / total);
+    }
+
+    return g_string_free(s, FALSE);
+}
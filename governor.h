@@ -0,0 +1,67 @@
+#ifndef _GOVERNOR_H_
+#define _GOVERNOR_H_
+
+#include <glib.h>
+
+/// Speex complexity we encode at when there's headroom - what every stream
+/// used to get
+#define GOVERNOR_MAX_COMPLEXITY (4)
+/// Lowest we go. 1 costs about a third of 4, and still sounds like speech
+#define GOVERNOR_MIN_COMPLEXITY (1)
+
+/// Mean time from a packet arriving to its reply being queued, in
+/// microseconds, above which we lower complexity...
+#define GOVERNOR_HIGH_LATENCY_US (20000)
+/// ...and below which we may raise it again
+#define GOVERNOR_LOW_LATENCY_US (8000)
+
+/// Messages waiting per worker above which we lower complexity, and
+/// below which we may raise it again
+#define GOVERNOR_HIGH_QUEUE (8)
+#define GOVERNOR_LOW_QUEUE (2)
+
+/// Seconds in a row with headroom before we raise complexity a step. We lower
+/// it a step every second we're over, so we back off fast and recover slowly
+#define GOVERNOR_RAISE_AFTER (10)
+
+void init_governor(void);
+
+/**
+ * The complexity encoders should use for their next packet. Streams pick up a
+ * change between packets - see flv_create_tag().
+ */
+int governor_complexity(void);
+
+/**
+ * Record how long a packet took, from arriving to its reply being queued.
+ * Called from any thread.
+ *
+ * @param latency_us The packet's latency in microseconds.
+ */
+void governor_packet_done(long latency_us);
+
+/**
+ * Record that a packet was encoded at the given complexity, for
+ * governor_describe(). Called from any thread.
+ */
+void governor_count_encode(int complexity);
+
+/**
+ * Move complexity a step down if we're falling behind, or up if we've had
+ * headroom for a while. Call about once a second, from one thread.
+ *
+ * @param queued Messages waiting to be handled, across all workers.
+ * @param num_workers Threads handling them.
+ */
+void governor_update(int queued, int num_workers);
+
+/**
+ * Describe how many packets were encoded at each complexity since the last
+ * call, and reset the counts.
+ *
+ * @return The description, or NULL if nothing was encoded. Caller must
+ * g_free() it.
+ */
+gchar *governor_describe(void);
+
+#endif
@@ -20,18 +20,20 @@ hybrid *get_hybrid(char *hid)
     hybrid *h = g_hash_table_lookup(id_to_hybrid, hid);
     if (!h)
     {
-        h = hybrid_new();
+        h = hybrid_new(globals.sample_rate);
         g_hash_table_insert(id_to_hybrid, g_strdup(hid), h);
     }
     return h;
 }
 
-hybrid *hybrid_new(void)
+hybrid *hybrid_new(int sample_rate)
 {
     hybrid *h = malloc(sizeof(hybrid));
 
-    h->tx_buf = cbuffer_init(20 * globals.sample_rate * NUM_CHANNELS);
-    h->rx_buf = cbuffer_init(20 * globals.sample_rate * NUM_CHANNELS);
+    h->sample_rate = sample_rate;
+
+    h->tx_buf = cbuffer_init(20 * sample_rate * NUM_CHANNELS);
+    h->rx_buf = cbuffer_init(20 * sample_rate * NUM_CHANNELS);
 
     h->tx_count = 0;
     h->rx_count = 0;
@@ -76,7 +78,7 @@ void hybrid_destroy(hybrid *h)
 
 void hybrid_setup_echo_cancel(hybrid *h)
 {
-    h->e = echo_create(h);
+    h->e = echo_create(h, h->sample_rate, globals.echo_path);
 }
 
 void hybrid_put_tx_samples(hybrid *h, SAMPLE_BLOCK *sb)
@@ -152,7 +154,7 @@ void hybrid_simulate_tx_delay(hybrid *h, float ms)
 {
     /* Dummy initial data to simulate delay */
     int i;
-    for (i=0; i<(ms * globals.sample_rate * NUM_CHANNELS)/1000.0; i++)
+    for (i=0; i<(ms * h->sample_rate * NUM_CHANNELS)/1000.0; i++)
     {
         cbuffer_push(h->tx_buf, SAMPLE_SILENCE);
     }
@@ -162,7 +164,7 @@ void hybrid_simulate_rx_delay(hybrid *h, float ms)
 {
     /* Dummy initial data to simulate delay */
     int i;
-    for (i=0; i<(ms * globals.sample_rate * NUM_CHANNELS)/1000.0; i++)
+    for (i=0; i<(ms * h->sample_rate * NUM_CHANNELS)/1000.0; i++)
     {
         cbuffer_push(h->rx_buf, SAMPLE_SILENCE);
     }
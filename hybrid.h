@@ -47,6 +47,7 @@ typedef struct hybrid {
     void *rx_cb_data;
 
     struct echo *e;
+    int sample_rate;            /**< rate of the samples passing through */
 
     char *name;                 /**< stream name owning this hybrid  */
 } hybrid;
@@ -54,7 +55,7 @@ typedef struct hybrid {
 
 /* Hybrid methods */
 void init_hybrids(void);
-hybrid *hybrid_new(void);
+hybrid *hybrid_new(int sample_rate);
 hybrid *get_hybrid(char *hid);
 void hybrid_set_name(hybrid *h, char *name);
 void hybrid_destroy(hybrid *h);
@@ -6,6 +6,23 @@
 
 #include "imo_message.h"
 
+/// Most free segments we keep around. Beyond this, they go back to malloc
+#define IMO_SEGMENT_POOL (64)
+
+G_LOCK_DEFINE_STATIC(segment_pool);
+static imo_segment *free_segments = NULL;
+static int num_free_segments = 0;
+
+/// What the messages for a batch's entries set when they're destroyed. Nobody
+/// looks - the batch holds the bytes until every entry has its reply
+static volatile gint batch_entry_lease = 0;
+
+static void index_message(imo_message *msg);
+static int write_header(unsigned char *text, int total_len, char type,
+        const char *stream_name, int stream_name_len);
+static imo_message *wrap_body(char type, const char *stream_name,
+        int stream_name_len, unsigned char *body, int body_len);
+
 /* Header format:
    Message length (including header)      - 4 bytes (big-endian)
    Type                                   - 1 byte
@@ -13,51 +30,134 @@
    Stream name                            - variable length
 */
 
-/* Caller must free stream_name and packet_data */
-/* TODO: error checking would be good */
-void decode_imo_message(const imo_message *msg, char *type,
-        char **stream_name, unsigned char **packet_data, int *packet_len)
+int imo_message_peek(const imo_message *msg, char *type,
+        const char **stream_name, int *name_len,
+        const unsigned char **packet_data, int *data_len)
 {
-    int offset = 4;             /* sizeof(int) on java */
-    unsigned char *text = msg->text;
-    *type = text[offset++];
+    if (!msg->type)
+    {
+        return -1;
+    }
 
-    int stream_name_length = (int)text[offset++];
+    *type = msg->type;
+    *stream_name = (const char *)msg->name.data;
+    *name_len = msg->name.len;
+    *packet_data = msg->body.data;
+    *data_len = msg->body.len;
 
-    *stream_name = malloc(stream_name_length+1); /* trailing \0 */
+    return 0;
+}
 
-    memcpy(*stream_name, text+offset, stream_name_length);
-    (*stream_name)[stream_name_length] = '\0';
+/* Find the type, name and body of a new message */
+static void index_message(imo_message *msg)
+{
+    const unsigned char *text = msg->text;
+
+    msg->type = 0;
+    msg->name.data = msg->body.data = NULL;
+    msg->name.len = msg->body.len = 0;
 
-    offset += stream_name_length;
+    if (msg->length < 6 || 6 + (int)text[5] > msg->length)
+    {
+        return;
+    }
 
-    /* account for header */
-    *packet_len = msg->length - (6+stream_name_length);
+    msg->type = text[4];
+    msg->name.data = text + 6;
+    msg->name.len = text[5];
+    msg->body.len = msg->length - (6 + msg->name.len);
+    msg->body.data = msg->body.len ? text + 6 + msg->name.len : NULL;
+}
 
-    if (*packet_len)
+unsigned int imo_message_conversation_hash(const imo_message *msg)
+{
+    if (msg->length < 6)
     {
-        *packet_data = malloc(*packet_len);
-        memcpy(*packet_data, text+offset, *packet_len);
+        return imo_conversation_hash("", 0);
     }
-    else
+
+    int stream_name_length = (int)msg->text[5];
+    return imo_conversation_hash((const char *)msg->text + 6,
+        MIN(stream_name_length, msg->length - 6));
+}
+
+unsigned int imo_conversation_hash(const char *stream_name, int name_len)
+{
+    /* Same function as g_str_hash */
+    unsigned int hash = 5381;
+    const unsigned char *p = (const unsigned char *)stream_name;
+    const unsigned char *end = p + name_len;
+
+    for (; p < end && *p != ':'; p++)
     {
-        /* g_debug("Got an imo message with zero packet len (type %c)", *type); */
-        *packet_data = NULL;
+        hash = (hash << 5) + hash + *p;
     }
+
+    return hash;
 }
 
-/* returned imo_message must eventually be freed */
-imo_message *create_imo_message(char type,
-        const char *stream_name, unsigned char *packet_data, int packet_len)
+guint32 imo_message_handle(const imo_message *msg)
 {
-    int stream_name_len = strlen(stream_name); // Hope this fits in a byte
-    int total_len = 4 + 1 + 1 + stream_name_len + packet_len;
-    int offset;
-    uint32_t msg_len_be = htonl(total_len);
+    guint32 handle_be;
 
-    unsigned char *text;
+    if (msg->name.len != IMO_HANDLE_LEN)
+    {
+        return 0;
+    }
+
+    memcpy(&handle_be, msg->name.data, IMO_HANDLE_LEN);
+    return ntohl(handle_be);
+}
+
+void decode_start_params(const unsigned char *data, int data_len,
+        imo_start_params *params)
+{
+    params->sample_rate = 0;
+    params->handles = 0;
+    params->pcm = 0;
+
+    if (!data || data_len <= 0)
+    {
+        return;
+    }
+
+    gchar *text = g_strndup((const gchar *)data, data_len);
+    gchar **pairs = g_strsplit(text, ";", 0);
+
+    for (int i = 0; pairs[i]; i++)
+    {
+        gchar **key_and_value = g_strsplit(pairs[i], "=", 2);
+
+        if (key_and_value[0] && key_and_value[1])
+        {
+            if (!strcmp("rate", key_and_value[0]))
+            {
+                params->sample_rate = atoi(key_and_value[1]);
+            }
+            else if (!strcmp("handles", key_and_value[0]))
+            {
+                params->handles = atoi(key_and_value[1]);
+            }
+            else if (!strcmp("pcm", key_and_value[0]))
+            {
+                params->pcm = atoi(key_and_value[1]);
+            }
+        }
+
+        g_strfreev(key_and_value);
+    }
+
+    g_strfreev(pairs);
+    g_free(text);
+}
+
+/* Write a message header at text, and return its length */
+static int write_header(unsigned char *text, int total_len, char type,
+        const char *stream_name, int stream_name_len)
+{
+    uint32_t msg_len_be = htonl(total_len);
+    int offset;
 
-    text = malloc(total_len);
     memcpy(text, &msg_len_be, 4); /* 4 bytes exactly, not sizeof(int) */
     offset = 4;
 
@@ -68,6 +168,20 @@ imo_message *create_imo_message(char type,
     memcpy(text+offset, stream_name, stream_name_len);
     offset += stream_name_len;
 
+    return offset;
+}
+
+/* returned imo_message must eventually be freed */
+imo_message *create_imo_message(char type,
+        const char *stream_name, unsigned char *packet_data, int packet_len)
+{
+    int stream_name_len = strlen(stream_name); // Hope this fits in a byte
+    int total_len = 4 + 1 + 1 + stream_name_len + packet_len;
+
+    unsigned char *text = malloc(total_len);
+    int offset = write_header(text, total_len, type, stream_name,
+        stream_name_len);
+
     memcpy(text+offset, packet_data, packet_len);
 
     imo_message *msg = create_imo_message_from_text(text, total_len);
@@ -75,14 +189,116 @@ imo_message *create_imo_message(char type,
     return msg;
 }
 
+unsigned char *imo_body_alloc(int body_len)
+{
+    return (unsigned char *)malloc(IMO_MAX_HEADER + body_len) +
+        IMO_MAX_HEADER;
+}
+
+void imo_body_free(unsigned char *body)
+{
+    if (body)
+    {
+        free(body - IMO_MAX_HEADER);
+    }
+}
+
+imo_message *create_imo_message_around(char type, const char *stream_name,
+        unsigned char *body, int body_len)
+{
+    return wrap_body(type, stream_name, MIN(strlen(stream_name), 255), body,
+        body_len);
+}
+
+imo_message *create_imo_message_around_handle(char type, guint32 handle,
+        unsigned char *body, int body_len)
+{
+    guint32 handle_be = htonl(handle);
+
+    return wrap_body(type, (const char *)&handle_be, IMO_HANDLE_LEN, body,
+        body_len);
+}
+
+/* Write a header in front of a body from imo_body_alloc() */
+static imo_message *wrap_body(char type, const char *stream_name,
+        int stream_name_len, unsigned char *body, int body_len)
+{
+    int header_len = 4 + 1 + 1 + stream_name_len;
+    unsigned char *text = body - header_len;
+
+    write_header(text, header_len + body_len, type, stream_name,
+        stream_name_len);
+
+    imo_message *msg = create_imo_message_from_text(text,
+        header_len + body_len);
+    msg->block = body - IMO_MAX_HEADER;
+
+    return msg;
+}
+
 imo_message *create_imo_message_from_text(unsigned char *text, int msg_len)
 {
-    imo_message *msg = malloc(sizeof(imo_message));
+    imo_message *msg = g_slice_new(imo_message);
+
+    msg->text = text;
+    msg->length = msg_len;
+    gettimeofday(&msg->ts, NULL);
+    msg->origin = IMO_ORIGIN_NONE;
+    msg->batch = NULL;
+    msg->batch_index = 0;
+    msg->segment = NULL;
+    msg->lease = NULL;
+    msg->block = text;
+    msg->next = NULL;
+
+    index_message(msg);
+
+    return msg;
+}
+
+imo_message *create_imo_message_in_segment(imo_segment *seg,
+        unsigned char *text, int msg_len, const struct timeval *ts)
+{
+    imo_message *msg = g_slice_new(imo_message);
 
     msg->text = text;
     msg->length = msg_len;
-    msg->ts = malloc(sizeof(struct timeval));
-    gettimeofday(msg->ts, NULL);
+    msg->ts = *ts;
+    msg->origin = IMO_ORIGIN_NONE;
+    msg->batch = NULL;
+    msg->batch_index = 0;
+    msg->segment = seg;
+    msg->lease = NULL;
+    msg->block = NULL;
+    msg->next = NULL;
+
+    index_message(msg);
+
+    g_atomic_int_inc(&seg->refs);
+
+    return msg;
+}
+
+imo_message *create_imo_message_leased(unsigned char *text, int msg_len,
+        const struct timeval *ts, volatile gint *lease,
+        void (*released)(gpointer data), gpointer data)
+{
+    imo_message *msg = g_slice_new(imo_message);
+
+    msg->text = text;
+    msg->length = msg_len;
+    msg->ts = *ts;
+    msg->origin = IMO_ORIGIN_NONE;
+    msg->batch = NULL;
+    msg->batch_index = 0;
+    msg->segment = NULL;
+    msg->lease = lease;
+    msg->released = released;
+    msg->released_data = data;
+    msg->block = NULL;
+    msg->next = NULL;
+
+    index_message(msg);
 
     return msg;
 }
@@ -94,6 +310,235 @@ void imo_message_destroy(imo_message *msg)
         return;
     }
 
-    free(msg->text);
-    free(msg);
+    if (msg->segment)
+    {
+        imo_segment_unref(msg->segment);
+    }
+    else if (msg->lease)
+    {
+        g_atomic_int_set(msg->lease, 1);
+        if (msg->released)
+        {
+            msg->released(msg->released_data);
+        }
+    }
+    else
+    {
+        free(msg->block);
+    }
+    g_slice_free(imo_message, msg);
+}
+
+int imo_batch_next(const imo_message *msg, int *offset, imo_message *entry)
+{
+    uint32_t len_be;
+
+    if (msg->type != 'B' || !msg->body.data ||
+        msg->body.len - *offset < 6)
+    {
+        return -1;
+    }
+
+    const unsigned char *p = msg->body.data + *offset;
+    memcpy(&len_be, p, 4);
+    uint32_t len = ntohl(len_be);
+
+    if (len < 6 || len > (uint32_t)(msg->body.len - *offset) ||
+        6 + (uint32_t)p[5] > len || (p[4] != 'D' && p[4] != 'd'))
+    {
+        return -1;
+    }
+
+    memset(entry, 0, sizeof(imo_message));
+    entry->text = (unsigned char *)p;
+    entry->length = len;
+    entry->ts = msg->ts;
+    entry->origin = msg->origin;
+    index_message(entry);
+
+    *offset += len;
+    return 0;
+}
+
+imo_batch *imo_batch_split(imo_message *msg)
+{
+    imo_message entry;
+    int offset = 0;
+
+    /* One pass, reading each length once - a message in shared memory may
+     * change under us, so a second look could find something else. Nothing
+     * is handed out until the whole body has checked out, so a bad entry
+     * doesn't leave the good ones before it half-handled */
+    GPtrArray *entries = g_ptr_array_new();
+    while (imo_batch_next(msg, &offset, &entry) == 0)
+    {
+        imo_message *e = create_imo_message_leased(entry.text, entry.length,
+            &msg->ts, &batch_entry_lease, NULL, NULL);
+        e->origin = msg->origin;
+        e->batch_index = entries->len;
+        g_ptr_array_add(entries, e);
+    }
+    if (!entries->len || offset != msg->body.len)
+    {
+        for (guint i = 0; i < entries->len; i++)
+        {
+            imo_message_destroy(g_ptr_array_index(entries, i));
+        }
+        g_ptr_array_free(entries, TRUE);
+        return NULL;
+    }
+
+    imo_batch *batch = g_slice_new(imo_batch);
+    batch->msg = msg;
+    batch->count = entries->len;
+    batch->entries = (imo_message **)g_ptr_array_free(entries, FALSE);
+    batch->replies = g_new0(imo_message *, batch->count);
+    batch->left = batch->count + 1;
+
+    for (int i = 0; i < batch->count; i++)
+    {
+        batch->entries[i]->batch = batch;
+    }
+
+    return batch;
+}
+
+gboolean imo_batch_answer(imo_message *reply)
+{
+    imo_batch *batch = reply->batch;
+
+    reply->batch = NULL;
+    batch->replies[reply->batch_index] = reply;
+
+    return imo_batch_release(batch);
+}
+
+gboolean imo_batch_release(imo_batch *batch)
+{
+    /* A full barrier, so whoever finishes the batch sees every reply */
+    return g_atomic_int_dec_and_test(&batch->left);
+}
+
+imo_message *imo_batch_reply(imo_batch *batch)
+{
+    int total_len = 4 + 1 + 1;
+
+    for (int i = 0; i < batch->count; i++)
+    {
+        total_len += batch->replies[i]->length;
+    }
+
+    unsigned char *text = malloc(total_len);
+    int offset = write_header(text, total_len, 'B', "", 0);
+
+    for (int i = 0; i < batch->count; i++)
+    {
+        imo_message *reply = batch->replies[i];
+        memcpy(text + offset, reply->text, reply->length);
+        offset += reply->length;
+        imo_message_destroy(reply);
+    }
+
+    imo_message *msg = create_imo_message_from_text(text, total_len);
+    msg->ts = batch->msg->ts;
+    msg->origin = batch->msg->origin;
+
+    /* Each entry is destroyed by whoever answered it - or was the answer */
+    imo_message_destroy(batch->msg);
+    g_free(batch->entries);
+    g_free(batch->replies);
+    g_slice_free(imo_batch, batch);
+
+    return msg;
+}
+
+imo_segment *imo_segment_new(int size)
+{
+    imo_segment *seg = NULL;
+
+    if (size == IMO_SEGMENT_SIZE)
+    {
+        G_LOCK(segment_pool);
+        if ((seg = free_segments))
+        {
+            free_segments = seg->next;
+            num_free_segments--;
+        }
+        G_UNLOCK(segment_pool);
+    }
+
+    if (!seg)
+    {
+        seg = malloc(sizeof(imo_segment) + size + IMO_INPUT_PADDING);
+        seg->size = size;
+        /* Never read into, so it stays zero */
+        memset(seg->data + size, 0, IMO_INPUT_PADDING);
+    }
+
+    seg->refs = 1;
+    seg->next = NULL;
+
+    return seg;
+}
+
+void imo_segment_unref(imo_segment *seg)
+{
+    if (!g_atomic_int_dec_and_test(&seg->refs))
+    {
+        return;
+    }
+
+    if (seg->size == IMO_SEGMENT_SIZE)
+    {
+        G_LOCK(segment_pool);
+        if (num_free_segments < IMO_SEGMENT_POOL)
+        {
+            seg->next = free_segments;
+            free_segments = seg;
+            num_free_segments++;
+            seg = NULL;
+        }
+        G_UNLOCK(segment_pool);
+    }
+
+    free(seg);                  /* NULL if it went back in the pool */
+}
+
+void imo_queue_init(imo_queue *q)
+{
+    q->head = q->tail = NULL;
+    q->length = 0;
+}
+
+void imo_queue_push(imo_queue *q, imo_message *msg)
+{
+    msg->next = NULL;
+    if (q->tail)
+    {
+        q->tail->next = msg;
+    }
+    else
+    {
+        q->head = msg;
+    }
+    q->tail = msg;
+    q->length++;
+}
+
+imo_message *imo_queue_pop(imo_queue *q)
+{
+    imo_message *msg = q->head;
+
+    if (msg)
+    {
+        q->head = msg->next;
+        if (!q->head)
+        {
+            q->tail = NULL;
+        }
+        msg->next = NULL;
+        q->length--;
+    }
+
+    return msg;
 }
@@ -1,31 +1,305 @@
 #ifndef _IMO_MESSAGE_H_
 #define _IMO_MESSAGE_H_
 
+#include <glib.h>
+#include <sys/time.h>
+
+/// Size of the blocks messages from wowza are read into
+#define IMO_SEGMENT_SIZE (64 * 1024)
+
+/// Longest message we'll take from wowza. Far more than a 'B' message full of
+/// audio needs - a length beyond it means the stream is corrupt
+#define IMO_MAX_MESSAGE_LEN (1024 * 1024)
+
+/// Readable bytes guaranteed past the end of every message read from wowza,
+/// so codecs can decode FLV bodies in place. At least libavcodec's
+/// FF_INPUT_BUFFER_PADDING_SIZE - flv.c checks
+#define IMO_INPUT_PADDING (32)
+
+/// Most bytes a message header takes: length, type, name length and name
+#define IMO_MAX_HEADER (4 + 1 + 1 + 255)
+
+/// A block of bytes read from wowza. Messages are framed in place, so the
+/// block can't be reused until every message in it is destroyed - the reader
+/// holds one reference while it's filling it, and each message another.
+typedef struct imo_segment {
+    volatile gint refs;
+    int size;                   /**< Bytes in data */
+    struct imo_segment *next;   /**< In the pool of free segments */
+    unsigned char data[];       /**< size bytes, then IMO_INPUT_PADDING
+                                     zeroes */
+} imo_segment;
+
+/// The origin of a message we made up ourselves, rather than read from wowza.
+/// Sending one sends it to every connection
+#define IMO_ORIGIN_NONE (-1)
+
+/// Bytes of a stream handle in place of a stream name. An 'S' message asking
+/// for "handles=1" gets an 'H' message back for its stream, whose body is the
+/// stream's handle, big-endian. The client may then send 'd' messages -
+/// the same as 'D', but with the handle as the stream name - and gets 'd'
+/// replies. Clients which don't ask never see either, so older ones work as
+/// before, and a client which gets no 'H' from an older shard keeps using
+/// names
+#define IMO_HANDLE_LEN (4)
+
+/// A 'B' message carries several audio messages in one frame, for clients
+/// with many streams on one connection. It has no stream name, and its body is
+/// the entries back to back, each a complete 'D' or 'd' message in the usual
+/// format. It's answered with one 'B' holding the reply to each entry, in the
+/// same order. Only clients which send 'B' messages get them.
+struct imo_batch;
+
+/// Part of a message's bytes, in place. Valid as long as the message is
+typedef struct imo_slice {
+    const unsigned char *data;
+    int len;
+} imo_slice;
+
 /// A message to/from Wowza
 typedef struct imo_message {
     unsigned char *text;        /**< Message bytes */
     int length;                 /**< Length of text */
-    struct timeval *ts;         /**< Timestamp of message arrival */
+    struct timeval ts;          /**< Timestamp of message arrival */
+
+    /* Found once, when the message is created. type is 0 if the message is
+     * too short for the lengths it contains */
+    char type;
+    imo_slice name;             /**< Stream name. Not NUL-terminated */
+    imo_slice body;             /**< FLV tag for 'D' messages. NULL data if
+                                     empty */
+
+    int origin;                 /**< Connection it was read from, which
+                                     replies to it go back to - see
+                                     interface_tcp.h */
+
+    struct imo_batch *batch;    /**< The 'B' message this is an entry of,
+                                     or the reply to an entry of. NULL
+                                     otherwise */
+    int batch_index;            /**< Which entry */
+
+    imo_segment *segment;       /**< Holds text, if it was read from wowza */
+    volatile gint *lease;       /**< Or if it's in someone else's memory,
+                                     what to set when we're done with it */
+    void (*released)(gpointer data); /**< Called once lease is set, to tell
+                                     its owner. NULL if it needn't be */
+    gpointer released_data;
+    unsigned char *block;       /**< Otherwise, what to free() text with */
+    struct imo_message *next;   /**< Next in whichever imo_queue it's on */
 } imo_message;
 
+/// FIFO of messages, linked through the messages themselves. Not thread-safe
+typedef struct imo_queue {
+    imo_message *head;
+    imo_message *tail;
+    int length;
+} imo_queue;
+
 /**
- * Parse an incoming imo message and extract the FLV tag, if any.
+ * Find the parts of an incoming imo message in place, without copying anything
+ * out. The pointers are into msg->text, and are valid as long as msg is. The
+ * body of a message read from wowza is followed by at least IMO_INPUT_PADDING
+ * readable bytes.
  *
  * @param msg The incoming message.
- * @param type Will be set to the type of the imo message - 'S', 'D', or 'E'.
- * @param stream_name Will be set to the name of the stream contained in the
- * message. Must be freed by caller
- * @param packet_data Will be set to the embedded FLV tag, or NULL if no FLV tag
- * is present. Must be freed by caller.
- * @param data_len Will be set to the length of the embedded FLV tag.
+ * @param type Will be set to the type of the imo message.
+ * @param stream_name Will point to the stream name. Not NUL-terminated.
+ * @param name_len Will be set to the length of the stream name.
+ * @param packet_data Will point to the body (an FLV tag for 'D' messages), or
+ * be NULL if there isn't one.
+ * @param data_len Will be set to the length of the body.
+ *
+ * @return Zero on success, non-zero if the message is too short for the
+ * lengths it contains.
+ */
+int imo_message_peek(const imo_message *msg, char *type,
+        const char **stream_name, int *name_len,
+        const unsigned char **packet_data, int *data_len);
+
+/**
+ * Hash the conversation id of a message's stream name (the part before the
+ * ':'), without copying it out. Both sides of a conversation hash the same.
+ *
+ * @param msg The message.
+ *
+ * @return The hash value.
  */
-void decode_imo_message(const imo_message *msg, char *type,
-        char **stream_name, unsigned char **packet_data, int *data_len);
+unsigned int imo_message_conversation_hash(const imo_message *msg);
+
+/**
+ * The same hash, of a stream name or conversation id which isn't in a
+ * message. Stops at the ':', if there is one.
+ */
+unsigned int imo_conversation_hash(const char *stream_name, int name_len);
+
+/**
+ * The stream handle a 'd' message carries in place of its stream name.
+ *
+ * @return The handle, or 0 (never a valid handle) if the name isn't
+ * IMO_HANDLE_LEN bytes.
+ */
+guint32 imo_message_handle(const imo_message *msg);
+
+/// Options a client may send as the body of an 'S' message
+typedef struct imo_start_params {
+    int sample_rate;            /**< "rate=N" - 0 if not given */
+    int handles;                /**< "handles=1" - send the stream's handle
+                                     back in an 'H' message. See
+                                     IMO_HANDLE_LEN */
+    int pcm;                    /**< "pcm=1" - the stream sends raw PCM
+                                     bodies (see pcm.h) rather than FLV
+                                     tags, and gets them back. Accepted
+                                     with a 'P' message whose body is
+                                     "rate=N", the rate the samples must be
+                                     at. A client which gets no 'P' - from
+                                     an older shard - must send FLV */
+} imo_start_params;
+
+/**
+ * Parse the body of an 'S' message. The body is optional, and consists of
+ * "key=value" pairs separated by ';'. Unknown keys are ignored, so older
+ * servers can talk to newer clients.
+ *
+ * @param data The body of the 'S' message, or NULL.
+ * @param data_len Length of data.
+ * @param params Will be filled in with the options found, or defaults.
+ */
+void decode_start_params(const unsigned char *data, int data_len,
+        imo_start_params *params);
 
 imo_message *create_imo_message(char type,
         const char *stream_name, unsigned char *packet_data, int packet_len);
 
+/**
+ * Allocate a message body with room in front for the header, so a message can
+ * be built around it with create_imo_message_around() instead of copying it.
+ *
+ * @param body_len Bytes of body.
+ *
+ * @return The body. Free it with imo_body_free() if it doesn't become a
+ * message.
+ */
+unsigned char *imo_body_alloc(int body_len);
+void imo_body_free(unsigned char *body);
+
+/**
+ * Create a message by writing its header in front of a body from
+ * imo_body_alloc(). Takes body.
+ */
+imo_message *create_imo_message_around(char type, const char *stream_name,
+        unsigned char *body, int body_len);
+
+/**
+ * Same as create_imo_message_around(), with a stream handle in place of the
+ * stream name - for replies to 'd' messages.
+ */
+imo_message *create_imo_message_around_handle(char type, guint32 handle,
+        unsigned char *body, int body_len);
+
 imo_message *create_imo_message_from_text(unsigned char *text, int msg_len);
+
+/**
+ * Create a message from bytes framed in place in a segment, without copying
+ * them. The message holds a reference to the segment until it's destroyed.
+ *
+ * @param seg The segment text is in.
+ * @param text The message's bytes, header included.
+ * @param msg_len Length of the message.
+ * @param ts When the bytes arrived.
+ */
+imo_message *create_imo_message_in_segment(imo_segment *seg,
+        unsigned char *text, int msg_len, const struct timeval *ts);
+
+/**
+ * Create a message from bytes in memory someone else owns - a shared-memory
+ * ring - without copying them. Destroying the message sets *lease to 1, so the
+ * owner knows it can reuse the bytes.
+ *
+ * @param text The message's bytes, header included.
+ * @param msg_len Length of the message.
+ * @param ts When the bytes arrived.
+ * @param lease Cleared by the owner; set once the message is destroyed.
+ * @param released Called with data once lease has been set, from whichever
+ * thread destroys the message - so an owner waiting for it needn't poll. May
+ * be NULL.
+ */
+imo_message *create_imo_message_leased(unsigned char *text, int msg_len,
+        const struct timeval *ts, volatile gint *lease,
+        void (*released)(gpointer data), gpointer data);
+
 void imo_message_destroy(imo_message *msg);
 
+/// A 'B' message split into its entries, waiting for a reply to each
+typedef struct imo_batch {
+    imo_message *msg;           /**< The 'B' message. Entries point into it */
+    int count;
+    imo_message **entries;      /**< Messages for the entries, in place */
+    imo_message **replies;      /**< Each entry's reply, as it comes in */
+    volatile gint left;         /**< Replies still to come, plus one for
+                                     whoever is handing the entries out */
+} imo_batch;
+
+/**
+ * Find the entry of a 'B' message at *offset into its body, without copying
+ * it. Start offset at 0.
+ *
+ * @param msg The 'B' message.
+ * @param offset Where the entry starts. Moved past it.
+ * @param entry Will describe the entry, in place. Valid as long as msg is.
+ *
+ * @return Zero if there was an entry, non-zero at the end of the body, or if
+ * the entry isn't a well-formed 'D' or 'd' message.
+ */
+int imo_batch_next(const imo_message *msg, int *offset, imo_message *entry);
+
+/**
+ * Split a 'B' message into a message for each entry, in place. Each is tagged
+ * with the batch, and so should its reply be. The caller holds the batch open
+ * until imo_batch_release(), so it can't be finished while the entries are
+ * still being handed out.
+ *
+ * @return The batch, which takes msg. NULL if msg isn't a well-formed 'B'
+ * message with at least one entry.
+ */
+imo_batch *imo_batch_split(imo_message *msg);
+
+/**
+ * Record the reply to an entry - reply->batch says which batch, and
+ * reply->batch_index which entry. Takes reply.
+ *
+ * @return TRUE if the batch has everything it was waiting for, and the
+ * caller should imo_batch_reply().
+ */
+gboolean imo_batch_answer(imo_message *reply);
+
+/**
+ * Let go of the hold imo_batch_split() gave the caller.
+ *
+ * @return TRUE if the batch has everything it was waiting for, and the
+ * caller should imo_batch_reply().
+ */
+gboolean imo_batch_release(imo_batch *batch);
+
+/**
+ * Make the 'B' reply to a batch, from its entries' replies, and free the
+ * batch and the message it came from.
+ */
+imo_message *imo_batch_reply(imo_batch *batch);
+
+/**
+ * Get a segment to read into, with one reference held by the caller. Segments
+ * of IMO_SEGMENT_SIZE come from a pool, so steady-state reading doesn't
+ * allocate. Bigger ones are for messages which don't fit.
+ */
+imo_segment *imo_segment_new(int size);
+void imo_segment_unref(imo_segment *seg);
+
+void imo_queue_init(imo_queue *q);
+void imo_queue_push(imo_queue *q, imo_message *msg);
+
+/**
+ * @return The message at the head of the queue, or NULL if it's empty.
+ */
+imo_message *imo_queue_pop(imo_queue *q);
+
 #endif
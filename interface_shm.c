@@ -0,0 +1,270 @@
+#include <arpa/inet.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "imo_message.h"
+#include "interface_shm.h"
+#include "kodama.h"
+#include "protocol.h"
+#include "shm.h"
+
+extern globals_t globals;
+
+/// A message read from the peer, in place. The ring up to end can be given
+/// back once done is set, and everything before it is done
+typedef struct shm_lease {
+    volatile gint done;
+    uint32_t end;
+} shm_lease;
+
+typedef struct shm_conn {
+    shm_segment seg;
+    gchar *name;
+    int origin;
+
+    /* Only touched by the connection's thread */
+    uint32_t cursor;            /**< Next byte of to_kodama to read */
+    shm_lease *leases;          /**< SHM_MAX_LEASES of them, in the order
+                                     their messages were read */
+    guint lease_head;           /**< Oldest outstanding */
+    guint lease_tail;           /**< Next to hand out */
+    imo_message *blocked;       /**< A reply there wasn't room for */
+    gboolean corrupt;           /**< The peer broke the framing */
+
+    imo_message *(*next_reply)(gpointer data);
+    void (*closed)(gpointer data);
+    gpointer data;
+} shm_conn;
+
+static gpointer shm_thread_loop(gpointer data);
+static gboolean receive_messages(shm_conn *c);
+static gboolean reclaim_leases(shm_conn *c);
+static gboolean send_replies(shm_conn *c);
+static void shm_close(shm_conn *c);
+static void lease_released(gpointer data);
+
+shm_conn *shm_connect(const char *name, int origin,
+    imo_message *(*next_reply)(gpointer data), void (*closed)(gpointer data),
+    gpointer data)
+{
+    if (globals.nothread)
+    {
+        g_warning("Shared memory connections need threads - ignoring %s",
+            name);
+        return NULL;
+    }
+
+    shm_conn *c = g_new0(shm_conn, 1);
+    if (shm_create(name, &c->seg))
+    {
+        g_free(c);
+        return NULL;
+    }
+
+    c->name = g_strdup(name);
+    c->origin = origin;
+    c->leases = malloc(SHM_MAX_LEASES * sizeof(shm_lease));
+    c->next_reply = next_reply;
+    c->closed = closed;
+    c->data = data;
+
+    if (!g_thread_create(shm_thread_loop, c, FALSE, NULL))
+    {
+        g_error("Unable to start the thread for shared memory %s", name);
+    }
+
+    g_message("Serving peers through shared memory %s", name);
+    return c;
+}
+
+void shm_wake(shm_conn *c)
+{
+    shm_doorbell(&c->seg.header->kodama_state);
+}
+
+/* Read, reclaim and write until there's nothing left to do, then sleep until
+ * the peer or a worker rings our doorbell */
+static gpointer shm_thread_loop(gpointer data)
+{
+    shm_conn *c = data;
+    shm_header *h = c->seg.header;
+
+    while (TRUE)
+    {
+        if (c->corrupt)
+        {
+            shm_close(c);
+            return NULL;
+        }
+
+        /* Not short-circuited - each has to get its turn */
+        if (receive_messages(c) | reclaim_leases(c) | send_replies(c))
+        {
+            continue;
+        }
+
+        /* Look once more before we sleep */
+        shm_prepare(&h->kodama_state);
+        if (receive_messages(c) | reclaim_leases(c) | send_replies(c) ||
+            c->corrupt)
+        {
+            shm_cancel(&h->kodama_state);
+            continue;
+        }
+
+        /* Workers wake us as they finish with the messages still out */
+        shm_sleep(&h->kodama_state, -1);
+    }
+
+    return NULL;
+}
+
+/* Dispatch whatever the peer has published since we last looked, in place */
+static gboolean receive_messages(shm_conn *c)
+{
+    shm_header *h = c->seg.header;
+    unsigned char *text;
+    uint32_t len;
+    struct timeval now;
+    gboolean any = FALSE;
+
+    while (!c->corrupt && c->lease_tail - c->lease_head < SHM_MAX_LEASES &&
+        (len = shm_next(&h->to_kodama, c->seg.to_kodama, &c->cursor, &text)))
+    {
+        if (len == SHM_CORRUPT)
+        {
+            /* There's no telling where the next message starts */
+            g_warning("Corrupt message length in %s - closing it", c->name);
+            c->corrupt = TRUE;
+            break;
+        }
+
+        if (!any)
+        {
+            /* Everything we find now arrived together, as far as we can
+             * tell */
+            gettimeofday(&now, NULL);
+            any = TRUE;
+        }
+
+        shm_lease *lease = &c->leases[c->lease_tail++ % SHM_MAX_LEASES];
+        lease->done = 0;
+        lease->end = c->cursor;
+
+        imo_message *msg = create_imo_message_leased(text, len, &now,
+            &lease->done, lease_released, c);
+        msg->origin = c->origin;
+        dispatch_imo_message(msg);
+    }
+
+    return any;
+}
+
+/* A worker has destroyed a message read from c. Only a syscall if c's thread
+ * is asleep - then it wakes to give the peer back the room */
+static void lease_released(gpointer data)
+{
+    shm_conn *c = data;
+
+    shm_doorbell(&c->seg.header->kodama_state);
+}
+
+/* Give the peer back the ring up to the oldest message still in use */
+static gboolean reclaim_leases(shm_conn *c)
+{
+    shm_header *h = c->seg.header;
+    gboolean any = FALSE;
+    uint32_t end = 0;
+
+    while (c->lease_head != c->lease_tail)
+    {
+        shm_lease *lease = &c->leases[c->lease_head % SHM_MAX_LEASES];
+        if (!g_atomic_int_get(&lease->done))
+        {
+            break;
+        }
+        end = lease->end;
+        c->lease_head++;
+        any = TRUE;
+    }
+
+    if (any)
+    {
+        shm_release(&h->to_kodama, end);
+        /* In case it's waiting for room */
+        shm_doorbell(&h->peer_state);
+    }
+
+    return any;
+}
+
+/* Copy as many replies into the peer's ring as it has room for */
+static gboolean send_replies(shm_conn *c)
+{
+    shm_header *h = c->seg.header;
+    gboolean any = FALSE;
+
+    while (TRUE)
+    {
+        imo_message *msg = c->blocked ? c->blocked : c->next_reply(c->data);
+        c->blocked = NULL;
+        if (!msg)
+        {
+            break;
+        }
+
+        if (msg->length + SHM_ALIGN > SHM_RING_SIZE)
+        {
+            g_warning("A %d byte reply won't fit in %s", msg->length,
+                c->name);
+            imo_message_destroy(msg);
+            continue;
+        }
+
+        unsigned char *dst = shm_reserve(&h->to_peer, c->seg.to_peer,
+            msg->length);
+        if (!dst)
+        {
+            /* The peer's behind. It rings our doorbell when it catches up -
+             * until then, replies wait where the workers left them */
+            c->blocked = msg;
+            break;
+        }
+
+        memcpy(dst, msg->text, msg->length);
+        shm_commit(&h->to_peer, msg->length);
+        imo_message_destroy(msg);
+        any = TRUE;
+    }
+
+    if (any)
+    {
+        shm_doorbell(&h->peer_state);
+    }
+
+    return any;
+}
+
+/* Give up on a peer which broke the framing: stop it attaching again, and
+ * have the slot drop replies from here on. The mapping stays, as workers may
+ * still be reading messages in it, or ringing our doorbell */
+static void shm_close(shm_conn *c)
+{
+    imo_message *msg;
+
+    shm_remove(c->name, &c->seg);
+    c->closed(c->data);
+
+    /* Replies queued before it closed - next_reply() drops them now */
+    if (c->blocked)
+    {
+        imo_message_destroy(c->blocked);
+        c->blocked = NULL;
+    }
+    while ((msg = c->next_reply(c->data)))
+    {
+        imo_message_destroy(msg);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef _INTERFACE_SHM_H_
+#define _INTERFACE_SHM_H_
+
+#include <glib.h>
+
+#include "shm.h"
+
+/// Most messages we can have read from a peer and not yet destroyed. Each
+/// takes at least SHM_ALIGN bytes of the ring, so the ring fills first
+#define SHM_MAX_LEASES (SHM_RING_SIZE / SHM_ALIGN)
+
+struct imo_message;
+struct shm_conn;
+
+/**
+ * Serve a peer on the same host - a media server, or shm_peer - through a
+ * shared-memory segment instead of a socket. The segment is created, and a
+ * thread of its own reads messages from the peer's ring and dispatches them
+ * in place - workers decode the FLV payloads straight out of the ring - and
+ * copies replies into the other ring. It's the connection's writer too: it
+ * calls next_reply() for each reply it has room for.
+ *
+ * @param name The segment's name, as for shm_open() - "/kodama0", say.
+ * @param origin What messages read from the peer are tagged with.
+ * @param next_reply Returns the next reply to send, or NULL if there isn't
+ * one.
+ * @param closed Called from the connection's thread if the peer breaks the
+ * rings' framing, once we've stopped reading from it. Replies to it should be
+ * dropped from then on. The thread exits once it returns.
+ * @param data Passed to next_reply and closed.
+ *
+ * @return The connection, or NULL if the segment couldn't be created, or
+ * we're running without threads.
+ */
+struct shm_conn *shm_connect(const char *name, int origin,
+    struct imo_message *(*next_reply)(gpointer data),
+    void (*closed)(gpointer data), gpointer data);
+
+/**
+ * Tell the connection's thread there's a reply waiting. Called from any
+ * thread.
+ */
+void shm_wake(struct shm_conn *c);
+
+#endif
@@ -1,140 +1,652 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "imo_message.h"
+#include "interface_shm.h"
 #include "interface_tcp.h"
+#include "interface_uring.h"
 #include "kodama.h"
 #include "protocol.h"
 #include "read_write.h"
+#include "ring.h"
 
 extern globals_t globals;
 
-static char *g_host;
-static int g_port;
-static char *g_port_str;
+/// Where a --server's connection is in being made again
+typedef enum conn_state {
+    CONN_WAITING,               /**< For the next attempt */
+    CONN_RESOLVING,             /**< Looking its address up */
+    CONN_CONNECTING,            /**< Waiting for connect() to go through */
+    CONN_CONNECTED
+} conn_state;
 
-int attempt_reconnect;
-int wowza_fd = -1;      /* TODO: we probably want something more flexible */
-GIOChannel *wowza_channel = NULL;
+/// One connection to a wowza - one we made to a --server, which we keep
+/// reconnecting, one a wowza made to our --listen port, whose slot is reused
+/// once it closes, or a --shm segment, which is only closed if its peer breaks
+/// the framing, and whose slot is never reused
+typedef struct wowza_conn {
+    int slot;                   /**< Index in conns */
+    volatile gint origin;       /**< What messages read from it are tagged
+                                     with. New each time it connects, so
+                                     replies to an earlier connection aren't
+                                     sent down this one. -1 while closed */
+    volatile int fd;            /**< -1 while closed */
+    gboolean in_use;            /**< Connected, or a --server we keep
+                                     reconnecting. Only touched by the main
+                                     thread */
 
+    /* Only for connections we make. All but retained are only touched by
+     * the main thread */
+    gchar *host;
+    int port;
+    gchar *port_str;
+    conn_state state;
+    guint backoff_ms;           /**< Wait before the next attempt, after the
+                                     last one failed. 0 once we're back */
+    guint timer;                /**< Until the next attempt, or until we give
+                                     up on connecting. 0 if neither */
+    int connecting_fd;          /**< While CONN_CONNECTING */
+    guint connect_watch;        /**< Tells us when connecting_fd is done */
+    GHashTable *retained;       /**< Stream name -> imo_queue of replies kept
+                                     while it's down. Under the retained
+                                     lock. NULL if there aren't any */
+
+    /* Reading */
+    struct shm_conn *shm;       /**< Set if it's a shared-memory segment,
+                                     whose thread reads and writes it */
+    GIOChannel *channel;        /**< NULL if its io_uring thread reads it */
+
+    /* Writing */
+    ring *replies;              /**< Replies waiting for the writer */
+    poll_parker parker;         /**< Wakes the writer */
+    gboolean writer_started;    /**< A writer thread of its own - otherwise
+                                     its io_uring thread writes */
+    guint output_watch;         /**< Our G_IO_OUT watch on channel, while
+                                     we're waiting to write in nothread mode.
+                                     0 if there isn't one */
+} wowza_conn;
+
+static wowza_conn conns[MAX_CONNECTIONS];
+/// Slots used so far. Only grows, so a reply can always find its slot
+static volatile gint num_slots = 0;
+/// Bumped each time a slot connects, to tell its connections apart
+static int generation = 0;
+
+/* Taken to decide what happens to a --server's reply while it's reconnecting,
+ * so nothing is kept once its new connection has been handed what was */
+G_LOCK_DEFINE_STATIC(retained);
+
+/// What a resolver thread found for a --server
+typedef struct resolution {
+    wowza_conn *conn;
+    int error;                  /**< From getaddrinfo() */
+    struct sockaddr_in addr;
+} resolution;
+
+static wowza_conn *new_slot(void);
+static void tcp_connect(wowza_conn *conn);
+static gpointer resolve_thread(gpointer data);
+static gboolean handle_resolved(gpointer data);
+static void start_connect(wowza_conn *conn, const struct sockaddr_in *addr);
+static gboolean
+    handle_connect(GIOChannel *source, GIOCondition cond, gpointer data);
+static gboolean handle_connect_timeout(gpointer data);
+static void connected(wowza_conn *conn, int fd);
+static void connect_failed(wowza_conn *conn, int fd, int error);
+static void reconnect_later(wowza_conn *conn);
+static gboolean handle_reconnect(gpointer data);
+static gboolean handle_lost(gpointer data);
+static void start_connection(wowza_conn *conn, int fd);
+static void connection_lost(gpointer data);
+static void shm_lost(gpointer data);
+static gboolean readdress_reply(wowza_conn *conn, imo_message *msg);
+static void retain_reply(wowza_conn *conn, imo_message *msg);
+static void expire_retained(GHashTable *retained);
+static void flush_retained(wowza_conn *conn, GHashTable *retained);
+static void send_to(wowza_conn *conn, imo_message *msg);
+static void broadcast_imo_message(imo_message *msg);
+static imo_message *pop_reply(gpointer data);
+static void take_replies(gpointer data);
+static gpointer writer_thread_loop(gpointer data);
+static gboolean
+    handle_accept(GIOChannel *source, GIOCondition cond, gpointer data);
 static gboolean
     handle_input(GIOChannel *source, GIOCondition cond, gpointer data);
 static gboolean
     handle_output(GIOChannel *source, GIOCondition cond, gpointer data);
 
-/* NOTES: when our connection to wowza dies, we should just forget all
- * information we have, and attempt to reconnect */
+/* NOTES: when our connection to a --server dies, we keep everything - its
+ * conversations, and its replies for a few seconds - and reconnect. Its wowza
+ * carries on with the same streams, so their filters needn't start over */
 
 void setup_tcp_connection(char *host, int port)
 {
-    /* Don't try to reconnect before we've connected */
-    attempt_reconnect = 0;
-
     /* Set up tables for read/write handlers */
     init_read_write();
 
-    g_host = g_strdup_printf("%s", host);
-    g_port = port;
-    g_port_str = g_strdup_printf("%d", g_port);
+    wowza_conn *conn = new_slot();
+    if (!conn)
+    {
+        g_warning("Can't connect to more than %d wowzas - ignoring %s:%d",
+            MAX_CONNECTIONS, host, port);
+        return;
+    }
 
-    tcp_connect();
+    conn->host = g_strdup_printf("%s", host);
+    conn->port = port;
+    conn->port_str = g_strdup_printf("%d", port);
+    conn->connecting_fd = -1;
+    conn->in_use = TRUE;
+
+    tcp_connect(conn);
 }
 
-/* Uses the global g_host and g_port */
-void tcp_connect(void)
+void setup_tcp_listener(int port)
 {
-    int sock_fd;
-    int error;
-    struct addrinfo hints, *result;
+    struct sockaddr_in addr;
+    int one = 1;
 
-    /* Stop trying to reconnect */
-    /* TODO: having to set this to 1 on on every failure is lame */
-    attempt_reconnect = 0;
+    init_read_write();
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        g_warning("There was an error creating a socket: %s",
+                strerror(errno));
+        return;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(listen_fd, MAX_CONNECTIONS))
+    {
+        g_warning("Unable to listen for wowza on port %d: %s", port,
+            strerror(errno));
+        close(listen_fd);
+        return;
+    }
+
+    GIOChannel *chan = g_io_channel_unix_new(listen_fd);
+    if (!g_io_add_watch(chan, G_IO_IN, handle_accept, NULL))
+    {
+        g_warning("(%s:%d) Unable to add watch on channel", __FILE__, __LINE__);
+        g_io_channel_unref(chan);
+        close(listen_fd);
+        return;
+    }
+
+    g_message("Listening for wowza on port %d", port);
+}
+
+void setup_shm_connection(const char *name)
+{
+    wowza_conn *conn = new_slot();
+    if (!conn)
+    {
+        g_warning("Can't serve more than %d wowzas - ignoring %s",
+            MAX_CONNECTIONS, name);
+        return;
+    }
+
+    generation = (generation + 1) % (G_MAXINT / MAX_CONNECTIONS);
+    int origin = generation * MAX_CONNECTIONS + conn->slot;
+
+    /* Set before anything read from it can be replied to */
+    g_atomic_int_set(&conn->origin, origin);
+    conn->shm = shm_connect(name, origin, pop_reply, shm_lost, conn);
+    if (!conn->shm)
+    {
+        g_atomic_int_set(&conn->origin, -1);
+        return;
+    }
+
+    conn->in_use = TRUE;
+}
+
+int tcp_connections(void)
+{
+    int count = 0;
+
+    for (int i = 0; i < g_atomic_int_get(&num_slots); i++)
+    {
+        if (g_atomic_int_get(&conns[i].origin) != -1)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* A slot for a new connection - one an accepted connection has finished with,
+ * or the next unused one. NULL if they're all in use. Main thread only */
+static wowza_conn *new_slot(void)
+{
+    int n = g_atomic_int_get(&num_slots);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (!conns[i].in_use)
+        {
+            return &conns[i];
+        }
+    }
+
+    if (n == MAX_CONNECTIONS)
+    {
+        return NULL;
+    }
+
+    wowza_conn *conn = &conns[n];
+    memset(conn, 0, sizeof(wowza_conn));
+    conn->slot = n;
+    conn->origin = -1;
+    conn->fd = -1;
+    if (!globals.nothread)
+    {
+        conn->replies = ring_new(RETURN_RING_SIZE);
+        if (poll_parker_init(&conn->parker))
+        {
+            g_error("Can't write to wowza without a way to wake the writer");
+        }
+    }
+
+    /* Replies look their slot up without a lock - it must be set up before
+     * they can see it */
+    g_atomic_int_set(&num_slots, n + 1);
+
+    return conn;
+}
+
+/* Uses the connection's host and port. getaddrinfo() blocks, so it's done by
+ * a thread of its own, which hands what it found back to the main loop */
+static void tcp_connect(wowza_conn *conn)
+{
+    resolution *res = g_new0(resolution, 1);
+    res->conn = conn;
+
+    conn->state = CONN_RESOLVING;
+    if (!g_thread_create(resolve_thread, res, FALSE, NULL))
+    {
+        g_warning("Can't start a thread to look up %s:%d", conn->host,
+            conn->port);
+        g_free(res);
+        reconnect_later(conn);
+    }
+}
+
+static gpointer resolve_thread(gpointer data)
+{
+    resolution *res = data;
+    struct addrinfo hints, *result;
 
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
 
-    /* Does a blocking DNS lookup */
-    error = getaddrinfo(g_host, g_port_str, &hints, &result);
-    if (error)
+    res->error = getaddrinfo(res->conn->host, res->conn->port_str, &hints,
+        &result);
+    if (!res->error)
+    {
+        memcpy(&res->addr, result->ai_addr, sizeof(res->addr));
+        freeaddrinfo(result);
+    }
+
+    g_idle_add(handle_resolved, res);
+    return NULL;
+}
+
+static gboolean handle_resolved(gpointer data)
+{
+    resolution *res = data;
+    wowza_conn *conn = res->conn;
+
+    if (res->error)
     {
         g_warning("There was an error looking up the address for %s:%d - %s",
-                g_host, g_port, gai_strerror(error));
-        attempt_reconnect = 1;
-        return;
+                conn->host, conn->port, gai_strerror(res->error));
+        reconnect_later(conn);
+    }
+    else
+    {
+        start_connect(conn, &res->addr);
     }
 
-    /* These values are all in result, but ehh */
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_free(res);
+    return FALSE;
+}
+
+/* Start connecting without waiting for it to go through - the main loop tells
+ * us when it has, in handle_connect() */
+static void start_connect(wowza_conn *conn, const struct sockaddr_in *addr)
+{
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd < 0)
     {
         g_warning("There was an error creating a socket: %s",
                 strerror(errno));
-        attempt_reconnect = 1;
+        reconnect_later(conn);
         return;
     }
 
     int flag = 1;
-    error = setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY,
-            &flag, sizeof(int));
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+    fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
 
-    error = connect(sock_fd, result->ai_addr, result->ai_addrlen);
-    if (error)
+    if (!connect(sock_fd, (const struct sockaddr *)addr, sizeof(*addr)))
+    {
+        connected(conn, sock_fd);
+        return;
+    }
+    if (errno != EINPROGRESS)
     {
-        g_warning("There was an error connecting to wowza on %s:%d (%s)"
-                " - this service will be fairly useless",
-                g_host, g_port, strerror(errno));
-        attempt_reconnect = 1;
+        connect_failed(conn, sock_fd, errno);
         return;
     }
 
-    freeaddrinfo(result);
+    /* The watch keeps the channel while it needs it. Unrefing it doesn't
+     * close sock_fd */
+    GIOChannel *chan = g_io_channel_unix_new(sock_fd);
+    conn->connect_watch = g_io_add_watch(chan, (G_IO_OUT | G_IO_HUP | G_IO_ERR),
+        handle_connect, conn);
+    g_io_channel_unref(chan);
+    if (!conn->connect_watch)
+    {
+        g_warning("(%s:%d) Unable to add watch on channel", __FILE__, __LINE__);
+        connect_failed(conn, sock_fd, EIO);
+        return;
+    }
+
+    conn->state = CONN_CONNECTING;
+    conn->connecting_fd = sock_fd;
+    conn->timer = g_timeout_add(CONNECT_TIMEOUT_MS, handle_connect_timeout,
+        conn);
+}
+
+/* The connect() start_connect() started has gone through, or failed */
+static gboolean
+handle_connect(GIOChannel *source, GIOCondition cond, gpointer data)
+{
+    wowza_conn *conn = data;
+    int fd = conn->connecting_fd;
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    UNUSED(source);
+    UNUSED(cond);
+
+    g_source_remove(conn->timer);
+    conn->timer = 0;
+    conn->connect_watch = 0;
+    conn->connecting_fd = -1;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len))
+    {
+        error = errno;
+    }
+
+    if (error)
+    {
+        connect_failed(conn, fd, error);
+    }
+    else
+    {
+        connected(conn, fd);
+    }
+
+    /* Remove this GIOFunc */
+    return FALSE;
+}
+
+static gboolean handle_connect_timeout(gpointer data)
+{
+    wowza_conn *conn = data;
+    int fd = conn->connecting_fd;
+
+    g_source_remove(conn->connect_watch);
+    conn->timer = 0;
+    conn->connect_watch = 0;
+    conn->connecting_fd = -1;
+
+    connect_failed(conn, fd, ETIMEDOUT);
+    return FALSE;
+}
+
+static void connected(wowza_conn *conn, int fd)
+{
+    g_message("Successfully connected to wowza on %s:%d", conn->host,
+        conn->port);
+
+    /* Hand it over as accept() would have - start_connection() sets up
+     * whatever it needs */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    conn->state = CONN_CONNECTED;
+    conn->backoff_ms = 0;
+    start_connection(conn, fd);
+}
+
+static void connect_failed(wowza_conn *conn, int fd, int error)
+{
+    g_warning("There was an error connecting to wowza on %s:%d (%s)"
+            " - this service will be fairly useless until we're back",
+            conn->host, conn->port, strerror(error));
+    close(fd);
+    reconnect_later(conn);
+}
+
+/* Try again in a while - twice as long as last time, up to RECONNECT_MAX_MS,
+ * give or take, so shards which lost the same wowza don't all come back at
+ * once. Meanwhile, drop whatever we've kept for it that's too old to send */
+static void reconnect_later(wowza_conn *conn)
+{
+    conn->backoff_ms = conn->backoff_ms ?
+        MIN(conn->backoff_ms * 2, RECONNECT_MAX_MS) : RECONNECT_MIN_MS;
+    guint delay = conn->backoff_ms / 2 +
+        g_random_int_range(0, conn->backoff_ms / 2 + 1);
+
+    conn->state = CONN_WAITING;
+    conn->timer = g_timeout_add(delay, handle_reconnect, conn);
+
+    G_LOCK(retained);
+    if (conn->retained)
+    {
+        expire_retained(conn->retained);
+    }
+    G_UNLOCK(retained);
+}
+
+static gboolean handle_reconnect(gpointer data)
+{
+    wowza_conn *conn = data;
+
+    conn->timer = 0;
+    g_debug("Attempting to reconnect to %s:%d", conn->host, conn->port);
+    tcp_connect(conn);
+
+    return FALSE;
+}
+
+/* The rest of connection_lost(), back on the main loop */
+static gboolean handle_lost(gpointer data)
+{
+    wowza_conn *conn = data;
+
+    if (!conn->host)
+    {
+        /* Wowza will connect again if it wants us. Its slot is free for
+         * whoever does */
+        conn->in_use = FALSE;
+    }
+    else if (conn->state == CONN_CONNECTED)
+    {
+        /* Only once for each connection we made */
+        reconnect_later(conn);
+    }
+    return FALSE;
+}
+
+/* Someone has connected to our --listen port */
+static gboolean
+handle_accept(GIOChannel *source, GIOCondition cond, gpointer data)
+{
+    UNUSED(cond);
+    UNUSED(data);
+
+    int fd = accept(g_io_channel_unix_get_fd(source), NULL, NULL);
+    if (fd < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN)
+        {
+            g_warning("Error accepting a wowza connection: %s",
+                strerror(errno));
+        }
+        return TRUE;
+    }
+
+    wowza_conn *conn = new_slot();
+    if (!conn)
+    {
+        g_warning("Already serving %d wowzas - turning another away",
+            MAX_CONNECTIONS);
+        close(fd);
+        return TRUE;
+    }
+
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
 
-    g_message("Successfully connected to wowza on %s:%d", g_host, g_port);
+    conn->in_use = TRUE;
+    g_message("Wowza connected (slot %d)", conn->slot);
+
+    start_connection(conn, fd);
+
+    return TRUE;
+}
+
+/* Start reading and writing a connected socket */
+static void start_connection(wowza_conn *conn, int fd)
+{
+    /* Tag its messages with something no earlier connection had, so their
+     * stale replies are dropped rather than sent down this one */
+    generation = (generation + 1) % (G_MAXINT / MAX_CONNECTIONS);
+    int origin = generation * MAX_CONNECTIONS + conn->slot;
+
+    register_fd(fd, origin);
+    conn->fd = fd;
+    conn->channel = NULL;
+
+    /* Set before anything read from it can be replied to. Once it is, a
+     * --server's replies go down this connection rather than being kept, so
+     * take what has been kept so far, to send once we can */
+    G_LOCK(retained);
+    g_atomic_int_set(&conn->origin, origin);
+    GHashTable *retained = conn->retained;
+    conn->retained = NULL;
+    G_UNLOCK(retained);
+
+    /* A slot which has had a writer thread keeps it, and stays on the main
+     * loop - we only ever fall back from io_uring */
+    if (globals.io_uring && !conn->writer_started)
+    {
+        if (!uring_connect(fd, &conn->parker, take_replies, connection_lost,
+                conn))
+        {
+            flush_retained(conn, retained);
+            return;
+        }
+
+        g_warning("io_uring is unavailable - using the main loop");
+        globals.io_uring = 0;
+    }
 
     /* Connected to Wowza - set up a watch on the channel */
-    GIOChannel *chan = g_io_channel_unix_new(sock_fd);
+    GIOChannel *chan = g_io_channel_unix_new(fd);
     // Set NULL encoding so that NULL bytes are handled properly
     g_io_channel_set_encoding(chan, NULL, NULL);
     g_io_channel_set_buffered(chan, FALSE);
     g_io_channel_set_flags(chan, G_IO_FLAG_NONBLOCK, NULL);
 
-    register_fd(sock_fd);
-
     if (!g_io_add_watch(chan, (G_IO_IN | G_IO_HUP | G_IO_ERR),
-            handle_input, NULL))
+            handle_input, conn))
     {
         g_warning("(%s:%d) Unable to add watch on channel", __FILE__, __LINE__);
+        unregister_fd(fd);
         g_io_channel_shutdown(chan, FALSE, NULL);
         g_io_channel_unref(chan);
-        unregister_fd(sock_fd);
 
-        wowza_fd = -1;
-        wowza_channel = NULL;
+        g_atomic_int_set(&conn->origin, -1);
+        conn->fd = -1;
         exit(-1);
     }
-    wowza_fd = sock_fd;
-    wowza_channel = chan;
+    conn->channel = chan;
+
+    if (!globals.nothread && !conn->writer_started)
+    {
+        conn->writer_started = TRUE;
+        g_thread_create(writer_thread_loop, conn, FALSE, NULL);
+    }
+
+    flush_retained(conn, retained);
+}
+
+/* The connection has been closed - from the main loop, or its io_uring
+ * thread */
+static void connection_lost(gpointer data)
+{
+    wowza_conn *conn = data;
+
+    /* Replies to it are dropped - or for a --server, kept - from here on */
+    G_LOCK(retained);
+    g_atomic_int_set(&conn->origin, -1);
+    G_UNLOCK(retained);
+    conn->fd = -1;
+    conn->channel = NULL;
+
+    /* Reconnect, or free the slot, from the main loop, which owns the timers
+     * and the slots */
+    g_idle_add(handle_lost, conn);
+}
+
+/* A --shm peer broke the framing, and its thread has given up on it - from
+ * that thread */
+static void shm_lost(gpointer data)
+{
+    wowza_conn *conn = data;
+
+    /* Replies to it are dropped from here on. Its slot stays in use, as
+     * workers may still wake it through conn->shm */
+    G_LOCK(retained);
+    g_atomic_int_set(&conn->origin, -1);
+    G_UNLOCK(retained);
 }
 
 /* Handle stream data input */
 static gboolean
 handle_input(GIOChannel *source, GIOCondition cond, gpointer data)
 {
+    wowza_conn *conn = data;
     int fd, n;
 
-    UNUSED(data);
-
     fd = g_io_channel_unix_get_fd(source);
 
-    if (cond & G_IO_HUP || cond & G_IO_ERR || ((n = read_data(fd)) == -9))
+    if (cond & G_IO_HUP || cond & G_IO_ERR || ((n = read_data(fd)) < 0))
     {
         if (cond & G_IO_HUP)
         {
@@ -144,21 +656,27 @@ handle_input(GIOChannel *source, GIOCondition cond, gpointer data)
         {
             g_warning("(%s:%d) Error on socket", __FILE__, __LINE__);
         }
-        else
+        else if (n == REMOTE_CLOSED)
         {
             /* The other side closed the connection */
             g_warning("Remote end closed connection");
         }
-        /* TODO: clean up any user data */
-
+        else
+        {
+            /* read_data() has said why */
+            g_warning("Unable to read from wowza - closing the connection");
+        }
+        if (conn->output_watch)
+        {
+            g_source_remove(conn->output_watch);
+            conn->output_watch = 0;
+        }
+        /* Frees what's left of its input and output - before its number can
+         * be reused */
+        unregister_fd(fd);
         g_io_channel_shutdown(source, FALSE, NULL);
         g_io_channel_unref(source);
-        unregister_fd(fd);
-        wowza_fd = -1;
-        wowza_channel = NULL;
-
-        /* Try to reconnect every so often */
-        attempt_reconnect = 1;
+        connection_lost(conn);
 
         /* Remove this GIOFunc */
         return FALSE;
@@ -173,14 +691,7 @@ handle_input(GIOChannel *source, GIOCondition cond, gpointer data)
 
         if (msg && msg->text && msg->length)
         {
-            if (globals.nothread)
-            {
-                handle_imo_message(msg);
-            }
-            else
-            {
-                queue_imo_message_for_worker(msg);
-            }
+            dispatch_imo_message(msg);
         }
         else
         {
@@ -200,47 +711,333 @@ void send_imo_message(imo_message *msg)
         return;
     }
 
-    /* TODO: Who do we send data to? We probably only have one wowza connection,
-     * but it would be good to make this more general. We should map stream
-     * names to the wowza fd they came in on */
-    if (wowza_fd == -1)
+    if (msg->origin == IMO_ORIGIN_NONE)
     {
-        /* I guess wowza is down. */
-        /* TODO: If wowza is smart enough to remember streams across restarts,
-         * we should queue data for wowza here */
-        g_warning("(%s:%d) wowza fd is -1", __FILE__, __LINE__);
+        broadcast_imo_message(msg);
+        return;
+    }
 
-        /* TODO: we should free msg here */
+    /* Back where it came from - if that connection is still there */
+    wowza_conn *conn = &conns[msg->origin % MAX_CONNECTIONS];
+    if (g_atomic_int_get(&conn->origin) != msg->origin &&
+        !readdress_reply(conn, msg))
+    {
         return;
     }
 
-    queue_message(wowza_fd, msg);
+    send_to(conn, msg);
+}
+
+/* A reply for one of conn's earlier connections - wowza is down, or has
+ * reconnected since. A --server's wowza is the same one each time, and still
+ * wants it: readdress it to the connection it has now, or keep it until it
+ * has one. Anyone else's reply has nowhere to go.
+ *
+ * Returns TRUE if msg should be sent on. Otherwise it's been taken */
+static gboolean readdress_reply(wowza_conn *conn, imo_message *msg)
+{
+    if (!conn->host)
+    {
+        g_debug("(%s:%d) Connection for reply is gone", __FILE__, __LINE__);
+        imo_message_destroy(msg);
+        return FALSE;
+    }
+
+    G_LOCK(retained);
+    int origin = g_atomic_int_get(&conn->origin);
+    if (origin == -1)
+    {
+        retain_reply(conn, msg);
+    }
+    else
+    {
+        msg->origin = origin;
+    }
+    G_UNLOCK(retained);
+
+    return origin != -1;
+}
+
+/* Key replies by their stream, so a busy one can't push out a quiet one's.
+ * Handles may have NULs in them, so they're spelt out */
+static gchar *retained_key(const imo_message *msg)
+{
+    if (msg->type == 'd')
+    {
+        return g_strdup_printf("#%u", imo_message_handle(msg));
+    }
+
+    return g_strndup((const gchar *)msg->name.data, msg->name.len);
+}
+
+static void free_retained_queue(gpointer data)
+{
+    imo_queue *q = data;
+    imo_message *msg;
+
+    while ((msg = imo_queue_pop(q)))
+    {
+        imo_message_destroy(msg);
+    }
+    g_free(q);
+}
+
+/* Keep msg with the others for its stream, dropping the oldest beyond
+ * RETAIN_PER_STREAM. Call with the retained lock held */
+static void retain_reply(wowza_conn *conn, imo_message *msg)
+{
+    if (!conn->retained)
+    {
+        conn->retained = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, free_retained_queue);
+    }
+
+    gchar *key = retained_key(msg);
+    imo_queue *q = g_hash_table_lookup(conn->retained, key);
+    if (q)
+    {
+        g_free(key);
+    }
+    else
+    {
+        q = g_new(imo_queue, 1);
+        imo_queue_init(q);
+        g_hash_table_insert(conn->retained, key, q);
+    }
 
-    /* Add a watch on the channel so we write data once the channel is
-     * writable */
-    if (!g_io_add_watch(wowza_channel, G_IO_OUT, handle_output, NULL))
+    imo_queue_push(q, msg);
+    if (q->length > RETAIN_PER_STREAM)
     {
-        g_warning("(%s:%d) Cannot add watch on GIOChannel for write",
-                __FILE__, __LINE__);
+        imo_message_destroy(imo_queue_pop(q));
     }
 }
 
+static gboolean expire_queue(gpointer key, gpointer value, gpointer data)
+{
+    imo_queue *q = value;
+    const struct timeval *now = data;
+
+    UNUSED(key);
+
+    /* Oldest first - made in order, and kept in order */
+    while (q->head)
+    {
+        long age_ms = (now->tv_sec - q->head->ts.tv_sec) * 1000 +
+            (now->tv_usec - q->head->ts.tv_usec) / 1000;
+        if (age_ms <= RETAIN_MAX_MS)
+        {
+            break;
+        }
+        imo_message_destroy(imo_queue_pop(q));
+    }
+
+    /* Forget streams with nothing left, so ended ones don't build up */
+    return q->head == NULL;
+}
+
+/* Drop kept replies older than RETAIN_MAX_MS. Call with the retained lock held,
+ * or once nobody else can see retained */
+static void expire_retained(GHashTable *retained)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    g_hash_table_foreach_remove(retained, expire_queue, &now);
+}
+
+static void flush_queue(gpointer key, gpointer value, gpointer data)
+{
+    imo_queue *q = value;
+    wowza_conn *conn = data;
+    imo_message *msg;
+
+    UNUSED(key);
+
+    while ((msg = imo_queue_pop(q)))
+    {
+        msg->origin = g_atomic_int_get(&conn->origin);
+        send_to(conn, msg);
+    }
+}
+
+/* Send what was kept while conn was down down its new connection, and forget
+ * it. retained may be NULL */
+static void flush_retained(wowza_conn *conn, GHashTable *retained)
+{
+    if (!retained)
+    {
+        return;
+    }
+
+    expire_retained(retained);
+    if (g_hash_table_size(retained))
+    {
+        g_message("Sending replies kept for %d streams while wowza on %s:%d "
+            "was down", g_hash_table_size(retained), conn->host, conn->port);
+    }
+
+    g_hash_table_foreach(retained, flush_queue, conn);
+    g_hash_table_destroy(retained);
+}
+
+static void send_to(wowza_conn *conn, imo_message *msg)
+{
+    if (!globals.nothread)
+    {
+        /* The writer only writes, so it drains this quickly - if it's full,
+         * that wowza isn't reading, or its writer has gone. Waiting for it
+         * would hold up every worker, and every other wowza with them */
+        if (!ring_push(conn->replies, msg))
+        {
+            count_drop(DROP_BACKED_UP);
+            imo_message_destroy(msg);
+            return;
+        }
+
+        /* Only a syscall if the writer has nothing else to do */
+        if (conn->shm)
+        {
+            shm_wake(conn->shm);
+        }
+        else
+        {
+            poll_parker_unpark(&conn->parker);
+        }
+        return;
+    }
+
+    /* Otherwise write now, and if the socket's full, have the main loop tell
+     * us when it isn't. One watch, however many messages are waiting */
+    queue_message(conn->fd, msg);
+    if (write_data(conn->fd) > 0 && !conn->output_watch)
+    {
+        conn->output_watch = g_io_add_watch(conn->channel, G_IO_OUT,
+            handle_output, conn);
+        if (!conn->output_watch)
+        {
+            g_warning("(%s:%d) Cannot add watch on GIOChannel for write",
+                    __FILE__, __LINE__);
+        }
+    }
+}
+
+/* Send a message of our own - a load report - to every wowza. Takes msg */
+static void broadcast_imo_message(imo_message *msg)
+{
+    for (int i = 0; i < g_atomic_int_get(&num_slots); i++)
+    {
+        int origin = g_atomic_int_get(&conns[i].origin);
+        if (origin == -1)
+        {
+            continue;
+        }
+
+        unsigned char *text = malloc(msg->length);
+        memcpy(text, msg->text, msg->length);
+        imo_message *copy = create_imo_message_from_text(text, msg->length);
+        copy->origin = origin;
+
+        send_to(&conns[i], copy);
+    }
+
+    imo_message_destroy(msg);
+}
+
+/* The next reply waiting for a connection, or NULL. Only called by its
+ * writer - the writer thread, its io_uring thread or its shared-memory
+ * thread - as we're the ring's only consumer */
+static imo_message *pop_reply(gpointer data)
+{
+    wowza_conn *conn = data;
+    imo_message *msg;
+
+    while ((msg = ring_pop(conn->replies)))
+    {
+        /* Unless it was queued just before the connection it was for
+         * closed */
+        if (msg->origin == g_atomic_int_get(&conn->origin) ||
+            readdress_reply(conn, msg))
+        {
+            return msg;
+        }
+    }
+
+    return NULL;
+}
+
+/* Queue the replies waiting for a connection on its socket */
+static void take_replies(gpointer data)
+{
+    wowza_conn *conn = data;
+    imo_message *msg;
+
+    /* msg will be freed once it's written, in write_data */
+    while ((msg = pop_reply(conn)))
+    {
+        int fd = conn->fd;
+        if (fd == -1)
+        {
+            imo_message_destroy(msg);
+            continue;
+        }
+        queue_message(fd, msg);
+    }
+}
+
+/* Write messages back to one wowza. Everything waiting is queued on the socket
+ * first, then written with as few writev() calls as it will take. While the
+ * socket is full we sleep until it's writable - replies pile up in the ring
+ * meanwhile, and go out together. While there's nothing to write, we sleep
+ * until someone queues something. */
+static gpointer writer_thread_loop(gpointer data)
+{
+    wowza_conn *conn = data;
+
+    while(TRUE)
+    {
+        take_replies(conn);
+
+        int fd = conn->fd;
+        int pending = fd == -1 ? FD_NOT_FOUND : write_data(fd);
+        if (pending > 0)
+        {
+            /* Not prepared, so nobody wakes us - only the socket, or the
+             * timeout, in case it's closed under us */
+            poll_parker_park(&conn->parker, fd, POLLOUT, WRITER_RETRY_MS);
+            continue;
+        }
+
+        /* Look once more before we sleep */
+        poll_parker_prepare(&conn->parker);
+        if (ring_count(conn->replies))
+        {
+            poll_parker_cancel(&conn->parker);
+            continue;
+        }
+
+        /* If writing failed, the main loop will notice the connection is gone
+         * soon - until then, retry every so often */
+        poll_parker_park(&conn->parker, -1, 0,
+            pending < 0 && fd != -1 ? WRITER_RETRY_MS : -1);
+    }
+
+    return NULL;
+}
+
 static gboolean
 handle_output(GIOChannel *source, GIOCondition cond, gpointer data)
 {
-    UNUSED(cond);
-    UNUSED(data);
+    wowza_conn *conn = data;
 
-    /* Presumably we'll have at least one message queued at this point */
-    int fd, n;
-
-    fd = g_io_channel_unix_get_fd(source);
+    UNUSED(cond);
 
-    do
+    if (write_data(g_io_channel_unix_get_fd(source)) > 0)
     {
-        n = write_data(fd);
-    } while (n > 0);
+        /* Still full - keep watching */
+        return TRUE;
+    }
 
-    /* We're written everything we had - remove this watch */
+    /* We've written everything we had (or can't write) - remove this watch */
+    conn->output_watch = 0;
     return FALSE;
 }
@@ -1,10 +1,70 @@
 #ifndef _INTERFACE_TCP_H_
 #define _INTERFACE_TCP_H_
 
+/// Most wowzas we serve at once - --server entries and connections to our
+/// --listen port together
+#define MAX_CONNECTIONS (64)
+
+/// Replies waiting to be written to one wowza. Beyond this it isn't keeping
+/// up, and its replies are dropped
+#define RETURN_RING_SIZE (65536)
+
+/// How long a writer waits before trying a socket which failed, or which has
+/// been full for a while, again
+#define WRITER_RETRY_MS (100)
+
+/// Wait between attempts to reach a --server we've lost. Doubles with each
+/// failure, up to the most, and starts again from the least once we're back
+#define RECONNECT_MIN_MS (500)
+#define RECONNECT_MAX_MS (30000)
+
+/// Longest we wait for a connect() to a --server to go through
+#define CONNECT_TIMEOUT_MS (5000)
+
+/// Replies to a --server's wowza kept while we're reconnecting to it, for
+/// each stream, and how old they may get before they're not worth sending
+#define RETAIN_PER_STREAM (50)
+#define RETAIN_MAX_MS (5000)
+
 struct imo_message;
 
+/**
+ * Connect to a wowza, and keep reconnecting whenever the connection drops.
+ * Neither looking its address up nor connecting blocks the main loop, and
+ * failed attempts back off from RECONNECT_MIN_MS to RECONNECT_MAX_MS. Replies
+ * for it while it's down are kept until it's back - see send_imo_message().
+ * Call once for each --server.
+ */
 void setup_tcp_connection(char *host, int port);
-void tcp_connect(void);
+
+/**
+ * Serve any wowza which connects to port. Their connections aren't
+ * reconnected - it's up to them to connect again.
+ */
+void setup_tcp_listener(int port);
+
+/**
+ * Serve a wowza on this host through a shared-memory segment - see
+ * shm_connect(). Call once for each --shm. Needs threads.
+ */
+void setup_shm_connection(const char *name);
+
+/**
+ * @return The number of wowzas we're connected to.
+ */
+int tcp_connections(void);
+
+/**
+ * Send a message to wowza. Each message read from a wowza is tagged with the
+ * connection it came in on (its origin), and a reply goes back down the same
+ * one - or nowhere, if that connection has closed since. The exception is a
+ * --server's wowza, which remembers its streams while we reconnect: its
+ * replies go down its new connection, and while it has none, the last
+ * RETAIN_PER_STREAM for each stream are kept to send once it has. A message
+ * with no origin goes to every wowza. Each connection has a writer of its
+ * own; in nothread mode the message is written right away, as far as the
+ * socket allows. Called from any thread. Takes msg.
+ */
 void send_imo_message(struct imo_message *msg);
 
 #endif
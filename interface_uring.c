@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <glib.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "imo_message.h"
+#include "interface_uring.h"
+#include "kodama.h"
+#include "protocol.h"
+#include "read_write.h"
+#include "ring.h"
+
+extern globals_t globals;
+
+#ifdef HAVE_LIBURING
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+/* receive_data() takes at most a segment at a time */
+#if URING_BUF_SIZE > IMO_SEGMENT_SIZE
+#error "URING_BUF_SIZE must not be more than IMO_SEGMENT_SIZE"
+#endif
+
+/// Our only buffer group
+#define URING_BGID (0)
+
+/// What each completion is for, in its user_data
+enum uring_op {
+    URING_RECV = 1,
+    URING_SEND,
+    URING_WAKE
+};
+
+/// One connection's io_uring state. Only touched by its thread, once it's
+/// started
+typedef struct uring_conn {
+    struct io_uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    unsigned char *buf_mem;
+    int fd;
+    gboolean receiving;         /**< A multishot receive is armed */
+    gboolean sending;           /**< A send is in flight */
+    gboolean waking;            /**< A poll on the parker is armed */
+    struct iovec send_iov[IOV_MAX];
+    struct msghdr send_msg;
+
+    poll_parker *parker;
+    void (*take)(gpointer data);
+    void (*closed)(gpointer data);
+    gpointer data;
+} uring_conn;
+
+static gpointer uring_thread_loop(gpointer data);
+static void arm_receive(uring_conn *u);
+static void arm_wake(uring_conn *u);
+static void arm_send(uring_conn *u);
+static gboolean handle_completion(uring_conn *u, struct io_uring_cqe *cqe);
+static void return_buffer(uring_conn *u, int bid);
+static void uring_close(uring_conn *u);
+
+int uring_connect(int fd, poll_parker *wake, void (*take)(gpointer data),
+    void (*closed)(gpointer data), gpointer data)
+{
+    int ret;
+
+    if (globals.nothread)
+    {
+        return -1;
+    }
+
+    uring_conn *u = g_new0(uring_conn, 1);
+
+    ret = io_uring_queue_init(URING_ENTRIES, &u->ring, 0);
+    if (ret < 0)
+    {
+        g_warning("Unable to set up io_uring: %s", strerror(-ret));
+        g_free(u);
+        return -1;
+    }
+
+    /* Provided buffers need 5.19 or so - older kernels can't do this */
+    u->buf_ring = io_uring_setup_buf_ring(&u->ring, URING_BUF_COUNT,
+        URING_BGID, 0, &ret);
+    if (!u->buf_ring)
+    {
+        g_warning("Unable to set up io_uring provided buffers: %s",
+            strerror(-ret));
+        io_uring_queue_exit(&u->ring);
+        g_free(u);
+        return -1;
+    }
+
+    u->buf_mem = malloc(URING_BUF_COUNT * URING_BUF_SIZE);
+    for (int i = 0; i < URING_BUF_COUNT; i++)
+    {
+        io_uring_buf_ring_add(u->buf_ring, u->buf_mem + i * URING_BUF_SIZE,
+            URING_BUF_SIZE, i, io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+    }
+    io_uring_buf_ring_advance(u->buf_ring, URING_BUF_COUNT);
+
+    u->fd = fd;
+    u->parker = wake;
+    u->take = take;
+    u->closed = closed;
+    u->data = data;
+
+    /* The thread frees u once the connection closes */
+    if (!g_thread_create(uring_thread_loop, u, FALSE, NULL))
+    {
+        g_warning("Unable to start the io_uring thread");
+        io_uring_free_buf_ring(&u->ring, u->buf_ring, URING_BUF_COUNT,
+            URING_BGID);
+        io_uring_queue_exit(&u->ring);
+        free(u->buf_mem);
+        g_free(u);
+        return -1;
+    }
+
+    g_message("Using io_uring for fd %d", fd);
+    return 0;
+}
+
+/* Everything happens here: completions are handled as they come in - each
+ * received buffer is framed and its messages dispatched to the workers before
+ * we look at the next - and whatever's queued to send goes out in one
+ * sendmsg() once the last one has finished. */
+static gpointer uring_thread_loop(gpointer data)
+{
+    uring_conn *u = data;
+
+    while (TRUE)
+    {
+        struct io_uring_cqe *cqe;
+        gboolean open = TRUE;
+
+        if (!u->receiving)
+        {
+            arm_receive(u);
+        }
+        if (!u->waking)
+        {
+            arm_wake(u);
+        }
+
+        /* Anything queued after we take what's waiting wakes us through the
+         * parker, so nothing waits for a completion which isn't coming */
+        poll_parker_prepare(u->parker);
+        u->take(u->data);
+        if (!u->sending)
+        {
+            arm_send(u);
+        }
+
+        int ret = io_uring_submit_and_wait(&u->ring, 1);
+        poll_parker_cancel(u->parker);
+        if (ret < 0 && ret != -EINTR)
+        {
+            g_warning("io_uring_submit_and_wait failed: %s", strerror(-ret));
+            open = FALSE;
+        }
+
+        while (open && !io_uring_peek_cqe(&u->ring, &cqe))
+        {
+            open = handle_completion(u, cqe);
+            io_uring_cqe_seen(&u->ring, cqe);
+        }
+
+        if (!open)
+        {
+            break;
+        }
+    }
+
+    uring_close(u);
+
+    return NULL;
+}
+
+static void arm_receive(uring_conn *u)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+    /* The kernel picks a buffer from our group for each completion, and keeps
+     * going until it runs out of them or the socket closes */
+    io_uring_prep_recv_multishot(sqe, u->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    io_uring_sqe_set_data64(sqe, URING_RECV);
+    u->receiving = TRUE;
+}
+
+static void arm_wake(uring_conn *u)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+    io_uring_prep_poll_add(sqe, u->parker->read_fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, URING_WAKE);
+    u->waking = TRUE;
+}
+
+static void arm_send(uring_conn *u)
+{
+    int count = write_gather(u->fd, u->send_iov, IOV_MAX);
+    if (count <= 0)
+    {
+        return;
+    }
+
+    memset(&u->send_msg, 0, sizeof(u->send_msg));
+    u->send_msg.msg_iov = u->send_iov;
+    u->send_msg.msg_iovlen = count;
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+    io_uring_prep_sendmsg(sqe, u->fd, &u->send_msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, URING_SEND);
+    u->sending = TRUE;
+}
+
+/* Returns FALSE once the connection is gone */
+static gboolean handle_completion(uring_conn *u, struct io_uring_cqe *cqe)
+{
+    int res = cqe->res;
+
+    switch (io_uring_cqe_get_data64(cqe))
+    {
+    case URING_RECV:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            u->receiving = FALSE;
+        }
+        if (res == -ENOBUFS || res == -EINTR)
+        {
+            /* We got behind handing buffers back - rearm */
+            return TRUE;
+        }
+        if (res <= 0)
+        {
+            if (res == 0)
+            {
+                g_warning("Remote end closed connection");
+            }
+            else
+            {
+                g_warning("(%s:%d) Error on socket: %s", __FILE__, __LINE__,
+                    strerror(-res));
+            }
+            return FALSE;
+        }
+
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        int n = receive_data(u->fd, u->buf_mem + bid * URING_BUF_SIZE, res);
+        return_buffer(u, bid);
+
+        if (n < 0)
+        {
+            g_warning("Lost track of message boundaries - reconnecting");
+            return FALSE;
+        }
+
+        while (n > 0)
+        {
+            imo_message *msg;
+            n = get_next_message(u->fd, &msg);
+            if (msg)
+            {
+                dispatch_imo_message(msg);
+            }
+        }
+        return TRUE;
+
+    case URING_SEND:
+        u->sending = FALSE;
+        if (res == -EINTR || res == -EAGAIN)
+        {
+            return TRUE;
+        }
+        if (res < 0)
+        {
+            g_warning("Error sending to wowza: %s", strerror(-res));
+            return FALSE;
+        }
+        write_done(u->fd, res);
+        return TRUE;
+
+    case URING_WAKE:
+        u->waking = FALSE;
+        poll_parker_woken(u->parker);
+        return TRUE;
+
+    default:
+        g_warning("(%s:%d) Unexpected completion", __FILE__, __LINE__);
+        return TRUE;
+    }
+}
+
+static void return_buffer(uring_conn *u, int bid)
+{
+    io_uring_buf_ring_add(u->buf_ring, u->buf_mem + bid * URING_BUF_SIZE,
+        URING_BUF_SIZE, bid, io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+    io_uring_buf_ring_advance(u->buf_ring, 1);
+}
+
+static void uring_close(uring_conn *u)
+{
+    /* Ends anything still outstanding, so the kernel is done with our buffers
+     * before we free them */
+    shutdown(u->fd, SHUT_RDWR);
+    io_uring_free_buf_ring(&u->ring, u->buf_ring, URING_BUF_COUNT, URING_BGID);
+    io_uring_queue_exit(&u->ring);
+    free(u->buf_mem);
+
+    /* Before its number can be reused */
+    unregister_fd(u->fd);
+    close(u->fd);
+
+    u->closed(u->data);
+    g_free(u);
+}
+
+#else
+
+int uring_connect(int fd, poll_parker *wake, void (*take)(gpointer data),
+    void (*closed)(gpointer data), gpointer data)
+{
+    UNUSED(fd);
+    UNUSED(wake);
+    UNUSED(take);
+    UNUSED(closed);
+    UNUSED(data);
+
+    g_warning("Built without io_uring (make LIBURING=1)");
+    return -1;
+}
+
+#endif
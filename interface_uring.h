@@ -0,0 +1,41 @@
+#ifndef _INTERFACE_URING_H_
+#define _INTERFACE_URING_H_
+
+#include <glib.h>
+
+/// Submission queue entries. We only ever have a receive, a send and a wakeup
+/// outstanding, but completions for all three may be waiting at once
+#define URING_ENTRIES (64)
+
+/// Buffers the kernel receives into, and how big each is. Each is handed back
+/// as soon as its bytes are framed, so we rarely have more than a couple out
+#define URING_BUF_COUNT (64)
+#define URING_BUF_SIZE (16384)
+
+struct poll_parker;
+
+/**
+ * Handle fd with io_uring instead of the GLib main loop: a thread of its own
+ * receives into buffers the kernel picks, frames the messages and dispatches
+ * them, and sends whatever is queued for fd in one sendmsg() at a time. It's
+ * the connection's writer too - it calls take() to have replies queued with
+ * queue_message(), each time it's woken through wake, and before it sends.
+ * Needs threads, and register_fd() to have been called on fd.
+ *
+ * @param fd A connected socket.
+ * @param wake Unparked when there are replies to take. Must outlive the
+ * thread.
+ * @param take Queues whatever replies are waiting for fd.
+ * @param closed Called once fd has been closed, just before the thread
+ * exits.
+ * @param data Passed to take and closed.
+ *
+ * @return Zero if the thread was started, non-zero if io_uring isn't
+ * available - built without it, or too old a kernel - and the caller should
+ * fall back to the main loop.
+ */
+int uring_connect(int fd, struct poll_parker *wake,
+    void (*take)(gpointer data), void (*closed)(gpointer data),
+    gpointer data);
+
+#endif
@@ -8,11 +8,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "admission.h"
 #include "av.h"
 #include "calibrate.h"
 #include "conversation.h"
 #include "hybrid.h"
 #include "echo.h"
+#include "epoch.h"
+#include "governor.h"
 #include "interface_hardware.h"
 #include "interface_tcp.h"
 #include "interface_udp.h"
@@ -25,9 +28,6 @@ stats_t stats;
 
 G_LOCK_DEFINE(stats);
 
-/* From interface_tcp */
-extern int attempt_reconnect;
-
 static void usage(char *arg0);
 static void set_fullname(void);
 static void calc_echo_globals(void);
@@ -59,15 +59,23 @@ static void usage(char *arg0)
     fprintf(stderr, "-m: ms     tx-side number of milliseconds of delay to simulate\n");
     fprintf(stderr, "-n: ms     rx-side number of milliseconds of delay to simulate\n");
     fprintf(stderr, "\n");
-    fprintf(stderr, "--sample/-s: rate    Sampling rate for echo cancellation\n");
+    fprintf(stderr, "--sample/-s: rate    Default sampling rate for echo cancellation\n");
     fprintf(stderr, "--echopath path len: Echo path length in milliseconds\n");
     fprintf(stderr, "--dtd {geigel|mecc}: Which double-talk detector to use\n");
     fprintf(stderr, "--dummy:             Reflect all messages back to wowza unchanged\n");
     fprintf(stderr, "--nothread:          Run in single-threaded mode\n");
+    fprintf(stderr, "--io-uring:          Talk to wowza through io_uring, if available\n");
+    fprintf(stderr, "--pin:               Pin worker threads to physical cores\n");
+    fprintf(stderr, "--pipeline:          Decode, cancel and encode in separate stages\n");
+    fprintf(stderr, "--deadline ms:       Reflect audio which has waited this long unprocessed\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "IMO options:\n");
     fprintf(stderr, "--shard: shardnum of this shard (enables imo mode)\n");
-    fprintf(stderr, "--server: <ip:port> Wowza server and port to connect to\n");
+    fprintf(stderr, "--server: <ip:port> Wowza server and port to connect to. May be\n");
+    fprintf(stderr, "          given more than once\n");
+    fprintf(stderr, "--listen: port  Serve any wowza which connects to this port\n");
+    fprintf(stderr, "--shm: name  Serve a wowza on this host through shared memory\n");
+    fprintf(stderr, "          /dev/shm/name. May be given more than once\n");
     fprintf(stderr, "--basename: Name of the service\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "\n");
@@ -99,23 +107,22 @@ static void set_fullname(void)
 
 static void calc_echo_globals(void)
 {
-    /* Computed */
-    globals.nlms_len = globals.echo_path * TAPS_PER_MS;
-    globals.dtd_hangover = 30 * TAPS_PER_MS; /* TODO: make user-settable */
-
-    if (globals.nlms_len % DTD_LEN)
+    /* The echo cancelers compute their own nlms_len and hangover, since each
+     * conversation may run at its own rate. Make sure the defaults work,
+     * though */
+    if (globals.sample_rate % 1000)
+    {
+        fprintf(stderr, "Sample rate (%d) must be a multiple of 1000\n",
+                globals.sample_rate);
+        exit(1);
+    }
+    if (!echo_params_valid(globals.sample_rate, globals.echo_path))
     {
         /* Log handlers haven't been set up at this point, so there's a good
          * chance we won't see this message if the run scripts call this
          * badly */
         fprintf(stderr, "DTD_LEN (%d) must divide evenly into nlms_len (%d)\n",
-                DTD_LEN, globals.nlms_len);
-        exit(1);
-    }
-    if (globals.sample_rate % 1000)
-    {
-        fprintf(stderr, "Sample rate (%d) must be a multiple of 1000\n",
-                globals.sample_rate);
+                DTD_LEN, globals.echo_path * TAPS_PER_MS(globals.sample_rate));
         exit(1);
     }
 
@@ -147,12 +154,17 @@ static void parse_command_line(int argc, char *argv[])
 
     globals.dummy = 0;
     globals.nothread = 0;
+    globals.io_uring = 0;
+    globals.pin_workers = 0;
+    globals.pipeline = 0;
+    globals.deadline_ms = 0;
 
     globals.basename = NULL;
     globals.fullname = NULL;
     globals.shardnum = -1;
-    globals.server_host = NULL;
-    globals.server_port = -1;
+    globals.servers = g_ptr_array_new();
+    globals.listen_port = 0;
+    globals.shm_names = g_ptr_array_new();
 
     globals.verbose = 0;
     globals.flv_debug = 0;
@@ -167,12 +179,18 @@ static void parse_command_line(int argc, char *argv[])
             /* {name, has_arg, flag, val},  */
             {"shard", 1, 0, 0}, /* 0 */
             {"server", 1, 0, 0},
+            {"listen", 1, 0, 0},
+            {"shm", 1, 0, 0},
             {"basename", 1, 0, 0},
             {"dtd", 1, 0, 0},
             {"sample", 1, 0, 's'},
             {"echopath", 1, 0, 0},
             {"dummy", 0, 0, 0},
             {"nothread", 0, 0, 0},
+            {"io-uring", 0, 0, 0},
+            {"pin", 0, 0, 0},
+            {"pipeline", 0, 0, 0},
+            {"deadline", 1, 0, 0},
             {"flv", 0, 0, 0},
             {"help", 0, 0, 'h'},
             {0, 0, 0, 0}
@@ -205,14 +223,19 @@ static void parse_command_line(int argc, char *argv[])
             }
             else if (!strcmp("server", long_options[option_index].name))
             {
-                gchar **host_and_port = g_strsplit(optarg, ":", 2);
-
                 /* TODO: error checking would be great here, but let's just not
                  * call this program with bad options, no? */
-                globals.server_host = g_strdup(host_and_port[0]);
-                globals.server_port = atoi(host_and_port[1]);
-
-                g_strfreev(host_and_port);
+                g_ptr_array_add(globals.servers, g_strdup(optarg));
+            }
+            else if (!strcmp("listen", long_options[option_index].name))
+            {
+                globals.listen_port = atoi(optarg);
+            }
+            else if (!strcmp("shm", long_options[option_index].name))
+            {
+                /* shm_open() wants a leading slash */
+                g_ptr_array_add(globals.shm_names, optarg[0] == '/' ?
+                    g_strdup(optarg) : g_strdup_printf("/%s", optarg));
             }
             else if (!strcmp("basename", long_options[option_index].name))
             {
@@ -249,6 +272,22 @@ static void parse_command_line(int argc, char *argv[])
             {
                 globals.nothread = 1;
             }
+            else if (!strcmp("io-uring", long_options[option_index].name))
+            {
+                globals.io_uring = 1;
+            }
+            else if (!strcmp("pin", long_options[option_index].name))
+            {
+                globals.pin_workers = 1;
+            }
+            else if (!strcmp("pipeline", long_options[option_index].name))
+            {
+                globals.pipeline = 1;
+            }
+            else if (!strcmp("deadline", long_options[option_index].name))
+            {
+                globals.deadline_ms = atoi(optarg);
+            }
             else if (!strcmp("echopath", long_options[option_index].name))
             {
                 globals.echo_path = atoi(optarg);
@@ -360,6 +399,11 @@ static void init_stats(void)
     stats.samples_processed = 0;
     stats.total_samples_processed = 0;
     stats.total_us = 0;
+    stats.total_cycles = 0;
+    for (int i = 0; i < NUM_DROP_REASONS; i++)
+    {
+        g_atomic_int_set(&stats.dropped[i], 0);
+    }
     G_UNLOCK(stats);
 }
 
@@ -374,9 +418,42 @@ static void report_stats(void)
             stats.samples_processed,
             (float)stats.samples_processed/globals.sample_rate);
     }
+    g_debug("Worker threads: %d (%.0f%% busy)", stats.num_threads,
+        100 * stats.utilization);
 
     stats.samples_processed = 0;
     G_UNLOCK(stats);
+
+    /* Take what we report off the counters, so drops that happen while we're
+     * reading them aren't lost */
+    int dropped[NUM_DROP_REASONS];
+    int total_dropped = 0;
+    for (int i = 0; i < NUM_DROP_REASONS; i++)
+    {
+        dropped[i] = g_atomic_int_get(&stats.dropped[i]);
+        g_atomic_int_add(&stats.dropped[i], -dropped[i]);
+        total_dropped += dropped[i];
+    }
+
+    if (total_dropped > dropped[DROP_BACKED_UP])
+    {
+        g_debug("Reflected unprocessed: %d queue full, %d expired, "
+            "%d no stream, %d failed", dropped[DROP_QUEUE_FULL],
+            dropped[DROP_EXPIRED], dropped[DROP_NO_STREAM],
+            dropped[DROP_FAILED]);
+    }
+    if (dropped[DROP_BACKED_UP])
+    {
+        g_warning("Dropped %d replies to wowzas which weren't taking them",
+            dropped[DROP_BACKED_UP]);
+    }
+
+    gchar *complexity = governor_describe();
+    if (complexity)
+    {
+        g_debug("Packets by encoder complexity: %s", complexity);
+        g_free(complexity);
+    }
 }
 
 static gboolean trigger(gpointer data)
@@ -387,17 +464,25 @@ static gboolean trigger(gpointer data)
 
     count++;
 
-    if (attempt_reconnect && ((count % 3) == 0))
+    if ((count % 60) == 0)
     {
-        g_debug("Attempting to reconnect");
-        tcp_connect();
+        report_stats();
     }
 
-    if ((count % 60) == 0)
+    admission_update();
+    resize_workers();
+    governor_update(protocol_queued_messages(), stats.num_threads);
+
+    /* Let wowza balance new conversations across shards */
+    if (globals.shardnum != -1 && tcp_connections() &&
+        (count % ADMISSION_REPORT_INTERVAL) == 0)
     {
-        report_stats();
+        send_load_report();
     }
 
+    /* Free conversations which ended a couple of ticks ago */
+    epoch_reclaim();
+
     /* Return FALSE if this function should be removed */
     return TRUE;
 }
@@ -416,9 +501,11 @@ int main(int argc, char *argv[])
     init_av();
     init_conversations();
 
-    calibrate();                /* Determine how many threads we can run */
-    init_protocol();            /* Create the work queue and threads */
+    calibrate();                /* Measure what a conversation costs */
+    init_protocol();            /* Create the work queues and first threads */
     init_stats();               /* Clear out the calibration values */
+    init_admission();           /* Size the shard from the calibration */
+    init_governor();
 
     /* If no shardnum is given, we're running in standalone mode */
     if (globals.shardnum == -1)
@@ -457,9 +544,33 @@ int main(int argc, char *argv[])
     }
     else
     {
-        /* We're in imo mode - connect to a wowza and echo cancel data from
-         * it */
-        setup_tcp_connection(globals.server_host, globals.server_port);
+        /* We're in imo mode - connect to the wowzas and echo cancel data
+         * from them */
+        for (guint i = 0; i < globals.servers->len; i++)
+        {
+            gchar **host_and_port = g_strsplit(
+                g_ptr_array_index(globals.servers, i), ":", 2);
+
+            setup_tcp_connection(host_and_port[0], atoi(host_and_port[1]));
+
+            g_strfreev(host_and_port);
+        }
+
+        if (globals.listen_port)
+        {
+            setup_tcp_listener(globals.listen_port);
+        }
+
+        for (guint i = 0; i < globals.shm_names->len; i++)
+        {
+            setup_shm_connection(g_ptr_array_index(globals.shm_names, i));
+        }
+
+        if (!globals.servers->len && !globals.listen_port &&
+            !globals.shm_names->len)
+        {
+            g_warning("No --server, --listen or --shm - nothing will reach us");
+        }
     }
 
     /* Set up a trigger function to run approximately every second */
@@ -59,14 +59,22 @@ typedef struct globals_t {
     int dummy;
     /** No threading mode - run in a single thread */
     int nothread;
+    /** Talk to wowza through io_uring, rather than the main loop, if we can
+     * - see interface_uring.h */
+    int io_uring;
+    /** Pin each worker thread to its own physical core */
+    int pin_workers;
+    /** Decode, echo-cancel and encode each packet in separate stages, so
+     * consecutive packets of a stream overlap - see conversation_pipeline() */
+    int pipeline;
+    /** Reflect audio unprocessed if it has waited this many milliseconds
+     * before we start on it. 0 for no deadline */
+    int deadline_ms;
     /** Number of milliseconds of echo to handle  */
     int echo_path;
-    /** Sample rate to use for echo cancellation */
+    /** Default (and highest) sample rate to use for echo cancellation. Each
+     * conversation may run lower, depending on its codec - see echo.h */
     int sample_rate;
-    /** nlms length in taps (ms of echo path * TAPS_PER_MS) */
-    int nlms_len;
-    /** DTD hangover time, in taps - default is 30 ms. (ms * TAPS_PER_MS) */
-    int dtd_hangover;
 
     /** Logging options */
     int verbose;
@@ -76,20 +84,41 @@ typedef struct globals_t {
     char *basename;
     int shardnum;
     char *fullname;
-    gchar *server_host;         // Server machine and port are both set with the
-    int server_port;            // "server" command-line option
+    GPtrArray *servers;         /**< "host:port" of each wowza to connect to,
+                                     from the "server" command-line option */
+    int listen_port;            /**< Port wowzas may connect to us on, or 0 */
+    GPtrArray *shm_names;       /**< Shared-memory segment to serve a wowza
+                                     through, for each "shm" option */
 } globals_t;
 
+/// Why a message was reflected back to wowza unprocessed - or for
+/// DROP_BACKED_UP, why a reply was never sent at all
+typedef enum drop_reason {
+    DROP_QUEUE_FULL,            /// Its bucket's queue was full
+    DROP_EXPIRED,               /// Past its deadline before we started on it
+    DROP_NO_STREAM,             /// Its conversation wasn't found, or ended
+    DROP_FAILED,                /// Couldn't be decoded or encoded
+    DROP_BACKED_UP,             /// Its wowza's replies were backed up
+    NUM_DROP_REASONS
+} drop_reason;
+
 typedef struct stats_t {
 
     float cpu_mips;              /// MIPS per core - read-only, no lock required
     int num_cpus;
     float ec_per_core;           /// Estimate of how many ec we can run per core
-    int num_threads;             /// How many threads we actually run
+    int num_threads;             /// Worker threads taking work right now
+    float utilization;           /// Share of their time spent processing
+                                 /// audio, over the last second
 
     uint64_t samples_processed;            /// Processed in the last minute
     uint64_t total_samples_processed;      /// Processed over server lifetime
     uint64_t total_us;                     /// Total time spent processing
+    uint64_t total_cycles;                 /// CPU cycles spent processing
+
+    /// Audio reflected unprocessed in the last minute, by reason. Updated
+    /// atomically - no lock required
+    volatile gint dropped[NUM_DROP_REASONS];
 } stats_t;
 
 
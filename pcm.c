@@ -0,0 +1,50 @@
+#include <glib.h>
+
+#include "cbuffer.h"
+#include "imo_message.h"
+#include "kodama.h"
+#include "pcm.h"
+#include "util.h"
+
+int pcm_parse_body(const unsigned char *data, int len, SAMPLE_BLOCK **sb)
+{
+    int count = (len - PCM_HEADER_LEN) / 2;
+
+    if (len < PCM_HEADER_LEN || data[0] != PCM_TAG ||
+        (len - PCM_HEADER_LEN) % 2 || count == 0 || count > PCM_MAX_SAMPLES)
+    {
+        return -1;
+    }
+
+    const unsigned char *p = data + PCM_HEADER_LEN;
+
+    *sb = sample_block_create(count);
+    (*sb)->pts = read_uint32_be(data + 1);
+    for (int i = 0; i < count; i++, p += 2)
+    {
+        (*sb)->s[i] = (SAMPLE)(p[0] | (p[1] << 8));
+    }
+
+    return 0;
+}
+
+int pcm_create_body(unsigned char **body, int *len, SAMPLE_BLOCK *sb)
+{
+    *len = PCM_HEADER_LEN + sb->count * 2;
+    /* With room for the imo header, so the reply is built around it */
+    *body = imo_body_alloc(*len);
+
+    unsigned char *p = *body;
+    *p++ = PCM_TAG;
+    write_uint32_be(p, (unsigned int)sb->pts);
+    p += 4;
+
+    for (size_t i = 0; i < sb->count; i++)
+    {
+        guint16 s = (guint16)sb->s[i];
+        *p++ = s & 0xff;
+        *p++ = s >> 8;
+    }
+
+    return 0;
+}
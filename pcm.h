@@ -0,0 +1,49 @@
+#ifndef _PCM_H_
+#define _PCM_H_
+
+/// First byte of a raw PCM audio body, where an FLV tag would have its tag
+/// type. Never an FLV tag type, so the two can't be confused
+#define PCM_TAG (0x50)           /* 'P' */
+
+/// Bytes before the samples: the tag, then a 32-bit big-endian timestamp in
+/// milliseconds, as an FLV tag's
+#define PCM_HEADER_LEN (1 + 4)
+
+/// Most samples one body may carry - a second at 16kHz, as
+/// KODAMA_MAX_AUDIO_FRAME_SIZE
+#define PCM_MAX_SAMPLES (16000)
+
+struct SAMPLE_BLOCK;
+
+/**
+ * Read the samples out of a raw PCM body: PCM_TAG, the timestamp, then 16-bit
+ * little-endian mono samples at the conversation's rate. For clients which
+ * handle codecs themselves - see the "pcm" option of 'S' messages. No codec,
+ * and no resampling.
+ *
+ * \note Caller must free sb.
+ *
+ * @param data The body.
+ * @param len Its length.
+ * @param sb Will hold the samples, and the timestamp as their pts.
+ *
+ * @return Zero on success, non-zero if it isn't a well-formed PCM body.
+ */
+int pcm_parse_body(const unsigned char *data, int len,
+    struct SAMPLE_BLOCK **sb);
+
+/**
+ * Write samples out as a raw PCM body, in the format pcm_parse_body() reads.
+ *
+ * \note Caller must free body with imo_body_free(), or hand it to
+ * create_imo_message_around().
+ *
+ * @param body Address of the body to create.
+ * @param len Will contain its length.
+ * @param sb The samples, and their pts.
+ *
+ * @return Zero on success.
+ */
+int pcm_create_body(unsigned char **body, int *len, struct SAMPLE_BLOCK *sb);
+
+#endif
@@ -1,33 +1,170 @@
+#include <arpa/inet.h>
 #include <glib.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 
+#include "admission.h"
 #include "cbuffer.h"
 #include "conversation.h"
+#include "flv.h"
+#include "governor.h"
 #include "imo_message.h"
 #include "interface_tcp.h"
+#include "pcm.h"
 #include "protocol.h"
+#include "ring.h"
 #include "util.h"
 
 extern globals_t globals;
 extern stats_t stats;
-
-/// Incoming imo messages get queued here for the next available thread
-GAsyncQueue *work_queue = NULL;
-
-/// Messages to send back to wowza get queued here for the main thread
-GAsyncQueue *return_queue = NULL;
+G_LOCK_EXTERN(stats);
+
+/// Number of buckets conversations are hashed into. A bucket is owned by one
+/// worker at a time, and is the unit of work stealing
+#define NUM_BUCKETS (1024)
+
+/// Most messages a worker handles from one bucket before giving others a turn.
+/// Audio from one stream within these is processed as a batch
+#define BUCKET_BATCH (16)
+
+/* A whole run of a bucket's messages may be from one stream */
+#if BUCKET_BATCH > R_BATCH_MAX
+#error "BUCKET_BATCH must not be more than R_BATCH_MAX"
+#endif
+
+/// Messages a bucket can hold before we start reflecting new ones unprocessed
+#define BUCKET_RING_SIZE (256)
+
+/// Most buckets a worker takes off its run queue at once, to run the one with
+/// the earliest deadline first. The rest stay where others can steal them
+#define EDF_WINDOW (8)
+
+/// Share of the active workers' time we aim to keep busy with audio. Above it
+/// we add workers right away...
+#define POOL_TARGET_UTILIZATION (0.75)
+/// ...as we do if more than this many messages are waiting per worker
+#define POOL_GROW_QUEUE (4)
+/// Seconds in a row with too many workers before we retire one. Retiring is
+/// cheap, but we'd rather not lose the cache of a worker we'll want again soon
+#define POOL_SHRINK_AFTER (30)
+
+/// Pending messages for the conversations which hash to one bucket. The
+/// messages are handled in arrival order, by one worker at a time.
+typedef struct work_bucket {
+    ring *msgs;                 /**< Messages waiting to be handled */
+    volatile gint scheduled;    /**< On a run queue, or being run */
+    volatile gint owner;        /**< Index of the worker this bucket runs on */
+    gint64 deadline;            /**< Of its oldest message, while on an EDF
+                                     heap - see message_deadline() */
+} work_bucket;
+
+/// A worker thread and its run queue
+typedef struct worker {
+    int id;
+    int cpu;                    /**< CPU we're pinned to, or -1 */
+
+    ring *runnable;             /**< Buckets with messages to handle */
+    parker parker;              /**< Where we sleep when there's no work */
+    volatile gint busy;         /**< Running a bucket - others may steal */
+    gboolean started;           /**< Has a thread. Only touched by whoever
+                                     resizes the pool */
+
+    /// Buckets taken off runnable, as a min-heap on deadline. Only we touch it
+    work_bucket *edf[EDF_WINDOW];
+    int edf_len;
+} worker;
+
+static work_bucket *buckets = NULL;
+static worker *workers = NULL;
+/// Workers we may run - one per CPU, so they never have to share one
+static int num_workers = 0;
+/// Workers taking on work. Workers past this one run what's already on their
+/// run queues, then park until the pool grows again
+static volatile gint active_workers = 0;
+
+/// Where dispatch_imo_message() sends a message
+typedef enum message_lane {
+    LANE_AUDIO,                 /**< To the workers - audio, and the 'S' and
+                                     'E' messages for its streams */
+    LANE_REFLECT                /**< Straight back to wowza */
+} message_lane;
 
 static void exit_thread_now(gpointer thread, gpointer user_data);
 static gpointer worker_thread_loop(gpointer data);
-static gpointer wowza_thread_loop(gpointer data);
-
-static void queue_imo_message_for_wowza(imo_message *msg);
-
-/// How long, in us, to sleep when we can't immediately acquire a conversation's
-/// lock
-#define LOCK_SLEEP_TIME 10
+static message_lane classify_message(imo_message *msg);
+
+static void worker_schedule(worker *w, work_bucket *b);
+static void wake_idle_worker(worker *busy);
+static work_bucket *worker_next_bucket(worker *w);
+static work_bucket *worker_pick_bucket(worker *w);
+static void edf_push(worker *w, work_bucket *b);
+static work_bucket *edf_pop(worker *w);
+static work_bucket *steal_bucket(worker *thief);
+static void run_bucket(work_bucket *b);
+static void pin_workers(void);
+static void start_workers(int count);
+static gboolean worker_active(worker *w);
+static worker *bucket_worker(work_bucket *b);
+
+/// An audio message waiting to run on its conversation side's strand, or
+/// going through the pipeline
+typedef struct audio_job {
+    imo_message *msg;
+    stream_handle handle;       /**< Stream msg belongs to */
+    const unsigned char *flv_data; /**< Points into msg */
+    int flv_len;
+} audio_job;
+
+/// Consecutive audio messages from one stream, handled together on its
+/// strand
+typedef struct audio_batch {
+    stream_handle handle;
+    const char *stream_name;    /**< Points into msgs[0] */
+    int name_len;
+    int count;
+    imo_message *msgs[R_BATCH_MAX];
+    audio_packet packets[R_BATCH_MAX]; /**< flv_data points into msgs */
+} audio_batch;
+
+/// An 'E' message waiting on its stream's strand, behind the audio already
+/// submitted there
+typedef struct end_job {
+    imo_message *msg;
+    gchar *stream_name;
+} end_job;
+
+/// Audio messages from a run of a bucket's messages, gathered by stream
+typedef struct audio_gather {
+    audio_batch *batches[BUCKET_BATCH];
+    int count;
+} audio_gather;
+
+static void handle_imo_messages(imo_message **msgs, int count);
+static void handle_batch_message(imo_message *msg);
+static void dispatch_batch_message(imo_message *msg);
+static void gather_audio(audio_gather *g, imo_message *msg);
+static void gather_flush(audio_gather *g);
+static void submit_audio_batch(audio_batch *batch);
+static void handle_audio_batch(gpointer item);
+static stream_handle audio_message_stream(imo_message *msg);
+static void handle_audio_message(imo_message *msg,
+    const unsigned char *flv_data, int flv_len);
+static void handle_audio_job(gpointer item);
+static void handle_end_job(gpointer item);
+static void audio_job_done(gpointer item, int ret,
+    unsigned char *return_flv_packet, int return_flv_len);
+static void return_audio_result(imo_message *msg, const char *stream_name,
+    int ret, unsigned char *return_flv_packet, int return_flv_len);
+static void return_imo_message(imo_message *msg);
+static guint bucket_hash(imo_message *msg);
+static void reject_stream(imo_message *msg, const char *stream_name);
+static void send_stream_handle(imo_message *msg, const char *stream_name);
+static void accept_pcm(imo_message *msg, const char *stream_name);
+static gboolean is_audio_message(imo_message *msg);
+static gint64 message_deadline(imo_message *msg);
+static gboolean message_expired(imo_message *msg);
 
 
 void init_protocol(void)
@@ -35,36 +172,203 @@ void init_protocol(void)
     if (globals.nothread)
     {
         g_debug("THREADING DISABLED");
+        if (globals.pipeline)
+        {
+            g_warning("--pipeline needs threads - ignoring it");
+            globals.pipeline = 0;
+        }
+        if (globals.io_uring)
+        {
+            g_warning("--io-uring needs threads - ignoring it");
+            globals.io_uring = 0;
+        }
+        G_LOCK(stats);
+        stats.num_threads = 1;
+        G_UNLOCK(stats);
         return;
     }
 
-    if (work_queue)
+    if (workers)
     {
         return;
     }
-    work_queue = g_async_queue_new();
-    return_queue = g_async_queue_new();
+    /* More workers than CPUs would only take turns on them. Start with one
+     * per physical core - resize_workers() adds the hyperthreads if the load
+     * needs them, and retires workers it doesn't */
+    num_workers = num_processors();
+    int *cpus = malloc(num_workers * sizeof(int));
+    int num_cores = physical_core_cpus(cpus, num_workers);
+    free(cpus);
+    if (num_cores <= 0)
+    {
+        num_cores = num_workers;
+    }
 
-    /* We assume the global stats object has been populated at this point -
-     * start the number of threads that we've determined is appropriate */
-    if (stats.num_threads == 1)
+    workers = malloc(num_workers * sizeof(worker));
+    for (int i = 0; i < num_workers; i++)
     {
-        g_debug("Starting 1 thread");
+        worker *w = &workers[i];
+        w->id = i;
+        w->cpu = -1;
+        /* A bucket is on at most one run queue at a time, so this never
+         * fills up */
+        w->runnable = ring_new(NUM_BUCKETS);
+        parker_init(&w->parker);
+        w->busy = FALSE;
+        w->started = FALSE;
+        w->edf_len = 0;
     }
-    else
+
+    /* Spread the buckets evenly across workers to start with. Stealing will
+     * move them around as load requires */
+    buckets = malloc(NUM_BUCKETS * sizeof(work_bucket));
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        work_bucket *b = &buckets[i];
+        b->msgs = ring_new(BUCKET_RING_SIZE);
+        b->scheduled = FALSE;
+        b->owner = i % num_cores;
+        b->deadline = 0;
+    }
+
+    if (globals.pin_workers)
     {
-        g_debug("Starting %d threads (%.01f conversations)",
-                stats.num_threads, stats.num_threads * 0.5);
+        pin_workers();
     }
 
-    for (int i = 0; i < stats.num_threads; i++)
+    g_debug("Starting %d of up to %d workers", num_cores, num_workers);
+    start_workers(num_cores);
+
+    /* Workers only dispatch audio in pipeline mode - the stages do the work,
+     * so give them as many threads as we'd otherwise have had workers.
+     * resize_workers() keeps the two in step */
+    if (globals.pipeline)
+    {
+        conversation_start_pipeline(num_cores);
+    }
+}
+
+/* Assign each worker a physical core, so hyperthread siblings don't end up
+ * sharing a cache between two busy workers */
+static void pin_workers(void)
+{
+    int num_cpus = num_processors();
+    int *cpus = malloc(num_cpus * sizeof(int));
+    int num_cores = physical_core_cpus(cpus, num_cpus);
+
+    if (num_cores <= 0)
+    {
+        g_warning("Unable to determine physical cores - not pinning workers");
+        free(cpus);
+        return;
+    }
+
+    g_debug("Pinning %d workers to %d physical cores", num_workers,
+        num_cores);
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers[i].cpu = cpus[i % num_cores];
+    }
+
+    free(cpus);
+}
+
+/* Make the first count workers active, starting threads for any which have
+ * never run. Only called from one thread at a time. */
+static void start_workers(int count)
+{
+    for (int i = 0; i < count; i++)
     {
-        /* TODO: should we save thread objects? */
-        /* TODO: monitor when threads crash so we can start them up again */
-        g_thread_create(worker_thread_loop, NULL, FALSE, NULL);
+        worker *w = &workers[i];
+        if (!w->started)
+        {
+            /* TODO: monitor when threads crash so we can start them up
+             * again */
+            g_thread_create(worker_thread_loop, w, FALSE, NULL);
+            w->started = TRUE;
+        }
     }
 
-    g_thread_create(wowza_thread_loop, NULL, FALSE, NULL);
+    g_atomic_int_set(&active_workers, count);
+
+    G_LOCK(stats);
+    stats.num_threads = count;
+    G_UNLOCK(stats);
+}
+
+void resize_workers(void)
+{
+    static uint64_t last_total_us = 0;
+    static struct timeval last_resize = {0, 0};
+    static int calm_seconds = 0;
+    struct timeval now;
+
+    if (!workers)
+    {
+        return;
+    }
+
+    G_LOCK(stats);
+    uint64_t total_us = stats.total_us;
+    G_UNLOCK(stats);
+
+    gettimeofday(&now, NULL);
+    long elapsed_us = last_resize.tv_sec ? delta(&last_resize, &now) : 0;
+    uint64_t busy_us = total_us - last_total_us;
+    last_total_us = total_us;
+    last_resize = now;
+
+    /* total_us goes backwards if stats were reset - skip a beat */
+    if (elapsed_us <= 0 || total_us < busy_us)
+    {
+        return;
+    }
+
+    int active = g_atomic_int_get(&active_workers);
+
+    /* How many CPUs' worth of audio we processed, and how many workers that
+     * needs to keep them at the target utilization */
+    float cpus_busy = (float)busy_us / elapsed_us;
+    int wanted = ceilf(cpus_busy / POOL_TARGET_UTILIZATION);
+    int queued = protocol_queued_messages();
+    if (queued > POOL_GROW_QUEUE * active)
+    {
+        /* Falling behind, whatever the measurements say */
+        wanted = MAX(wanted, active + 1);
+    }
+    wanted = CLAMP(wanted, 1, num_workers);
+
+    G_LOCK(stats);
+    stats.utilization = cpus_busy / active;
+    G_UNLOCK(stats);
+
+    if (wanted > active)
+    {
+        g_debug("Growing from %d to %d workers (%.0f%% busy, %d queued)",
+            active, wanted, 100 * cpus_busy / active, queued);
+        calm_seconds = 0;
+    }
+    else if (wanted < active && ++calm_seconds >= POOL_SHRINK_AFTER)
+    {
+        wanted = active - 1;
+        g_debug("Retiring a worker - %d left (%.0f%% busy)", wanted,
+            100 * cpus_busy / active);
+        calm_seconds = 0;
+    }
+    else
+    {
+        if (wanted == active)
+        {
+            calm_seconds = 0;
+        }
+        return;
+    }
+
+    start_workers(wanted);
+    if (globals.pipeline)
+    {
+        conversation_resize_pipeline(wanted);
+    }
 }
 
 void exit_all_threads(void)
@@ -146,18 +450,47 @@ void handle_imo_message(imo_message *msg)
 
     char *stream_name;
     char type;
+    char *hex;
+    imo_start_params params;
 
-    /* We may or may not get these */
-    unsigned char *flv_data = NULL;
-    int flv_len = 0;
+    const char *peek_name;
+    int peek_name_len;
+    const unsigned char *peek_data;
+    int peek_len;
 
-    int reflect = 1;            /* Reflect this message back unchanged? */
+    if (imo_message_peek(msg, &type, &peek_name, &peek_name_len, &peek_data,
+            &peek_len))
+    {
+        g_warning("Malformed imo message (%d bytes)", msg->length);
+        return_imo_message(msg);
+        return;
+    }
 
-    struct timeval start, end;
-    long d_us;
-    char *hex;
+    /* Nearly everything is audio - handle it in place, without copying the
+     * stream name or FLV tag out of the message */
+    if (type == 'D' || type == 'd')
+    {
+        if (message_expired(msg))
+        {
+            count_drop(DROP_EXPIRED);
+            return_imo_message(msg);
+            return;
+        }
+
+        handle_audio_message(msg, peek_data, peek_len);
+        return;
+    }
 
-    decode_imo_message(msg, &type, &stream_name, &flv_data, &flv_len);
+    /* A batch of audio messages - handle each, and answer them together */
+    if (type == 'B' && !globals.dummy)
+    {
+        handle_batch_message(msg);
+        return;
+    }
+
+    /* Everything else is rare enough that copying the name out to
+     * NUL-terminate it doesn't matter */
+    stream_name = g_strndup(peek_name, peek_name_len);
 
     /* TODO: test reflecting message back with different delays -- see what
      * wowza's deadline is */
@@ -173,83 +506,51 @@ void handle_imo_message(imo_message *msg)
         {
             g_debug("(Dummy mode)");
         }
-        conversation_start(stream_name);
+        decode_start_params(peek_data, peek_len, &params);
+        if (conversation_start(stream_name, params.sample_rate))
+        {
+            /* We're full. Tell wowza to take the conversation elsewhere,
+             * instead of reflecting the 'S' to accept it */
+            reject_stream(msg, stream_name);
+            msg = NULL;
+        }
+        else
+        {
+            /* Ahead of the 'S', so the client has them by the time it knows
+             * it's accepted */
+            if (params.handles)
+            {
+                send_stream_handle(msg, stream_name);
+            }
+            if (params.pcm)
+            {
+                accept_pcm(msg, stream_name);
+            }
+        }
         break;
     case 'E':
         g_debug("Got an E message for stream %s", stream_name);
-        /* Any messages from the other side will just be reflected */
-        conversation_end(stream_name);
-        break;
-    case 'D':
-        /* g_debug("Got a D message for stream %s", stream_name); */
-        if ((!flv_data) || (flv_len == 0))
+        /* Its audio may still be waiting on its strand - end it after that */
+        if (!globals.nothread)
         {
-            g_warning("D message received with no FLV packet");
-        }
-        else if (!globals.dummy)
-        {
-            unsigned char *return_flv_packet = NULL;
-            int return_flv_len;
-            struct timeval t1, t2;
-
-
-            gettimeofday(&start, NULL);
-            gettimeofday(&t1, NULL);
-            int ret;
-            int lock_failure_count = 0;
-            do {
-                ret = r(stream_name, flv_data, flv_len, &return_flv_packet,
-                        &return_flv_len);
-                if (ret == LOCK_FAILURE)
-                {
-                    lock_failure_count++;
-                    if ((lock_failure_count % 10) == 0)
-                    {
-                        /* g_warning("Failed %d times to get lock and process " */
-                        /*         "stream %s (%.03f ms)", */
-                        /*         lock_failure_count, stream_name, */
-                        /*         (float)lock_failure_count*LOCK_SLEEP_TIME/1000); */
-                    }
-                    usleep(LOCK_SLEEP_TIME);
-                }
-            } while (ret == LOCK_FAILURE);
-
-            gettimeofday(&t2, NULL);
-            d_us = delta(&t1, &t2);
-            /* VERBOSE_LOG("P: Time to acquire lock and r: %li\n", d_us); */
-
-            /* Don't reflect if everything is OK */
-            reflect = ((ret != 0) || (return_flv_packet == NULL) ||
-                       (return_flv_len == 0));
-
-            if (!reflect)
+            end_job *job = g_slice_new(end_job);
+            job->msg = msg;
+            job->stream_name = stream_name;
+            stream_handle h = conversation_find_stream(stream_name,
+                strlen(stream_name));
+            if (h != STREAM_HANDLE_NONE &&
+                conversation_submit(h, handle_end_job, job) == 0)
             {
-                imo_message *return_msg;
-                return_msg = create_imo_message('D',
-                    stream_name, return_flv_packet, return_flv_len);
-
-
-                /* Copy the timestamp from the original, incoming message */
-                memcpy(return_msg->ts, msg->ts, sizeof(struct timeval));
-
-                if (globals.nothread)
-                {
-                    /* Send message right away */
-                    send_imo_message(return_msg);
-                }
-                else
-                {
-                    /* Put on return queue for main thread */
-                    queue_imo_message_for_wowza(return_msg);
-                }
+                /* The job has both now */
+                return;
             }
-            /* Ok to do this even if it's NULL */
-            free(return_flv_packet);
-
-            gettimeofday(&end, NULL);
-            d_us = delta(&start, &end);
-            /* VERBOSE_LOG("P: %.02f ms to handle message\n", (d_us/1000.)); */
+            g_slice_free(end_job, job);
         }
+        /* Any messages from the other side will just be reflected */
+        conversation_end(stream_name);
+        break;
+    case 'B':
+        /* Dummy mode - reflecting the whole batch answers every entry */
         break;
     default:
         g_debug("Unknown message type %c", type);
@@ -258,86 +559,939 @@ void handle_imo_message(imo_message *msg)
         free(hex);
     }
 
-    if (reflect)
+    /* Reflect this message back unchanged */
+    if (msg)
+    {
+        return_imo_message(msg);
+    }
+
+    g_free(stream_name);
+}
+
+/* Answer an 'S' message with an 'R' - the shard is full, and the stream should
+ * be started on another one. The body says how full we are, in the same format
+ * as an 'L' message. Takes msg. */
+static void reject_stream(imo_message *msg, const char *stream_name)
+{
+    gchar *load = admission_describe();
+    imo_message *reply = create_imo_message('R', stream_name,
+        (unsigned char *)load, strlen(load));
+
+    reply->ts = msg->ts;
+    reply->origin = msg->origin;
+    return_imo_message(reply);
+    imo_message_destroy(msg);
+
+    g_free(load);
+}
+
+/* Tell the client which sent an 'S' message the handle it may use for its
+ * stream from now on, in an 'H' message. See IMO_HANDLE_LEN */
+static void send_stream_handle(imo_message *msg, const char *stream_name)
+{
+    stream_handle h = conversation_find_stream(stream_name,
+        strlen(stream_name));
+    if (h == STREAM_HANDLE_NONE)
+    {
+        return;
+    }
+
+    guint32 handle_be = htonl(h);
+    imo_message *reply = create_imo_message('H', stream_name,
+        (unsigned char *)&handle_be, IMO_HANDLE_LEN);
+
+    reply->ts = msg->ts;
+    reply->origin = msg->origin;
+    return_imo_message(reply);
+}
+
+/* Let a stream send raw PCM, and tell its client so - and the rate - in a 'P'
+ * message */
+static void accept_pcm(imo_message *msg, const char *stream_name)
+{
+    int sample_rate = conversation_use_pcm(stream_name);
+    if (!sample_rate)
+    {
+        return;
+    }
+
+    gchar *body = g_strdup_printf("rate=%d", sample_rate);
+    imo_message *reply = create_imo_message('P', stream_name,
+        (unsigned char *)body, strlen(body));
+
+    reply->ts = msg->ts;
+    reply->origin = msg->origin;
+    return_imo_message(reply);
+
+    g_free(body);
+}
+
+void send_load_report(void)
+{
+    gchar *load = admission_describe();
+    const char *name = globals.fullname ? globals.fullname : "kodama";
+
+    return_imo_message(create_imo_message('L', name, (unsigned char *)load,
+        strlen(load)));
+
+    g_free(load);
+}
+
+/* Handle a run of messages from one bucket. Audio messages for the same stream
+ * are gathered into one batch, which pays for the stream lookup, the strand and
+ * the echo canceler's lock once. The entries of a 'B' message arrive one by
+ * one, each in its own stream's bucket (see dispatch_batch_message()).
+ * Anything else is handled in order - batches gathered before it are
+ * submitted first. */
+static void handle_imo_messages(imo_message **msgs, int count)
+{
+    audio_gather g;
+    g.count = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        gather_audio(&g, msgs[i]);
+    }
+
+    gather_flush(&g);
+}
+
+/* Handle each entry of a 'B' message on its own, and answer them together */
+static void handle_batch_message(imo_message *msg)
+{
+    imo_batch *batch = imo_batch_split(msg);
+
+    if (!batch)
+    {
+        g_warning("Malformed batch message (%d bytes)", msg->length);
+        return_imo_message(msg);
+        return;
+    }
+
+    for (int i = 0; i < batch->count; i++)
+    {
+        handle_imo_message(batch->entries[i]);
+    }
+
+    if (imo_batch_release(batch))
+    {
+        return_imo_message(imo_batch_reply(batch));
+    }
+}
+
+/* Add an audio message to the batch for its stream, or handle anything else
+ * right away, once what's been gathered so far has been submitted */
+static void gather_audio(audio_gather *g, imo_message *msg)
+{
+    char type;
+    const char *name;
+    int name_len;
+    const unsigned char *flv_data;
+    int flv_len;
+
+    if (globals.dummy || imo_message_peek(msg, &type, &name, &name_len,
+            &flv_data, &flv_len) || (type != 'D' && type != 'd') ||
+        !flv_data || !flv_len)
+    {
+        gather_flush(g);
+        handle_imo_message(msg);
+        return;
+    }
+
+    /* Too late to be worth processing - and reflecting it now leaves more
+     * time for the ones behind it */
+    if (message_expired(msg))
+    {
+        count_drop(DROP_EXPIRED);
+        return_imo_message(msg);
+        return;
+    }
+
+    audio_batch *batch = NULL;
+    int j;
+    for (j = 0; j < g->count; j++)
+    {
+        /* A handle is never mistaken for a name of the same length */
+        if (g->batches[j]->msgs[0]->type == type &&
+            g->batches[j]->name_len == name_len &&
+            memcmp(g->batches[j]->stream_name, name, name_len) == 0)
+        {
+            batch = g->batches[j];
+            break;
+        }
+    }
+
+    /* A run is at most BUCKET_BATCH messages, so neither a batch nor the
+     * table of them can fill up */
+    if (!batch)
     {
-        if (globals.nothread)
+        batch = g_slice_new(audio_batch);
+        batch->count = 0;
+        batch->stream_name = name;
+        batch->name_len = name_len;
+        g->batches[j] = batch;
+        if (j == g->count)
         {
-            send_imo_message(msg);
+            g->count++;
+        }
+    }
+
+    batch->msgs[batch->count] = msg;
+    batch->packets[batch->count].flv_data = flv_data;
+    batch->packets[batch->count].flv_len = flv_len;
+    batch->count++;
+}
+
+/* Submit every batch gathered so far */
+static void gather_flush(audio_gather *g)
+{
+    for (int j = 0; j < g->count; j++)
+    {
+        submit_audio_batch(g->batches[j]);
+    }
+    g->count = 0;
+}
+
+/* Hand a batch to its stream's strand, or reflect it if there's no such
+ * stream. Either way, the batch is gone once this returns. */
+static void submit_audio_batch(audio_batch *batch)
+{
+    batch->handle = audio_message_stream(batch->msgs[0]);
+
+    if (batch->handle != STREAM_HANDLE_NONE &&
+        conversation_submit(batch->handle, handle_audio_batch, batch) == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < batch->count; i++)
+    {
+        count_drop(DROP_NO_STREAM);
+        return_imo_message(batch->msgs[i]);
+    }
+    g_slice_free(audio_batch, batch);
+}
+
+/* Runs on the strand for the batch's side of its conversation */
+static void handle_audio_batch(gpointer item)
+{
+    audio_batch *batch = item;
+
+    /* The strand may have been busy for a while - drop whatever has expired
+     * while we waited for it */
+    int count = 0;
+    for (int i = 0; i < batch->count; i++)
+    {
+        if (message_expired(batch->msgs[i]))
+        {
+            count_drop(DROP_EXPIRED);
+            return_imo_message(batch->msgs[i]);
         }
         else
         {
-            queue_imo_message_for_wowza(msg);
+            batch->msgs[count] = batch->msgs[i];
+            batch->packets[count] = batch->packets[i];
+            count++;
+        }
+    }
+    batch->count = count;
+
+    if (!batch->count)
+    {
+        /* Nothing left to do */
+    }
+    else if (r_batch(batch->handle, batch->packets, batch->count))
+    {
+        /* The conversation ended while the batch was queued */
+        for (int i = 0; i < batch->count; i++)
+        {
+            count_drop(DROP_NO_STREAM);
+            return_imo_message(batch->msgs[i]);
         }
     }
     else
     {
+        gchar *stream_name = conversation_stream_name(batch->handle);
+
+        for (int i = 0; i < batch->count; i++)
+        {
+            audio_packet *p = &batch->packets[i];
+            return_audio_result(batch->msgs[i], stream_name, p->ret,
+                p->return_flv_data, p->return_flv_len);
+        }
+        g_free(stream_name);
+    }
+
+    g_slice_free(audio_batch, batch);
+}
+
+/* The stream an audio message is for - straight from its handle for a 'd'
+ * message, or looked up by name for a 'D'. STREAM_HANDLE_NONE if there's no
+ * such stream. A stale handle is passed through, and fails to resolve when
+ * it's used */
+static stream_handle audio_message_stream(imo_message *msg)
+{
+    if (msg->type == 'd')
+    {
+        return imo_message_handle(msg);
+    }
+
+    return conversation_find_stream((const char *)msg->name.data,
+        msg->name.len);
+}
+
+/* Handle a 'D' or 'd' message. flv_data points into msg */
+static void handle_audio_message(imo_message *msg,
+    const unsigned char *flv_data, int flv_len)
+{
+    if ((!flv_data) || (flv_len == 0))
+    {
+        g_warning("D message received with no FLV packet");
+    }
+    else if (!globals.dummy)
+    {
+        stream_handle h = audio_message_stream(msg);
+
+        if (h != STREAM_HANDLE_NONE)
+        {
+            audio_job *job = g_slice_new(audio_job);
+            job->msg = msg;
+            job->handle = h;
+            job->flv_data = flv_data;
+            job->flv_len = flv_len;
+
+            /* The job owns msg from here on. If this side of the conversation
+             * is busy on another thread, that thread will run the job once
+             * it's done - we don't wait for it */
+            int ret = globals.pipeline ?
+                conversation_pipeline(h, flv_data, flv_len, audio_job_done,
+                    job) :
+                conversation_submit(h, handle_audio_job, job);
+            if (ret == 0)
+            {
+                return;
+            }
+
+            /* The conversation just ended - reflect it */
+            g_slice_free(audio_job, job);
+        }
+        count_drop(DROP_NO_STREAM);
+    }
+
+    /* Reflect this message back unchanged */
+    return_imo_message(msg);
+}
+
+/* Runs on the strand for the ending stream's side of its conversation, once
+ * the audio ahead of it has been handled */
+static void handle_end_job(gpointer item)
+{
+    end_job *job = item;
+
+    /* Any messages from the other side will just be reflected */
+    conversation_end(job->stream_name);
+    return_imo_message(job->msg);
+
+    g_free(job->stream_name);
+    g_slice_free(end_job, job);
+}
+
+/* Runs on the strand for the job's side of its conversation */
+static void handle_audio_job(gpointer item)
+{
+    audio_job *job = item;
+
+    unsigned char *return_flv_packet = NULL;
+    int return_flv_len = 0;
+    struct timeval start, end;
+    long d_us;
+
+    gettimeofday(&start, NULL);
+
+    if (message_expired(job->msg))
+    {
+        count_drop(DROP_EXPIRED);
+        return_imo_message(job->msg);
+        g_slice_free(audio_job, job);
+        return;
+    }
+
+    int ret = r(job->handle, job->flv_data, job->flv_len,
+        &return_flv_packet, &return_flv_len);
+
+    audio_job_done(job, ret, return_flv_packet, return_flv_len);
+
+    gettimeofday(&end, NULL);
+    d_us = delta(&start, &end);
+    /* VERBOSE_LOG("P: %.02f ms to handle message\n", (d_us/1000.)); */
+}
+
+/* Send back the result of an audio job, and free it. Called from a stage
+ * thread in pipeline mode */
+static void audio_job_done(gpointer item, int ret,
+    unsigned char *return_flv_packet, int return_flv_len)
+{
+    audio_job *job = item;
+
+    /* NULL if the conversation ended while we were working on it */
+    gchar *stream_name = conversation_stream_name(job->handle);
+
+    return_audio_result(job->msg, stream_name, ret, return_flv_packet,
+        return_flv_len);
+
+    g_free(stream_name);
+    g_slice_free(audio_job, job);
+}
+
+/* Send the echo-canceled version of msg back to wowza, or msg itself if it
+ * couldn't be processed. Takes msg and return_flv_packet. */
+static void return_audio_result(imo_message *msg, const char *stream_name,
+    int ret, unsigned char *return_flv_packet, int return_flv_len)
+{
+    /* Don't reflect if everything is OK */
+    if ((ret == 0) && return_flv_packet && return_flv_len && stream_name)
+    {
+        /* The tag was encoded with room for the header in front of it. A
+         * client which sent us a handle gets one back */
+        imo_message *return_msg;
+        return_msg = msg->type == 'd' ?
+            create_imo_message_around_handle('d', imo_message_handle(msg),
+                return_flv_packet, return_flv_len) :
+            create_imo_message_around('D', stream_name, return_flv_packet,
+                return_flv_len);
+        return_flv_packet = NULL;
+
+        /* Copy the timestamp and origin from the original, incoming
+         * message */
+        return_msg->ts = msg->ts;
+        return_msg->origin = msg->origin;
+        return_msg->batch = msg->batch;
+        return_msg->batch_index = msg->batch_index;
+
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        governor_packet_done(delta(&msg->ts, &now));
+
+        return_imo_message(return_msg);
+
         /* Done with this message */
         imo_message_destroy(msg);
     }
+    else
+    {
+        count_drop(stream_name ? DROP_FAILED : DROP_NO_STREAM);
+        return_imo_message(msg);
+    }
+
+    /* Ok to do this even if it's NULL */
+    imo_body_free(return_flv_packet);
+}
+
+/* Send a message back to the wowza it came from, from whichever thread we're
+ * on. Written right away in nothread mode, and otherwise queued for that
+ * connection's writer. Replies to the entries of a 'B' message wait for each
+ * other, and go back as one 'B' */
+static void return_imo_message(imo_message *msg)
+{
+    imo_batch *batch = msg->batch;
+
+    if (!batch)
+    {
+        send_imo_message(msg);
+    }
+    else if (imo_batch_answer(msg))
+    {
+        send_imo_message(imo_batch_reply(batch));
+    }
+}
 
-    free(stream_name);
-    free(flv_data);             /* Should be ok to free even if it's NULL */
+void dispatch_imo_message(imo_message *msg)
+{
+    if (globals.nothread)
+    {
+        handle_imo_message(msg);
+        return;
+    }
+
+    switch (classify_message(msg))
+    {
+    case LANE_AUDIO:
+        if (msg->type == 'B' && !globals.dummy)
+        {
+            dispatch_batch_message(msg);
+            break;
+        }
+        queue_imo_message_for_worker(msg);
+        break;
+    case LANE_REFLECT:
+        return_imo_message(msg);
+        break;
+    }
+}
+
+/* Send each entry of a 'B' message to its own stream's bucket, so it stays in
+ * order with the stream's other audio, and runs wherever its conversation
+ * does. Their replies are gathered into one 'B' again as they come back */
+static void dispatch_batch_message(imo_message *msg)
+{
+    imo_batch *batch = imo_batch_split(msg);
+
+    if (!batch)
+    {
+        g_warning("Malformed batch message (%d bytes)", msg->length);
+        return_imo_message(msg);
+        return;
+    }
+
+    for (int i = 0; i < batch->count; i++)
+    {
+        imo_message *entry = batch->entries[i];
+        if (classify_message(entry) == LANE_AUDIO)
+        {
+            queue_imo_message_for_worker(entry);
+        }
+        else
+        {
+            return_imo_message(entry);
+        }
+    }
+
+    /* Its entries may all have been answered already - reflected, expired,
+     * or for streams which have ended */
+    if (imo_batch_release(batch))
+    {
+        return_imo_message(imo_batch_reply(batch));
+    }
+}
+
+/* Decide where a message goes from its type, and for audio messages the type
+ * of the FLV tag they carry. Cheap enough for the I/O thread - nothing is
+ * copied or decoded */
+static message_lane classify_message(imo_message *msg)
+{
+    char type;
+    const char *name;
+    int name_len;
+    const unsigned char *data;
+    int data_len;
+
+    if (imo_message_peek(msg, &type, &name, &name_len, &data, &data_len))
+    {
+        g_warning("Malformed imo message (%d bytes)", msg->length);
+        return LANE_REFLECT;
+    }
+
+    switch (type)
+    {
+    case 'B':
+        /* Split up by dispatch_batch_message(). Anything in it which isn't
+         * audio is reflected there */
+        return LANE_AUDIO;
+    case 'D':
+    case 'd':
+        /* Video and metadata tags go straight back. Dummy mode still sends
+         * everything to the workers, so it measures the queues as before */
+        if (globals.dummy || (data_len > 0 &&
+                (data[0] == FLV_TAG_TYPE_AUDIO || data[0] == PCM_TAG)))
+        {
+            return LANE_AUDIO;
+        }
+        return LANE_REFLECT;
+    case 'S':
+    case 'E':
+        /* Through the same bucket as the stream's audio, so a conversation
+         * exists before its first packet is handled, and isn't ended before
+         * its last. Having no deadline, they still run ahead of audio which
+         * arrived around the same time */
+        return LANE_AUDIO;
+    default:
+        g_debug("Unknown message type %c", type);
+        return LANE_REFLECT;
+    }
 }
 
 void queue_imo_message_for_worker(imo_message *msg)
 {
     /* g_debug("Queueing an imo message for worker threads"); */
 
-    g_async_queue_push(work_queue, msg);
+    work_bucket *b = &buckets[bucket_hash(msg) % NUM_BUCKETS];
+
+    if (!ring_push(b->msgs, msg))
+    {
+        /* These conversations are hopelessly behind. Don't block the I/O
+         * thread on them - reflect the message so the audio keeps flowing */
+        count_drop(DROP_QUEUE_FULL);
+        if (msg->type == 'S')
+        {
+            /* Reflecting would accept it without a conversation - sending an
+             * 'S' back unchanged means yes - so say we're full instead */
+            gchar *stream_name = g_strndup((const gchar *)msg->name.data,
+                msg->name.len);
+            reject_stream(msg, stream_name);
+            g_free(stream_name);
+            return;
+        }
+        return_imo_message(msg);
+        return;
+    }
+
+    /* If the bucket was already scheduled, whoever is running it will pick
+     * this message up */
+    if (g_atomic_int_compare_and_exchange(&b->scheduled, FALSE, TRUE))
+    {
+        worker_schedule(bucket_worker(b), b);
+    }
 }
 
-static void queue_imo_message_for_wowza(imo_message *msg)
+/* Both sides of a conversation hash to the same bucket, so a conversation's
+ * echo state and codec contexts stay in one worker's cache - whether they name
+ * their streams or send handles. Only in dummy mode does a whole 'B' message
+ * reach a bucket - it goes with its first entry, and is reflected whole */
+static guint bucket_hash(imo_message *msg)
 {
-    g_async_queue_push(return_queue, msg);
+    imo_message first;
+    int offset = 0;
+
+    if (msg->type == 'B' && imo_batch_next(msg, &offset, &first) == 0)
+    {
+        msg = &first;
+    }
+
+    if (msg->type == 'd')
+    {
+        return conversation_hash(imo_message_handle(msg));
+    }
+
+    return imo_message_conversation_hash(msg);
 }
 
-static gpointer worker_thread_loop(gpointer data)
+int protocol_queued_messages(void)
 {
-    UNUSED(data);
+    int queued = 0;
 
-    g_async_queue_ref(work_queue);
-    /* Called fns will append to return_queue */
-    g_async_queue_ref(return_queue);
+    if (!buckets)
+    {
+        return 0;
+    }
 
-    while(TRUE)
+    for (int i = 0; i < NUM_BUCKETS; i++)
     {
-        /* g_debug("Waiting for an imo message"); */
-        imo_message *msg;
+        queued += ring_count(buckets[i].msgs);
+    }
 
-        msg = g_async_queue_pop(work_queue);
+    return queued;
+}
 
-        handle_imo_message(msg);
-        /* g_debug("Handled an imo message"); */
+/* Put a bucket on a worker's run queue */
+static void worker_schedule(worker *w, work_bucket *b)
+{
+    if (!ring_push(w->runnable, b))
+    {
+        /* Can't happen - the ring holds every bucket */
+        g_error("Worker %d run queue overflow", w->id);
+    }
 
-        /* Message will either reflected back and freed once written, or freed
-         * in handle_imo_message */
-        /* imo_message_destroy(msg); */
+    /* w is busy and work is piling up behind it - let someone steal it */
+    if (!parker_unpark(&w->parker) && ring_count(w->runnable) > 1)
+    {
+        wake_idle_worker(w);
     }
-    g_async_queue_unref(return_queue);
-    g_async_queue_unref(work_queue);
+}
 
-    return NULL;
+/* The worker a bucket should be scheduled on. Called by whoever just set
+ * b->scheduled, so nobody else is moving the bucket */
+static worker *bucket_worker(work_bucket *b)
+{
+    int owner = g_atomic_int_get(&b->owner);
+    int active = g_atomic_int_get(&active_workers);
+
+    if (owner >= active)
+    {
+        /* Its worker has retired - spread its buckets over those left */
+        owner = (b - buckets) % active;
+        g_atomic_int_set(&b->owner, owner);
+    }
+
+    return &workers[owner];
 }
 
-static gpointer wowza_thread_loop(gpointer data)
+static gboolean worker_active(worker *w)
 {
-    UNUSED(data);
+    return w->id < g_atomic_int_get(&active_workers);
+}
 
-    g_async_queue_ref(return_queue);
+static void wake_idle_worker(worker *busy)
+{
+    int active = g_atomic_int_get(&active_workers);
 
-    while(TRUE)
+    for (int i = 0; i < active; i++)
     {
-        imo_message *msg;
+        worker *w = &workers[i];
+        if (w != busy && parker_is_parked(&w->parker) &&
+            parker_unpark(&w->parker))
+        {
+            break;
+        }
+    }
+}
 
-        msg = g_async_queue_pop(return_queue);
+/* Get the next bucket for w to run, stealing one if w has nothing to do. Spins
+ * for a while, then parks until there's work. A retired worker doesn't steal,
+ * so it parks once its own run queue is empty. */
+static work_bucket *worker_next_bucket(worker *w)
+{
+    work_bucket *b;
 
-        send_imo_message(msg);
+    while (TRUE)
+    {
+        for (int i = 0; i < w->parker.spin_limit; i++)
+        {
+            if ((b = worker_pick_bucket(w)) ||
+                (worker_active(w) && (b = steal_bucket(w))))
+            {
+                parker_adapt(&w->parker, TRUE);
+                return b;
+            }
+            cpu_relax();
+        }
+
+        /* Anyone scheduling on us from here on will unpark us, so look once
+         * more before we sleep */
+        parker_prepare(&w->parker);
+        if ((b = worker_pick_bucket(w)))
+        {
+            parker_cancel(&w->parker);
+            return b;
+        }
+        parker_adapt(&w->parker, FALSE);
+        parker_park(&w->parker);
+    }
+}
+
+/* Get the most urgent of our own buckets. Buckets on our run queue are in the
+ * order they became runnable, which isn't the order their messages are due in
+ * - a bucket which used up its batch goes to the back, behind buckets with
+ * newer messages. So we look at a few at a time and run the one with the
+ * earliest deadline. */
+static work_bucket *worker_pick_bucket(worker *w)
+{
+    work_bucket *b;
+
+    while (w->edf_len < EDF_WINDOW && (b = ring_pop(w->runnable)))
+    {
+        /* The bucket is scheduled, so we're its only consumer, and its oldest
+         * message stays put while it waits on our heap */
+        imo_message *msg = ring_peek(b->msgs);
+        b->deadline = msg ? message_deadline(msg) : G_MAXINT64;
+        edf_push(w, b);
+    }
+
+    return edf_pop(w);
+}
+
+static void edf_push(worker *w, work_bucket *b)
+{
+    int i = w->edf_len++;
+
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (w->edf[parent]->deadline <= b->deadline)
+        {
+            break;
+        }
+        w->edf[i] = w->edf[parent];
+        i = parent;
+    }
+    w->edf[i] = b;
+}
+
+static work_bucket *edf_pop(worker *w)
+{
+    if (!w->edf_len)
+    {
+        return NULL;
+    }
+
+    work_bucket *top = w->edf[0];
+    work_bucket *last = w->edf[--w->edf_len];
+    int i = 0;
+
+    while (TRUE)
+    {
+        int child = 2 * i + 1;
+        if (child >= w->edf_len)
+        {
+            break;
+        }
+        if (child + 1 < w->edf_len &&
+            w->edf[child + 1]->deadline < w->edf[child]->deadline)
+        {
+            child++;
+        }
+        if (last->deadline <= w->edf[child]->deadline)
+        {
+            break;
+        }
+        w->edf[i] = w->edf[child];
+        i = child;
+    }
+    if (w->edf_len)
+    {
+        w->edf[i] = last;
+    }
+
+    return top;
+}
+
+/* Take a bucket from the most backed-up busy worker. Moving the bucket moves
+ * all of its conversations - their future messages will be scheduled on the
+ * thief, so they don't bounce back and forth between caches. Retired workers
+ * are fair game, so what they have left isn't stuck behind their current
+ * bucket. */
+static work_bucket *steal_bucket(worker *thief)
+{
+    worker *victim = NULL;
+    gsize most = 0;
+
+    /* This only needs to be approximately right */
+    for (int i = 0; i < num_workers; i++)
+    {
+        worker *w = &workers[i];
+        gsize len = ring_count(w->runnable);
+        /* An idle worker is about to run its own work */
+        if (w != thief && g_atomic_int_get(&w->busy) && len > most)
+        {
+            most = len;
+            victim = w;
+        }
+    }
+
+    if (!victim)
+    {
+        return NULL;
+    }
+
+    /* The run queue only pops from the front, so we take the bucket that's
+     * been waiting longest - the victim is busy, so it's also the one that
+     * would have waited longest for it */
+    work_bucket *b = ring_pop(victim->runnable);
+    if (b)
+    {
+        g_atomic_int_set(&b->owner, thief->id);
+    }
+
+    return b;
+}
+
+/* Handle the messages waiting in a bucket. We're the only thread running it
+ * until we clear b->scheduled. */
+static void run_bucket(work_bucket *b)
+{
+    imo_message *msgs[BUCKET_BATCH];
+    int count = 0;
+
+    while (count < BUCKET_BATCH && (msgs[count] = ring_pop(b->msgs)))
+    {
+        count++;
+    }
+
+    /* Pipelined packets overlap with each other already - batching them would
+     * only hold the first ones up */
+    if (globals.pipeline)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            handle_imo_message(msgs[i]);
+        }
+    }
+    else
+    {
+        handle_imo_messages(msgs, count);
+    }
 
-        /* msg will be freed once it's written, in write_data */
-        /* imo_message_destroy(msg); */
+    /* Unschedule before checking for more, so a message pushed in between
+     * either gets scheduled by its producer, or seen by us here */
+    g_atomic_int_set(&b->scheduled, FALSE);
+    __sync_synchronize();
+
+    /* Give other buckets a turn before finishing this one */
+    if (ring_count(b->msgs) &&
+        g_atomic_int_compare_and_exchange(&b->scheduled, FALSE, TRUE))
+    {
+        worker_schedule(bucket_worker(b), b);
     }
+}
+
+static gboolean is_audio_message(imo_message *msg)
+{
+    char type;
+    const char *name;
+    int name_len;
+    const unsigned char *data;
+    int data_len;
 
-    g_async_queue_unref(return_queue);
+    return imo_message_peek(msg, &type, &name, &name_len, &data,
+        &data_len) == 0 && (type == 'D' || type == 'd' || type == 'B');
+}
+
+/* When a message should be done by, in microseconds since the epoch. Only
+ * audio has a deadline - anything else is due when it arrived, so it goes ahead
+ * of audio which arrived around the same time, and is never late. */
+static gint64 message_deadline(imo_message *msg)
+{
+    gint64 arrival = (gint64)msg->ts.tv_sec * G_USEC_PER_SEC +
+        msg->ts.tv_usec;
+
+    if (globals.deadline_ms > 0 && is_audio_message(msg))
+    {
+        return arrival + (gint64)globals.deadline_ms * 1000;
+    }
+
+    return arrival;
+}
+
+/* TRUE if msg is audio that has missed its deadline */
+static gboolean message_expired(imo_message *msg)
+{
+    struct timeval now;
+
+    if (globals.deadline_ms <= 0 || !is_audio_message(msg))
+    {
+        return FALSE;
+    }
+
+    gettimeofday(&now, NULL);
+
+    return (gint64)now.tv_sec * G_USEC_PER_SEC + now.tv_usec >
+        message_deadline(msg);
+}
+
+void count_drop(drop_reason reason)
+{
+    g_atomic_int_inc(&stats.dropped[reason]);
+}
+
+static gpointer worker_thread_loop(gpointer data)
+{
+    worker *w = data;
+
+    if (w->cpu != -1 && pin_thread_to_cpu(w->cpu))
+    {
+        g_warning("Unable to pin worker %d to cpu %d", w->id, w->cpu);
+    }
+
+    while(TRUE)
+    {
+        /* g_debug("Waiting for an imo message"); */
+        work_bucket *b = worker_next_bucket(w);
+
+        /* Messages will either reflected back and freed once written, or freed
+         * in handle_imo_message */
+        g_atomic_int_set(&w->busy, TRUE);
+        run_bucket(b);
+        g_atomic_int_set(&w->busy, FALSE);
+    }
 
     return NULL;
 }
@@ -18,8 +18,30 @@ void init_protocol(void);
 void exit_all_threads(void);
 
 
+/**
+ * Send a message that just arrived from wowza where it's handled: audio to the
+ * workers, 'S' and 'E' to the control thread, and anything else straight back
+ * to wowza. In nothread mode, handle it right away.
+ */
+void dispatch_imo_message(struct imo_message *msg);
+
 void queue_imo_message_for_worker(struct imo_message *msg);
 
+/**
+ * Count the messages waiting in the workers' buckets. Approximate - they're
+ * being added and taken away as we count.
+ *
+ * @return The number of messages, or 0 in nothread mode.
+ */
+int protocol_queued_messages(void);
+
+/**
+ * Grow or shrink the worker pool to fit the load - the time spent processing
+ * audio since the last call, and the messages waiting. Never runs more
+ * workers than CPUs. Call about once a second, from one thread.
+ */
+void resize_workers(void);
+
 /* Protocol 1 - UDP */
 struct SAMPLE_BLOCK *message_to_samples(gchar *buf, gint num_bytes);
 gchar *samples_to_message(struct SAMPLE_BLOCK *sb, gint *num_bytes, protocol proto);
@@ -27,4 +49,16 @@ gchar *samples_to_message(struct SAMPLE_BLOCK *sb, gint *num_bytes, protocol pro
 /* Protocol 2 - imo messages */
 void handle_imo_message(struct imo_message *msg);
 
+/**
+ * Tell wowza how loaded this shard is, with an 'L' message. The stream name is
+ * the shard's full name, and the body is as described by admission_describe().
+ */
+void send_load_report(void);
+
+/**
+ * Count a message we gave up on, for the next stats report. Called from any
+ * thread.
+ */
+void count_drop(drop_reason reason);
+
 #endif
@@ -1,13 +1,13 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <glib.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#include "imolist.h"
 #include "imo_message.h"
 #include "kodama.h"
 #include "read_write.h"
@@ -15,10 +15,22 @@
 
 extern globals_t globals;
 
-static int extract_messages(fd_buffer *fd_buf);
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
 
-/* Map of fd to fd_buffer structs */
+static int frame_messages(fd_buffer *fd_buf, const struct timeval *ts);
+static void next_segment(fd_buffer *fd_buf, int spilled);
+static int take_bytes(fd_buffer *fd_buf, int in_segment, int spilled);
+static fd_buffer *lookup_fd(int fd);
+static void release_fd(fd_buffer *fd_buf);
+static int gather(fd_buffer *fd_buf, struct iovec *iov, int max);
+static int done(fd_buffer *fd_buf, int written);
+
+/* Map of fd to fd_buffer structs. Connections come and go while others are
+ * being read and written, so it's locked */
 GHashTable *fd_to_buffer = NULL;
+G_LOCK_DEFINE_STATIC(fd_to_buffer);
 
 void init_read_write(void)
 {
@@ -28,7 +40,7 @@ void init_read_write(void)
     }
 }
 
-void register_fd(int fd)
+void register_fd(int fd, int origin)
 {
     /* Create an fd_buffer, insert it into the hashtable. Create the hashtable
      * if necessary */
@@ -36,40 +48,66 @@ void register_fd(int fd)
     fd_buffer *fd_buf = malloc(sizeof(fd_buffer));
 
     /* Init all fields */
-    fd_buf->buffer = NULL;
-    fd_buf->buffer_len = 0;
-
-    fd_buf->read_head = fd_buf->read_tail = NULL;
+    fd_buf->segment = imo_segment_new(IMO_SEGMENT_SIZE);
+    fd_buf->start = fd_buf->end = 0;
+    fd_buf->spare = NULL;
+    fd_buf->origin = origin;
 
-    fd_buf->write_head = fd_buf->write_tail = NULL;
+    imo_queue_init(&fd_buf->read_queue);
+    imo_queue_init(&fd_buf->write_queue);
+    fd_buf->write_offset = 0;
 
     fd_buf->mutex = g_mutex_new();
+    fd_buf->refs = 1;
 
-    /* TODO: make sure this fd isn't already present as a key */
-
+    G_LOCK(fd_to_buffer);
+    fd_buffer *old = g_hash_table_lookup(fd_to_buffer, GINT_TO_POINTER(fd));
     g_hash_table_insert(fd_to_buffer, GINT_TO_POINTER(fd), fd_buf);
+    G_UNLOCK(fd_to_buffer);
+
+    if (old)
+    {
+        /* Whoever closed it didn't unregister it first */
+        g_warning("(%s:%d) fd %d was already registered", __FILE__, __LINE__,
+            fd);
+        release_fd(old);
+    }
 }
 
 void unregister_fd(int fd)
 {
-    /* TODO: implement */
-    UNUSED(fd);
+    G_LOCK(fd_to_buffer);
+    fd_buffer *fd_buf = g_hash_table_lookup(fd_to_buffer, GINT_TO_POINTER(fd));
+    if (fd_buf)
+    {
+        g_hash_table_remove(fd_to_buffer, GINT_TO_POINTER(fd));
+    }
+    G_UNLOCK(fd_to_buffer);
+
+    if (!fd_buf)
+    {
+        g_debug("(%s:%d) fd not found: %d", __FILE__, __LINE__, fd);
+        return;
+    }
+
+    /* Nobody new can find it now - it goes once those who have are done */
+    release_fd(fd_buf);
 }
 
-static int extract_messages(fd_buffer *fd_buf)
+/* Frame the complete messages between start and end of the current segment,
+ * in place, and queue them. Returns the number of messages framed, or
+ * READ_ERROR if the stream is corrupt */
+static int frame_messages(fd_buffer *fd_buf, const struct timeval *ts)
 {
     /* Messages will be prepended with their length as a 4-byte integer */
 
-    int buf_len = fd_buf->buffer_len;
-    int offset = 0;
+    unsigned char *buf = fd_buf->segment->data;
     int num_msgs = 0;
-    unsigned char *buf = fd_buf->buffer;
-    unsigned char *temp;
 
     /* We use 4, not sizeof(int), since these come from java, where an int is
      * always 4 bytes */
 
-    while (buf_len - offset > 4)
+    while (fd_buf->end - fd_buf->start >= 4)
     {
         /* Header format:
            Message length (including header)      - 4 bytes (big-endian)
@@ -78,226 +116,365 @@ static int extract_messages(fd_buffer *fd_buf)
            Stream name                            - variable length
         */
 
-        /* First int (4 bytes only) in the buffer at this offset should be a
-         * (big-endian) message length */
+        /* First int (4 bytes only) at start should be a (big-endian) message
+         * length. It needn't be aligned */
         int32_t msg_length;
-        msg_length = ntohl(*((int32_t *)(buf+offset)));
+        memcpy(&msg_length, buf + fd_buf->start, 4);
+        msg_length = ntohl(msg_length);
 
-        /* We know the size of the next message - do we have that many bytes? */
-        if (buf_len >= msg_length + offset)
+        if (msg_length < 6 || msg_length > IMO_MAX_MESSAGE_LEN)
         {
-            temp = malloc(msg_length);
-            memcpy(temp, buf+offset, msg_length);
-
-            imo_message *msg = create_imo_message_from_text(temp, msg_length);
-
-            /* Queue the message in the full message list. temp will have to be
-             * freed later */
-            g_mutex_lock(fd_buf->mutex);
-            slist_append(&(fd_buf->read_head), &(fd_buf->read_tail), msg);
-            g_mutex_unlock(fd_buf->mutex);
-
-            num_msgs++;
-
-            offset += msg_length;
+            /* We'd never find the next message - or wait forever for this
+             * one, having allocated room for it */
+            g_warning("Corrupt message length %d", msg_length);
+            return READ_ERROR;
         }
-        else
+
+        /* We know the size of the next message - do we have that many bytes? */
+        if (fd_buf->end - fd_buf->start < msg_length)
         {
             /* This message is still incomplete */
             break;
         }
+
+        imo_message *msg = create_imo_message_in_segment(fd_buf->segment,
+            buf + fd_buf->start, msg_length, ts);
+        msg->origin = fd_buf->origin;
+        imo_queue_push(&fd_buf->read_queue, msg);
+
+        num_msgs++;
+        fd_buf->start += msg_length;
     }
 
-    if (offset == 0)
+    return num_msgs;
+}
+
+/* Move on to the spare segment, once a read has overflowed into it. The partial
+ * message left at the end of the old segment is copied in front of the bytes
+ * which spilled, so it's contiguous. This is the only copying we do, and it
+ * happens once a segment, not once a message. */
+static void next_segment(fd_buffer *fd_buf, int spilled)
+{
+    imo_segment *old = fd_buf->segment;
+    int partial = fd_buf->end - fd_buf->start;
+    int size = partial + spilled;
+    imo_segment *next;
+
+    /* A message too big for a segment gets one of its own. frame_messages()
+     * has already checked its length */
+    if (partial >= 4)
     {
-        /* We didn't get any new messages - there's at most 1 partial message in
-         * buffer */
-        return 0;
+        int32_t msg_length;
+        memcpy(&msg_length, old->data + fd_buf->start, 4);
+        size = MAX(size, (int)ntohl(msg_length));
     }
 
-    /* There may be data from a partial message left over in the buffer,
-     * starting at offset. Allocate a new buffer for it */
-    temp = NULL;
-    if (buf_len > offset)
+    if (size <= fd_buf->spare->size)
+    {
+        next = fd_buf->spare;
+        fd_buf->spare = NULL;
+        memmove(next->data + partial, next->data, spilled);
+    }
+    else
     {
-        int partial_len = buf_len - offset;
-        temp = malloc(partial_len);
-        memcpy(temp, buf+offset, partial_len);
+        /* The spare stays spare */
+        next = imo_segment_new(size);
+        memcpy(next->data + partial, fd_buf->spare->data, spilled);
     }
+    memcpy(next->data, old->data + fd_buf->start, partial);
 
-    /* Clean up old buffer info */
-    g_free(buf);
-    fd_buf->buffer = temp;
-    fd_buf->buffer_len = buf_len - offset;
+    fd_buf->segment = next;
+    fd_buf->start = 0;
+    fd_buf->end = partial + spilled;
 
-    return num_msgs;
+    /* Freed, or back in the pool, once the last message in it is destroyed */
+    imo_segment_unref(old);
 }
 
 int read_data(int fd)
 {
-    int bytes;
-    int num_msgs;
-    char *tbuf;
+    ssize_t bytes;
     fd_buffer *fd_buf;
+    struct iovec iov[2];
 
     /* Do we know about this fd? */
-    fd_buf = g_hash_table_lookup(fd_to_buffer, GINT_TO_POINTER(fd));
+    fd_buf = lookup_fd(fd);
     if (fd_buf == NULL)
     {
         g_debug("(%s:%d) fd not found: %d", __FILE__, __LINE__, fd);
         return FD_NOT_FOUND;
     }
 
-    /* How many bytes can be read? */
-    if (ioctl(fd, FIONREAD, &bytes))
+    /* Read whatever fits in the rest of the segment, and overflow into the
+     * spare, so one read takes everything that's waiting without asking how
+     * much that is first */
+    if (!fd_buf->spare)
     {
-        /* TODO: check errno here and do something appropriate */
-        g_debug("(%s:%d) error performing ioctl on fd: %d",
-                __FILE__, __LINE__, fd);
-        return READ_ERROR;
+        fd_buf->spare = imo_segment_new(IMO_SEGMENT_SIZE);
     }
+    iov[0].iov_base = fd_buf->segment->data + fd_buf->end;
+    iov[0].iov_len = fd_buf->segment->size - fd_buf->end;
+    iov[1].iov_base = fd_buf->spare->data;
+    iov[1].iov_len = fd_buf->spare->size;
 
-    if (bytes > 0)
+    bytes = readv(fd, iov, 2);
+    if (bytes < 0)
     {
-        tbuf = malloc(bytes);
-        if (read(fd, tbuf, bytes) < bytes)
+        if (errno == EINTR || errno == EAGAIN)
         {
-            if (errno == EINTR || errno == EAGAIN)
-            {
-                free(tbuf);
-                return 0;
-            }
-
-            g_debug("(%s:%d) Error other than EINTR or "
-                    "EAGAIN when reading from fd: %d", __FILE__, __LINE__, fd);
-            /* TODO: if we were building up a partial message, I guess it's dead
-             * now */
-            free(tbuf);
-            /* TODO: clean up this fd_buf? */
-            return READ_ERROR;
+            release_fd(fd_buf);
+            return 0;
         }
 
-        /* We have at least part of a message in tbuf. Append it to any current
-         * incomplete message we have */
-
-        /* Make the buffer large enough to hold all previous data, plus this
-         * data */
-        fd_buf->buffer = realloc(fd_buf->buffer, fd_buf->buffer_len + bytes);
-
-        /* Append the new data */
-        memcpy(fd_buf->buffer + fd_buf->buffer_len, tbuf, bytes);
-        fd_buf->buffer_len += bytes;
-
-        free(tbuf);
+        g_warning("(%s:%d) Error reading from fd %d: %s", __FILE__, __LINE__,
+            fd, strerror(errno));
+        /* Our caller treats any error as the connection being gone - it drops
+         * it, and unregisters fd */
+        release_fd(fd_buf);
+        return READ_ERROR;
     }
     else if (bytes == 0)
     {
         /* Other end closed the fd. Returning this signals caller to tell us to
          * clean up fd_buf, among other things */
+        release_fd(fd_buf);
         return REMOTE_CLOSED;
     }
-    else {
-        /* TODO: how does this happen? Does this even happen? */
-        g_debug("(%s:%d) Entering this clause was a complete surprise to me",
-                __FILE__, __LINE__);
-        return 0;
-    }
 
-    num_msgs = extract_messages(fd_buf);
+    int in_segment = MIN(bytes, (ssize_t)iov[0].iov_len);
+    int num_msgs = take_bytes(fd_buf, in_segment, bytes - in_segment);
+    release_fd(fd_buf);
 
     return num_msgs;
 }
 
-/* Sends the message at the head of the write list for a given fd. Returns the
- * number of messages remaining in the write queue. */
-int write_data(int fd)
+int receive_data(int fd, const unsigned char *data, int len)
 {
     fd_buffer *fd_buf;
-    imo_message *msg = NULL;
-    int written = 0, total;
-    int messages_remaining = 0;
 
-    fd_buf = g_hash_table_lookup(fd_to_buffer, GINT_TO_POINTER(fd));
+    fd_buf = lookup_fd(fd);
+    if (fd_buf == NULL)
+    {
+        g_debug("(%s:%d) fd not found: %d", __FILE__, __LINE__, fd);
+        return FD_NOT_FOUND;
+    }
+
+    /* As read_data, but someone else has done the read. The spare is always
+     * a whole IMO_SEGMENT_SIZE, so anything up to that fits */
+    if (len > IMO_SEGMENT_SIZE)
+    {
+        g_warning("(%s:%d) %d bytes is more than we can take at once",
+            __FILE__, __LINE__, len);
+        release_fd(fd_buf);
+        return READ_ERROR;
+    }
+    if (!fd_buf->spare)
+    {
+        fd_buf->spare = imo_segment_new(IMO_SEGMENT_SIZE);
+    }
+
+    int in_segment = MIN(len, fd_buf->segment->size - fd_buf->end);
+    memcpy(fd_buf->segment->data + fd_buf->end, data, in_segment);
+    memcpy(fd_buf->spare->data, data + in_segment, len - in_segment);
+
+    int num_msgs = take_bytes(fd_buf, in_segment, len - in_segment);
+    release_fd(fd_buf);
+
+    return num_msgs;
+}
+
+/* Frame the bytes a read just put at the end of the segment, and whatever
+ * overflowed into the spare */
+static int take_bytes(fd_buffer *fd_buf, int in_segment, int spilled)
+{
+    int num_msgs;
+    struct timeval now;
+
+    /* Everything in this read arrived together */
+    gettimeofday(&now, NULL);
+
+    fd_buf->end += in_segment;
+
+    num_msgs = frame_messages(fd_buf, &now);
+
+    if (num_msgs >= 0 && spilled)
+    {
+        next_segment(fd_buf, spilled);
+
+        int more = frame_messages(fd_buf, &now);
+        num_msgs = more < 0 ? more : num_msgs + more;
+    }
+
+    if (num_msgs < 0)
+    {
+        /* We can't find message boundaries any more - start over */
+        return REMOTE_CLOSED;
+    }
+
+    return num_msgs;
+}
+
+int write_gather(int fd, struct iovec *iov, int max)
+{
+    fd_buffer *fd_buf = lookup_fd(fd);
+    if (fd_buf == NULL)
+    {
+        return FD_NOT_FOUND;
+    }
+
+    int count = gather(fd_buf, iov, max);
+    release_fd(fd_buf);
+
+    return count;
+}
+
+int write_done(int fd, int written)
+{
+    fd_buffer *fd_buf = lookup_fd(fd);
     if (fd_buf == NULL)
     {
         return FD_NOT_FOUND;
     }
 
+    int remaining = done(fd_buf, written);
+    release_fd(fd_buf);
+
+    return remaining;
+}
+
+/* Point iov at the messages queued on fd_buf. Producers only ever add to the
+ * tail, and only the writer takes messages off the head, so the ones we
+ * gather stay put once we let go of the lock - for as long as fd_buf does */
+static int gather(fd_buffer *fd_buf, struct iovec *iov, int max)
+{
+    int count = 0;
+
     g_mutex_lock(fd_buf->mutex);
+    for (imo_message *msg = fd_buf->write_queue.head;
+         msg && count < max; msg = msg->next)
+    {
+        iov[count].iov_base = msg->text;
+        iov[count].iov_len = msg->length;
+        count++;
+    }
+    g_mutex_unlock(fd_buf->mutex);
 
-    if ((messages_remaining = g_slist_length(fd_buf->write_head)) > 0)
+    if (count)
     {
-        msg = g_slist_nth_data(fd_buf->write_head, 0);
-        slist_delete_first(&(fd_buf->write_head), &(fd_buf->write_tail));
+        /* We may have sent part of the first one last time */
+        iov[0].iov_base = (char *)iov[0].iov_base + fd_buf->write_offset;
+        iov[0].iov_len -= fd_buf->write_offset;
     }
 
+    return count;
+}
+
+/* Take written bytes off the front of fd_buf's queue */
+static int done(fd_buffer *fd_buf, int written)
+{
+    imo_queue sent;
+
+    /* Take off whatever went out completely */
+    imo_queue_init(&sent);
+    g_mutex_lock(fd_buf->mutex);
+    written += fd_buf->write_offset;
+    while (written > 0)
+    {
+        imo_message *msg = fd_buf->write_queue.head;
+        if (written < msg->length)
+        {
+            break;
+        }
+        written -= msg->length;
+        imo_queue_push(&sent, imo_queue_pop(&fd_buf->write_queue));
+    }
+    fd_buf->write_offset = written;
+    int remaining = fd_buf->write_queue.length;
     g_mutex_unlock(fd_buf->mutex);
 
-    if (!messages_remaining)
+    imo_message *msg;
+    while ((msg = imo_queue_pop(&sent)))
     {
-        return 0;
+        imo_message_destroy(msg);
     }
 
-    messages_remaining--;
+    return remaining;
+}
+
+int write_data(int fd)
+{
+    struct iovec iov[IOV_MAX];
+    int remaining;
 
-    total = msg->length;
+    /* Held throughout, so the messages we're writing aren't freed under us if
+     * the connection is dropped meanwhile */
+    fd_buffer *fd_buf = lookup_fd(fd);
+    if (fd_buf == NULL)
+    {
+        return FD_NOT_FOUND;
+    }
 
-    while (written < total)
+    while (TRUE)
     {
-        int length;
-        if((length = write(fd, msg->text+written, total-written)) < 0)
+        int count = gather(fd_buf, iov, IOV_MAX);
+        if (count <= 0)
         {
-            if (errno == EAGAIN || errno == EINTR)
+            release_fd(fd_buf);
+            return count;
+        }
+
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
             {
                 continue;
             }
-            /* Some other error */
-            g_warning("Error in write_data:write(): %s", strerror(errno));
-            imo_message_destroy(msg);
+            if (errno == EAGAIN)
+            {
+                break;
+            }
+            g_warning("Error in write_data:writev(): %s", strerror(errno));
             /* TODO: handle this */
+            release_fd(fd_buf);
             return WRITE_ERROR;
         }
-        written += length;
-    }
 
-    /* We have nothing more to do with the original incoming message. Its
-     * timestamp was copied to this outgoing message - let's see how long
-     * everything took */
-    struct timeval now;
-    gettimeofday(&now, NULL);
-
-    long d_us = delta(msg->ts, &now);
-    /* VERBOSE_LOG("Total time to handle message: %.03f ms\n", d_us/1000.); */
+        remaining = done(fd_buf, written);
 
-    /* We're done with msg at this point */
-    imo_message_destroy(msg);
+        /* A short write means the socket is full */
+        size_t wanted = 0;
+        for (int i = 0; i < count; i++)
+        {
+            wanted += iov[i].iov_len;
+        }
+        if ((size_t)written < wanted)
+        {
+            release_fd(fd_buf);
+            return remaining;
+        }
+    }
 
-    /* g_debug("Sent an imo message"); */
+    remaining = done(fd_buf, 0);
+    release_fd(fd_buf);
 
-    return messages_remaining;
+    return remaining;
 }
 
 int get_next_message(int fd, imo_message **msg)
 {
     fd_buffer *fd_buf;
 
-    /* This existed in a call to read_data immediately prior to this, so should
-     * still be around */
-    fd_buf = g_hash_table_lookup(fd_to_buffer, GINT_TO_POINTER(fd));
-
-    /* If there are no messages in the sll, give up */
-    if (g_slist_length(fd_buf->read_head) <= 0)
-    {
-        *msg = NULL;
-        return 0;
-    }
-
-    /* Only called by one thread, so no need to lock here */
+    /* This existed in a call to read_data immediately prior to this, and only
+     * the thread reading it unregisters it, so should still be around */
+    fd_buf = lookup_fd(fd);
 
-    *msg = g_slist_nth_data(fd_buf->read_head, 0);
-    slist_delete_first(&(fd_buf->read_head), &(fd_buf->read_tail));
+    /* Only called by the thread which reads, so no need to lock here */
+    *msg = imo_queue_pop(&fd_buf->read_queue);
+    int remaining = fd_buf->read_queue.length;
+    release_fd(fd_buf);
 
-    return g_slist_length(fd_buf->read_head);
+    return remaining;
 }
 
 int queue_message(int fd, imo_message *msg)
@@ -309,19 +486,66 @@ int queue_message(int fd, imo_message *msg)
         return 0;
     }
 
-    fd_buf = g_hash_table_lookup(fd_to_buffer, GINT_TO_POINTER(fd));
+    fd_buf = lookup_fd(fd);
     if (fd_buf == NULL)
     {
         g_warning("(%s:%d) No fd_buffer found for fd %d", __FILE__, __LINE__,
                 fd);
-        /* TODO: free msg here */
+        imo_message_destroy(msg);
         return -2;
     }
 
     /* Queue the new message in the write list */
     g_mutex_lock(fd_buf->mutex);
-    slist_append(&(fd_buf->write_head), &(fd_buf->write_tail), msg);
+    imo_queue_push(&fd_buf->write_queue, msg);
     g_mutex_unlock(fd_buf->mutex);
+    release_fd(fd_buf);
 
     return 0;
 }
+
+/* fd's buffer, or NULL. The caller has a reference to it, and must
+ * release_fd() it once it's done */
+static fd_buffer *lookup_fd(int fd)
+{
+    G_LOCK(fd_to_buffer);
+    fd_buffer *fd_buf = g_hash_table_lookup(fd_to_buffer, GINT_TO_POINTER(fd));
+    if (fd_buf)
+    {
+        g_atomic_int_inc(&fd_buf->refs);
+    }
+    G_UNLOCK(fd_to_buffer);
+
+    return fd_buf;
+}
+
+static void destroy_queue(imo_queue *q)
+{
+    imo_message *msg;
+
+    while ((msg = imo_queue_pop(q)))
+    {
+        imo_message_destroy(msg);
+    }
+}
+
+static void release_fd(fd_buffer *fd_buf)
+{
+    if (!g_atomic_int_dec_and_test(&fd_buf->refs))
+    {
+        return;
+    }
+
+    /* Messages hold their own references to the segments they're in, so
+     * these only go once the last of them has been handled */
+    destroy_queue(&fd_buf->read_queue);
+    destroy_queue(&fd_buf->write_queue);
+    imo_segment_unref(fd_buf->segment);
+    if (fd_buf->spare)
+    {
+        imo_segment_unref(fd_buf->spare);
+    }
+
+    g_mutex_free(fd_buf->mutex);
+    free(fd_buf);
+}
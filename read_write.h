@@ -2,32 +2,98 @@
 #define _READ_WRITE_H_
 
 #include <glib.h>               /* Sucks, but oh, well */
+#include <sys/uio.h>
 
 typedef enum read_result {
     REMOTE_CLOSED = -9, WRITE_ERROR = -3, READ_ERROR = -2, FD_NOT_FOUND = -1,
 } read_result;
 
 
-typedef struct fd_buffer {
-    unsigned char *buffer;
-    unsigned int buffer_len;
+#include "imo_message.h"
 
-    GSList *read_head;   /**< Completely read messages */
-    GSList *read_tail;
+typedef struct fd_buffer {
+    imo_segment *segment;       /**< Being read into */
+    int start;                  /**< Offset of the first unframed byte */
+    int end;                    /**< Offset just past the last byte read */
+    imo_segment *spare;         /**< Where reads overflow to - see read_data */
+    int origin;                 /**< Given to the messages read from it */
 
-    GSList *write_head;         /**< Messages queued to send */
-    GSList *write_tail;
+    imo_queue read_queue;       /**< Completely read messages. Only touched by
+                                     the thread reading the fd */
+    imo_queue write_queue;      /**< Messages queued to send. Locked */
+    int write_offset;           /**< Bytes of its head already sent. Only
+                                     touched by the thread writing the fd */
 
     GMutex *mutex;              /**< per-fd mutex */
+    volatile gint refs;         /**< The table's, and one for each call
+                                     using it - it's freed once it's been
+                                     unregistered and they've all returned */
 } fd_buffer;
 
-struct imo_message;
-
 void init_read_write(void);
-void register_fd(int fd);
+
+/**
+ * Start buffering fd's messages.
+ *
+ * @param fd The fd.
+ * @param origin What messages read from it are tagged with, so replies find
+ * their way back - see interface_tcp.h.
+ */
+void register_fd(int fd, int origin);
+
+/**
+ * Stop buffering fd: forget it, and free its buffers, along with any messages
+ * read from it which haven't been taken, and replies which haven't been sent.
+ * A writer part way through write_data() finishes with it first. Call before
+ * closing fd, so its number can't be reused while it's still registered.
+ */
 void unregister_fd(int fd);
 int read_data(int fd);
+
+/**
+ * Take bytes someone else has read from fd - the io_uring backend, from its
+ * provided buffers - and frame the messages they complete, as read_data()
+ * does. data is copied, so the caller may reuse it as soon as this returns.
+ *
+ * @param fd The fd the bytes came from.
+ * @param data The bytes.
+ * @param len How many - no more than IMO_SEGMENT_SIZE.
+ *
+ * @return The number of messages framed, or a read_result.
+ */
+int receive_data(int fd, const unsigned char *data, int len);
+
+/**
+ * Write as many of the messages queued for fd as it will take, up to IOV_MAX at
+ * a time with writev(). Messages are destroyed once they're completely
+ * written. Only one thread may write a given fd.
+ *
+ * @param fd The fd.
+ *
+ * @return The number of messages still queued - nonzero if fd is full, and
+ * we should wait until it's writable - or a read_result on error.
+ */
 int write_data(int fd);
+
+/**
+ * The first half of write_data(), for callers who do the write themselves:
+ * point iov at up to max of the messages queued for fd, starting where the
+ * last write left off. The messages stay queued until write_done(). They're
+ * only valid while fd stays registered, so the caller must be the thread which
+ * unregisters it.
+ *
+ * @return The number of iovecs filled in - 0 if nothing is queued - or
+ * FD_NOT_FOUND.
+ */
+int write_gather(int fd, struct iovec *iov, int max);
+
+/**
+ * The second half: take written bytes off the front of fd's queue, destroying
+ * the messages which went out completely.
+ *
+ * @return The number of messages still queued, or FD_NOT_FOUND.
+ */
+int write_done(int fd, int written);
 int get_next_message(int fd, struct imo_message **msg);
 int queue_message(int fd, struct imo_message *msg);
 
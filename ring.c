@@ -0,0 +1,387 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "ring.h"
+
+#define PARKER_RUNNING (0)
+#define PARKER_PARKED (1)
+
+/// Bounds for adaptive spinning, in iterations of cpu_relax()
+#define MIN_SPIN (64)
+#define MAX_SPIN (16384)
+
+ring *ring_new(gsize capacity)
+{
+    ring *r;
+    gsize size = 2;
+
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    if (posix_memalign((void **)&r, RING_CACHE_LINE, sizeof(ring)))
+    {
+        g_error("Unable to allocate ring");
+    }
+
+    r->cells = malloc(size * sizeof(ring_cell));
+    r->mask = size - 1;
+    for (gsize i = 0; i < size; i++)
+    {
+        r->cells[i].seq = i;
+        r->cells[i].data = NULL;
+    }
+    r->head = 0;
+    r->tail = 0;
+
+    return r;
+}
+
+void ring_free(ring *r)
+{
+    g_return_if_fail(r != NULL);
+
+    free(r->cells);
+    free(r);
+}
+
+gboolean ring_push(ring *r, gpointer data)
+{
+    ring_cell *cell;
+    gsize pos = r->head;
+
+    while (TRUE)
+    {
+        cell = &r->cells[pos & r->mask];
+        gsize seq = cell->seq;
+        ACQUIRE_BARRIER();
+        gssize dif = (gssize)seq - (gssize)pos;
+
+        if (dif == 0)
+        {
+            /* The cell is free on this lap - try to claim it */
+            if (__sync_bool_compare_and_swap(&r->head, pos, pos + 1))
+            {
+                break;
+            }
+            pos = r->head;
+        }
+        else if (dif < 0)
+        {
+            /* The cell still holds last lap's data - we're full */
+            return FALSE;
+        }
+        else
+        {
+            /* Another producer beat us to it */
+            pos = r->head;
+        }
+    }
+
+    cell->data = data;
+    RELEASE_BARRIER();
+    cell->seq = pos + 1;
+
+    return TRUE;
+}
+
+gpointer ring_pop(ring *r)
+{
+    ring_cell *cell;
+    gsize pos = r->tail;
+
+    while (TRUE)
+    {
+        cell = &r->cells[pos & r->mask];
+        gsize seq = cell->seq;
+        ACQUIRE_BARRIER();
+        gssize dif = (gssize)seq - (gssize)(pos + 1);
+
+        if (dif == 0)
+        {
+            if (__sync_bool_compare_and_swap(&r->tail, pos, pos + 1))
+            {
+                break;
+            }
+            pos = r->tail;
+        }
+        else if (dif < 0)
+        {
+            /* Nothing has been published here yet - we're empty */
+            return NULL;
+        }
+        else
+        {
+            pos = r->tail;
+        }
+    }
+
+    gpointer data = cell->data;
+    RELEASE_BARRIER();
+    /* Free the cell for the producer on the next lap */
+    cell->seq = pos + r->mask + 1;
+
+    return data;
+}
+
+gpointer ring_peek(ring *r)
+{
+    gsize pos = r->tail;
+    ring_cell *cell = &r->cells[pos & r->mask];
+    gsize seq = cell->seq;
+    ACQUIRE_BARRIER();
+
+    if (seq != pos + 1)
+    {
+        return NULL;
+    }
+
+    return cell->data;
+}
+
+gsize ring_count(ring *r)
+{
+    gsize head = r->head;
+    gsize tail = r->tail;
+
+    return (head > tail) ? (head - tail) : 0;
+}
+
+gpointer ring_pop_wait(ring *r, parker *p)
+{
+    gpointer data;
+
+    while (TRUE)
+    {
+        for (int i = 0; i < p->spin_limit; i++)
+        {
+            if ((data = ring_pop(r)))
+            {
+                parker_adapt(p, TRUE);
+                return data;
+            }
+            cpu_relax();
+        }
+
+        parker_prepare(p);
+        if ((data = ring_pop(r)))
+        {
+            parker_cancel(p);
+            return data;
+        }
+        parker_adapt(p, FALSE);
+        parker_park(p);
+    }
+}
+
+void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+void parker_init(parker *p)
+{
+    p->state = PARKER_RUNNING;
+    p->spin_limit = MIN_SPIN;
+#ifndef __linux__
+    p->mutex = g_mutex_new();
+    p->cond = g_cond_new();
+#endif
+}
+
+void parker_prepare(parker *p)
+{
+    /* Full barrier: our state must be visible before we look for work again,
+     * or we could miss a push that happened in between */
+    __sync_lock_test_and_set(&p->state, PARKER_PARKED);
+    __sync_synchronize();
+}
+
+void parker_cancel(parker *p)
+{
+    p->state = PARKER_RUNNING;
+}
+
+void parker_park(parker *p)
+{
+#ifdef __linux__
+    /* Returns right away if someone already unparked us */
+    syscall(SYS_futex, &p->state, FUTEX_WAIT_PRIVATE, PARKER_PARKED,
+        NULL, NULL, 0);
+#else
+    g_mutex_lock(p->mutex);
+    while (p->state == PARKER_PARKED)
+    {
+        g_cond_wait(p->cond, p->mutex);
+    }
+    g_mutex_unlock(p->mutex);
+#endif
+    p->state = PARKER_RUNNING;
+}
+
+gboolean parker_unpark(parker *p)
+{
+    /* Pairs with the barrier in parker_prepare - whatever we published before
+     * calling this must be visible before we check the state */
+    __sync_synchronize();
+
+    if (p->state != PARKER_PARKED ||
+        !__sync_bool_compare_and_swap(&p->state, PARKER_PARKED,
+            PARKER_RUNNING))
+    {
+        return FALSE;
+    }
+
+#ifdef __linux__
+    syscall(SYS_futex, &p->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    g_mutex_lock(p->mutex);
+    g_cond_signal(p->cond);
+    g_mutex_unlock(p->mutex);
+#endif
+
+    return TRUE;
+}
+
+gboolean parker_is_parked(parker *p)
+{
+    return p->state == PARKER_PARKED;
+}
+
+void parker_adapt(parker *p, gboolean found_while_spinning)
+{
+    if (found_while_spinning)
+    {
+        p->spin_limit = MIN(p->spin_limit * 2, MAX_SPIN);
+    }
+    else
+    {
+        p->spin_limit = MAX(p->spin_limit / 2, MIN_SPIN);
+    }
+}
+
+int poll_parker_init(poll_parker *p)
+{
+    int fds[2];
+
+    p->state = PARKER_RUNNING;
+
+#ifdef __linux__
+    p->read_fd = p->write_fd = eventfd(0, EFD_NONBLOCK);
+    if (p->read_fd != -1)
+    {
+        return 0;
+    }
+    g_warning("Unable to create an eventfd - using a pipe");
+#endif
+
+    if (pipe(fds))
+    {
+        g_warning("Unable to create a pipe to wake a thread with");
+        p->read_fd = p->write_fd = -1;
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    p->read_fd = fds[0];
+    p->write_fd = fds[1];
+
+    return 0;
+}
+
+void poll_parker_prepare(poll_parker *p)
+{
+    /* As parker_prepare */
+    __sync_lock_test_and_set(&p->state, PARKER_PARKED);
+    __sync_synchronize();
+}
+
+void poll_parker_cancel(poll_parker *p)
+{
+    p->state = PARKER_RUNNING;
+}
+
+short poll_parker_park(poll_parker *p, int fd, short events, int timeout_ms)
+{
+    struct pollfd fds[2];
+    int nfds = 1;
+
+    fds[0].fd = p->read_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    if (fd != -1)
+    {
+        fds[1].fd = fd;
+        fds[1].events = events;
+        fds[1].revents = 0;
+        nfds = 2;
+    }
+
+    /* An unpark between prepare and here leaves the eventfd readable, so
+     * poll() returns right away */
+    if (poll(fds, nfds, timeout_ms) < 0 && errno != EINTR)
+    {
+        g_warning("poll failed while parked");
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+        poll_parker_woken(p);
+    }
+    else
+    {
+        p->state = PARKER_RUNNING;
+    }
+
+    return nfds == 2 ? fds[1].revents : 0;
+}
+
+void poll_parker_woken(poll_parker *p)
+{
+    p->state = PARKER_RUNNING;
+
+    /* Reset it. One read empties an eventfd - a pipe may take several */
+    uint64_t buf[8];
+    while (read(p->read_fd, buf, sizeof(buf)) > 0 &&
+        p->read_fd != p->write_fd)
+    {
+    }
+}
+
+gboolean poll_parker_unpark(poll_parker *p)
+{
+    /* As parker_unpark */
+    __sync_synchronize();
+
+    if (p->state != PARKER_PARKED ||
+        !__sync_bool_compare_and_swap(&p->state, PARKER_PARKED,
+            PARKER_RUNNING))
+    {
+        return FALSE;
+    }
+
+    uint64_t one = 1;
+    if (write(p->write_fd, &one, p->read_fd == p->write_fd ? 8 : 1) < 0 &&
+        errno != EAGAIN)
+    {
+        g_warning("Unable to wake a parked thread");
+    }
+
+    return TRUE;
+}
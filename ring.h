@@ -0,0 +1,177 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <glib.h>
+
+/// Keep the hot indices of a ring on separate cache lines
+#define RING_CACHE_LINE (64)
+
+/* Order a load of a published index before the reads it guards, and the writes
+ * being published before the store of the index. x86 loads and stores already
+ * have acquire/release semantics - we only need to keep the compiler from
+ * reordering them */
+#if defined(__x86_64__) || defined(__i386__)
+#define ACQUIRE_BARRIER() __asm__ __volatile__("" ::: "memory")
+#define RELEASE_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define ACQUIRE_BARRIER() __sync_synchronize()
+#define RELEASE_BARRIER() __sync_synchronize()
+#endif
+
+typedef struct ring_cell {
+    volatile gsize seq;         /**< Which lap this cell is ready for */
+    gpointer data;
+} ring_cell;
+
+/// Bounded lock-free multi-producer, multi-consumer queue of pointers (Dmitry
+/// Vyukov's design). Works as MPSC/SPSC too - there's no separate
+/// implementation, since the uncontended CAS is cheap.
+typedef struct ring {
+    ring_cell *cells;
+    gsize mask;                 /**< capacity - 1 */
+
+    char pad0[RING_CACHE_LINE];
+    volatile gsize head;        /**< Next position to push to */
+    char pad1[RING_CACHE_LINE];
+    volatile gsize tail;        /**< Next position to pop from */
+    char pad2[RING_CACHE_LINE];
+} ring;
+
+/// Lets one thread sleep until another has work for it. The waiting thread
+/// spins for a while first, since a futex round trip costs more than a short
+/// wait for the next message under load. How long it spins adapts to whether
+/// spinning has been paying off.
+typedef struct parker {
+    volatile gint state;        /**< PARKER_RUNNING or PARKER_PARKED */
+    int spin_limit;             /**< Current number of spins before parking */
+#ifndef __linux__
+    GMutex *mutex;              /**< No futexes - fall back to a condvar */
+    GCond *cond;
+#endif
+} parker;
+
+/// Like a parker, but sleeps in poll(), so the sleeper can wait for a file
+/// descriptor at the same time. Wakes through an eventfd, or a pipe where
+/// there's no eventfd. No spinning - the sleeper is expected to have a socket
+/// to wait on more often than not.
+typedef struct poll_parker {
+    volatile gint state;        /**< PARKER_RUNNING or PARKER_PARKED */
+    int read_fd;                /**< What poll() watches */
+    int write_fd;               /**< Same as read_fd for an eventfd */
+} poll_parker;
+
+/**
+ * Create a ring.
+ *
+ * @param capacity Number of entries - rounded up to a power of 2.
+ */
+ring *ring_new(gsize capacity);
+void ring_free(ring *r);
+
+/**
+ * @return FALSE if the ring is full, TRUE if data was pushed.
+ */
+gboolean ring_push(ring *r, gpointer data);
+
+/**
+ * @return The oldest entry, or NULL if the ring is empty.
+ */
+gpointer ring_pop(ring *r);
+
+/**
+ * Look at the oldest entry without popping it.
+ *
+ * \note Only meaningful if the caller is the ring's only consumer - otherwise
+ * the entry may be popped by someone else as soon as this returns.
+ *
+ * @return The oldest entry, or NULL if the ring is empty.
+ */
+gpointer ring_peek(ring *r);
+
+/**
+ * @return Approximate number of entries - may be stale by the time it returns.
+ */
+gsize ring_count(ring *r);
+
+/**
+ * Pop from a ring that only the calling thread waits on, spinning and then
+ * parking on p until something is pushed.
+ */
+gpointer ring_pop_wait(ring *r, parker *p);
+
+void parker_init(parker *p);
+
+/**
+ * Announce that we're about to park. The caller must check for work once more
+ * after this, and either parker_park() or parker_cancel() depending on whether
+ * it found any. Anyone calling parker_unpark() after this will wake us.
+ */
+void parker_prepare(parker *p);
+void parker_cancel(parker *p);
+
+/**
+ * Sleep until parker_unpark(). May return spuriously.
+ */
+void parker_park(parker *p);
+
+/**
+ * Wake a parked thread. Cheap - no syscall - unless the thread is actually
+ * parked. Call after publishing the work the thread should see.
+ *
+ * @return TRUE if the thread was parked.
+ */
+gboolean parker_unpark(parker *p);
+
+gboolean parker_is_parked(parker *p);
+
+/**
+ * Feed back whether spinning found work, to adjust how long we spin next time.
+ */
+void parker_adapt(parker *p, gboolean found_while_spinning);
+
+/**
+ * Set up a poll_parker.
+ *
+ * @return Zero on success, non-zero if neither an eventfd nor a pipe could be
+ * created.
+ */
+int poll_parker_init(poll_parker *p);
+
+/**
+ * As parker_prepare() and parker_cancel().
+ */
+void poll_parker_prepare(poll_parker *p);
+void poll_parker_cancel(poll_parker *p);
+
+/**
+ * Sleep until poll_parker_unpark(), until fd has one of events, or for at most
+ * timeout_ms.
+ *
+ * @param fd File descriptor to wait on as well, or -1 for none.
+ * @param events What to wait for on fd - POLLOUT, for instance.
+ * @param timeout_ms Longest to sleep, or -1 for no limit.
+ *
+ * @return The events which happened on fd, or 0.
+ */
+short poll_parker_park(poll_parker *p, int fd, short events, int timeout_ms);
+
+/**
+ * For threads which wait on read_fd themselves, rather than with
+ * poll_parker_park() - an io_uring poll, say. Call once read_fd is readable,
+ * to reset it and mark p running.
+ */
+void poll_parker_woken(poll_parker *p);
+
+/**
+ * Wake a parked poll_parker. Makes a syscall only if it's actually parked.
+ *
+ * @return TRUE if it was parked.
+ */
+gboolean poll_parker_unpark(poll_parker *p);
+
+/**
+ * Tell the CPU we're in a spin loop.
+ */
+void cpu_relax(void);
+
+#endif
@@ -0,0 +1,273 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+#include "shm.h"
+
+#define SHM_ROUND(len) (((len) + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1))
+
+/* The header, then each ring's bytes and their padding */
+#define SHM_TOTAL_SIZE (sizeof(shm_header) + 2 * (SHM_RING_SIZE + SHM_PADDING))
+
+static void map_rings(shm_segment *seg);
+
+int shm_create(const char *name, shm_segment *seg)
+{
+    /* Whoever was attached to an old one is talking to a kodama which has
+     * gone - start clean */
+    shm_unlink(name);
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+    {
+        g_warning("Unable to create shared memory %s: %s", name,
+            strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, SHM_TOTAL_SIZE))
+    {
+        g_warning("Unable to size shared memory %s: %s", name,
+            strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    /* A new segment reads as zeroes - both rings empty, nobody parked */
+    void *mem = mmap(NULL, SHM_TOTAL_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        g_warning("Unable to map shared memory %s: %s", name,
+            strerror(errno));
+        shm_unlink(name);
+        return -1;
+    }
+
+    seg->header = mem;
+    seg->size = SHM_TOTAL_SIZE;
+    map_rings(seg);
+
+    seg->header->version = SHM_VERSION;
+    seg->header->ring_size = SHM_RING_SIZE;
+    RELEASE_BARRIER();
+    seg->header->magic = SHM_MAGIC;
+
+    return 0;
+}
+
+int shm_attach(const char *name, shm_segment *seg)
+{
+    struct stat st;
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) || (gsize)st.st_size < SHM_TOTAL_SIZE)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *mem = mmap(NULL, SHM_TOTAL_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    seg->header = mem;
+    seg->size = SHM_TOTAL_SIZE;
+
+    if (seg->header->magic != SHM_MAGIC)
+    {
+        /* Not set up yet - or not ours */
+        munmap(mem, SHM_TOTAL_SIZE);
+        return -1;
+    }
+    ACQUIRE_BARRIER();
+
+    if (seg->header->version != SHM_VERSION ||
+        seg->header->ring_size != SHM_RING_SIZE)
+    {
+        g_warning("Shared memory %s is version %u with %u byte rings - we "
+            "want version %d with %d", name, seg->header->version,
+            seg->header->ring_size, SHM_VERSION, SHM_RING_SIZE);
+        munmap(mem, SHM_TOTAL_SIZE);
+        return -1;
+    }
+
+    map_rings(seg);
+
+    return 0;
+}
+
+static void map_rings(shm_segment *seg)
+{
+    seg->to_kodama = (unsigned char *)seg->header + sizeof(shm_header);
+    seg->to_peer = seg->to_kodama + SHM_RING_SIZE + SHM_PADDING;
+}
+
+void shm_remove(const char *name, shm_segment *seg)
+{
+    seg->header->magic = 0;
+    shm_unlink(name);
+}
+
+unsigned char *shm_reserve(shm_ring *r, unsigned char *data, uint32_t len)
+{
+    uint32_t tail = r->tail;
+    uint32_t pos = tail & (SHM_RING_SIZE - 1);
+    uint32_t need = SHM_ROUND(len);
+    uint32_t skip = 0;
+
+    /* Messages are never split, so they can be read in place */
+    if (need > SHM_RING_SIZE - pos)
+    {
+        skip = SHM_RING_SIZE - pos;
+    }
+
+    /* Only the consumer moves head - a stale value just means less room */
+    uint32_t used = tail - r->head;
+    if (used + skip + need > SHM_RING_SIZE)
+    {
+        return NULL;
+    }
+
+    if (skip)
+    {
+        /* There are always at least SHM_ALIGN bytes left, so this fits */
+        uint32_t wrap = SHM_WRAP;
+        memcpy(data + pos, &wrap, 4);
+        pos = 0;
+    }
+
+    return data + pos;
+}
+
+void shm_commit(shm_ring *r, uint32_t len)
+{
+    uint32_t tail = r->tail;
+    uint32_t pos = tail & (SHM_RING_SIZE - 1);
+    uint32_t need = SHM_ROUND(len);
+
+    /* As shm_reserve() decided */
+    if (need > SHM_RING_SIZE - pos)
+    {
+        tail += SHM_RING_SIZE - pos;
+    }
+
+    /* The message must be visible before the tail that covers it */
+    RELEASE_BARRIER();
+    r->tail = tail + need;
+}
+
+uint32_t shm_next(shm_ring *r, unsigned char *data, uint32_t *cursor,
+    unsigned char **msg)
+{
+    uint32_t tail = r->tail;
+
+    while (*cursor != tail)
+    {
+        ACQUIRE_BARRIER();
+
+        /* The lengths are the producer's, so it's up to us to check them
+         * against what it has actually published */
+        uint32_t pos = *cursor & (SHM_RING_SIZE - 1);
+        uint32_t avail = tail - *cursor;
+        uint32_t len;
+        memcpy(&len, data + pos, 4);
+        len = ntohl(len);
+
+        if (len == SHM_WRAP)
+        {
+            if (SHM_RING_SIZE - pos > avail)
+            {
+                return SHM_CORRUPT;
+            }
+            *cursor += SHM_RING_SIZE - pos;
+            continue;
+        }
+
+        if (len < 6 || len > SHM_RING_SIZE - pos || SHM_ROUND(len) > avail)
+        {
+            return SHM_CORRUPT;
+        }
+
+        *msg = data + pos;
+        *cursor += SHM_ROUND(len);
+        return len;
+    }
+
+    return 0;
+}
+
+void shm_release(shm_ring *r, uint32_t pos)
+{
+    /* We must be done reading before the producer may overwrite it */
+    __sync_synchronize();
+    r->head = pos;
+}
+
+void shm_prepare(volatile gint *state)
+{
+    /* As parker_prepare */
+    __sync_lock_test_and_set(state, SHM_PARKED);
+    __sync_synchronize();
+}
+
+void shm_cancel(volatile gint *state)
+{
+    *state = SHM_RUNNING;
+}
+
+void shm_sleep(volatile gint *state, int timeout_ms)
+{
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    /* Not FUTEX_WAIT_PRIVATE - the other side is another process */
+    syscall(SYS_futex, state, FUTEX_WAIT, SHM_PARKED,
+        timeout_ms < 0 ? NULL : &ts, NULL, 0);
+#else
+    /* No futexes - poll */
+    g_usleep(1000 * (timeout_ms < 0 ? 1 : MIN(timeout_ms, 1)));
+#endif
+    *state = SHM_RUNNING;
+}
+
+void shm_doorbell(volatile gint *state)
+{
+    /* As parker_unpark - what we published must be visible before we look */
+    __sync_synchronize();
+
+    if (*state != SHM_PARKED ||
+        !__sync_bool_compare_and_swap(state, SHM_PARKED, SHM_RUNNING))
+    {
+        return;
+    }
+
+#ifdef __linux__
+    syscall(SYS_futex, state, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
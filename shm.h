@@ -0,0 +1,152 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+/// Bytes of messages each direction can hold. A power of 2
+#define SHM_RING_SIZE (1 << 20)
+
+/// Records start on this boundary
+#define SHM_ALIGN (8)
+
+/// A record length which means "the rest of the ring is empty - carry on at
+/// the start". Real imo messages are at least 6 bytes
+#define SHM_WRAP (0)
+
+/// What shm_next() returns when the producer's framing doesn't add up - a
+/// length shorter than a message, or running past the end of the ring or of
+/// what it has published. There's no finding the next message after that
+#define SHM_CORRUPT (0xffffffffu)
+
+/// Doorbell states
+#define SHM_RUNNING (0)
+#define SHM_PARKED (1)
+
+#define SHM_MAGIC (0x6b6f646du)     /* "kodm" */
+#define SHM_VERSION (1)
+
+/// Slack after each ring's bytes, so a message at the very end can still be
+/// decoded in place - see IMO_INPUT_PADDING
+#define SHM_PADDING (64)
+
+/// One direction of a shared-memory connection: a single-producer,
+/// single-consumer ring of imo messages, in exactly the format
+/// create_imo_message() makes, each starting on an SHM_ALIGN boundary and
+/// never split across the end of the ring. Positions count bytes, and only
+/// ever grow - they wrap at 2^32, which SHM_RING_SIZE divides.
+typedef struct shm_ring {
+    volatile uint32_t head;     /**< Bytes the consumer has finished with.
+                                     Only it moves this */
+    char pad0[RING_CACHE_LINE - sizeof(uint32_t)];
+    volatile uint32_t tail;     /**< Bytes the producer has published. Only
+                                     it moves this */
+    char pad1[RING_CACHE_LINE - sizeof(uint32_t)];
+} shm_ring;
+
+/// The start of the shared segment. The two rings' bytes follow it
+typedef struct shm_header {
+    volatile uint32_t magic;    /**< Written last, once the rest is set up */
+    uint32_t version;
+    uint32_t ring_size;
+    volatile gint peer_attached;
+    char pad0[RING_CACHE_LINE - 4 * sizeof(uint32_t)];
+
+    /* Doorbells. Each side marks its own SHM_PARKED before it sleeps, and
+     * the other side wakes it after publishing anything it might be waiting
+     * for - messages, or room for more */
+    volatile gint kodama_state;
+    char pad1[RING_CACHE_LINE - sizeof(gint)];
+    volatile gint peer_state;
+    char pad2[RING_CACHE_LINE - sizeof(gint)];
+
+    shm_ring to_kodama;         /**< Written by the peer */
+    shm_ring to_peer;           /**< Written by kodama */
+} shm_header;
+
+/// A mapped segment
+typedef struct shm_segment {
+    shm_header *header;
+    unsigned char *to_kodama;   /**< Bytes of header->to_kodama */
+    unsigned char *to_peer;     /**< Bytes of header->to_peer */
+    gsize size;                 /**< Of the whole mapping */
+} shm_segment;
+
+/**
+ * Create a segment in /dev/shm, replacing any left over from before, and set
+ * it up for a peer to attach to.
+ *
+ * @param name Its name, as for shm_open() - "/kodama0", say.
+ * @param seg Will describe the mapping.
+ *
+ * @return Zero on success.
+ */
+int shm_create(const char *name, shm_segment *seg);
+
+/**
+ * Map a segment shm_create() made.
+ *
+ * @return Zero on success, non-zero if it doesn't exist (yet), or isn't one
+ * of ours.
+ */
+int shm_attach(const char *name, shm_segment *seg);
+
+/**
+ * Stop anyone else attaching to a segment shm_create() made, and mark it as
+ * no longer ours for whoever still is. It stays mapped, as others may still
+ * ring its doorbells.
+ */
+void shm_remove(const char *name, shm_segment *seg);
+
+/**
+ * Find room for a message of len bytes at the end of r, for the producer to
+ * write it into. Nothing is visible to the consumer until shm_commit().
+ *
+ * @return Where to write the message, or NULL if there isn't room yet.
+ */
+unsigned char *shm_reserve(shm_ring *r, unsigned char *data, uint32_t len);
+
+/**
+ * Publish the message written into the last shm_reserve().
+ */
+void shm_commit(shm_ring *r, uint32_t len);
+
+/**
+ * Find the next message at or after *cursor, for the consumer. Messages stay
+ * in place until the consumer moves head past them with shm_release(), so a
+ * consumer may read ahead of what it has finished with.
+ *
+ * @param cursor Where to start looking. Moved past the message.
+ * @param msg Will point to the message, in place.
+ *
+ * @return The message's length, 0 if there are no more yet, or SHM_CORRUPT,
+ * leaving cursor where it was.
+ */
+uint32_t shm_next(shm_ring *r, unsigned char *data, uint32_t *cursor,
+    unsigned char **msg);
+
+/**
+ * Give the bytes before pos back to the producer.
+ */
+void shm_release(shm_ring *r, uint32_t pos);
+
+/**
+ * As parker_prepare() and parker_cancel(), on a doorbell in shared memory.
+ */
+void shm_prepare(volatile gint *state);
+void shm_cancel(volatile gint *state);
+
+/**
+ * Sleep until shm_doorbell(), or for at most timeout_ms (-1 for no limit).
+ * Returns right away if the doorbell was rung since shm_prepare().
+ */
+void shm_sleep(volatile gint *state, int timeout_ms);
+
+/**
+ * Wake whoever is sleeping on state. Only a syscall if they actually are.
+ */
+void shm_doorbell(volatile gint *state);
+
+#endif
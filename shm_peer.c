@@ -0,0 +1,387 @@
+/* Stands in for a wowza on the same host as a shard, talking to it through
+ * shared memory rather than a socket (run the shard with --shm name). Attaches
+ * to the segment once the shard has made it, starts a number of
+ * conversations, then keeps a window of audio messages in flight across them
+ * for a while - written straight into the ring - and prints the replies we got
+ * per second and how long they took to come back, as bench_io does for TCP.
+ *
+ * Run the shard with --dummy to measure the transport alone, rather than echo
+ * cancellation.
+ *
+ * Usage: shm_peer [name] [conversations] [seconds] [window]
+ */
+
+#include <arpa/inet.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "imo_message.h"
+#include "shm.h"
+
+#define DEFAULT_NAME "/kodama"
+#define DEFAULT_CONVERSATIONS (100)
+#define DEFAULT_SECONDS (10)
+/// Audio messages sent and not yet replied to
+#define DEFAULT_WINDOW (256)
+
+/// Longest we wait for the shard to make the segment, and then to accept the
+/// conversations
+#define START_TIMEOUT_SECS (10)
+
+/// How long we sleep at a time when there's nothing to do, so we notice the
+/// time is up even if the shard has stopped answering
+#define IDLE_MS (100)
+
+/// Round trip times we can tell apart, in microseconds. Anything slower lands
+/// in the last bucket
+#define RTT_BUCKETS (100000)
+
+/// A speex packet in an FLV tag, as calibrate() uses
+#define FLV_PACKET_LEN (68)
+static unsigned char flv_packet[FLV_PACKET_LEN] = "\x08\x00\x00\x35\x00\x1A\x27\x00\x00\x00\x00\xB6\x2B\x42\x48\xD4\x16\x8C\xE2\x47\x04\x49\x9C\x01\x18\xC5\xDD\xA7\x16\x95\x38\xB6\xFD\xA2\x57\x8F\xEC\x75\xDA\xA1\x53\x11\xBC\xE9\x7E\x84\xA9\xC9\x20\x2A\x9C\x60\x17\xB3\x80\x3D\xAD\x62\x38\xA0\xC0\x03\x60\xB7\x00\x00\x00\x40";
+
+typedef struct bench_stream {
+    gchar *name;
+    gboolean accepted;
+    GQueue sent;                /**< When each unanswered packet went out, as
+                                     gint64 microseconds. Replies to a stream
+                                     come back in order */
+} bench_stream;
+
+static shm_segment seg;
+static uint32_t cursor = 0;     /**< Next byte of to_peer to read */
+
+static bench_stream *streams = NULL;
+static int num_streams = 0;
+static GHashTable *stream_by_name = NULL;
+static int accepted = 0;
+
+static int in_flight = 0;
+static long replies = 0;
+static long other_replies = 0;
+static guint32 *rtt_counts = NULL;
+
+static gint64 now_us(void);
+static void attach(const char *name);
+static gboolean put_message(char type, const char *stream_name,
+    const unsigned char *body, int body_len);
+static gboolean read_replies(void);
+static void handle_reply(imo_message *msg);
+static gboolean send_audio(int count);
+static void wait_for_shard(void);
+static long rtt_percentile(double p);
+
+static gint64 now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (gint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void attach(const char *name)
+{
+    gint64 start = now_us();
+
+    printf("Waiting for a shard to serve %s\n", name);
+    while (shm_attach(name, &seg))
+    {
+        if (now_us() - start > START_TIMEOUT_SECS * 1000000LL)
+        {
+            fprintf(stderr, "No shard made %s - is it running with --shm?\n",
+                name);
+            exit(1);
+        }
+        g_usleep(IDLE_MS * 1000);
+    }
+
+    if (!g_atomic_int_compare_and_exchange(&seg.header->peer_attached, 0, 1))
+    {
+        fprintf(stderr, "Someone else is already attached to %s\n", name);
+        exit(1);
+    }
+
+    /* Replies left for whoever was here before us aren't ours */
+    cursor = seg.header->to_peer.tail;
+    shm_release(&seg.header->to_peer, cursor);
+}
+
+/* Write a message straight into the shard's ring, in create_imo_message()'s
+ * format. FALSE if there isn't room for it yet */
+static gboolean put_message(char type, const char *stream_name,
+    const unsigned char *body, int body_len)
+{
+    int name_len = strlen(stream_name);
+    uint32_t len = 4 + 1 + 1 + name_len + body_len;
+
+    unsigned char *dst = shm_reserve(&seg.header->to_kodama, seg.to_kodama,
+        len);
+    if (!dst)
+    {
+        return FALSE;
+    }
+
+    uint32_t len_be = htonl(len);
+    memcpy(dst, &len_be, 4);
+    dst[4] = type;
+    dst[5] = name_len;
+    memcpy(dst + 6, stream_name, name_len);
+    memcpy(dst + 6 + name_len, body, body_len);
+
+    shm_commit(&seg.header->to_kodama, len);
+    return TRUE;
+}
+
+/* Handle every reply waiting, and give their room back. TRUE if there were
+ * any */
+static gboolean read_replies(void)
+{
+    shm_ring *r = &seg.header->to_peer;
+    unsigned char *text;
+    uint32_t len;
+    struct timeval now;
+    volatile gint done;
+    gboolean any = FALSE;
+
+    gettimeofday(&now, NULL);
+
+    while ((len = shm_next(r, seg.to_peer, &cursor, &text)))
+    {
+        if (len == SHM_CORRUPT)
+        {
+            fprintf(stderr, "Lost track of message boundaries\n");
+            exit(1);
+        }
+
+        /* Borrowed - the ring keeps its bytes until we release them */
+        imo_message *msg = create_imo_message_leased(text, len, &now, &done,
+            NULL, NULL);
+        handle_reply(msg);
+        imo_message_destroy(msg);
+        any = TRUE;
+    }
+
+    if (any)
+    {
+        shm_release(r, cursor);
+        /* In case the shard is waiting for room */
+        shm_doorbell(&seg.header->kodama_state);
+    }
+
+    return any;
+}
+
+static void handle_reply(imo_message *msg)
+{
+    char type;
+    const char *name;
+    int name_len;
+    const unsigned char *body;
+    int body_len;
+
+    if (imo_message_peek(msg, &type, &name, &name_len, &body, &body_len))
+    {
+        fprintf(stderr, "Malformed message from the shard\n");
+        return;
+    }
+
+    gchar *key = g_strndup(name, name_len);
+    bench_stream *s = g_hash_table_lookup(stream_by_name, key);
+    g_free(key);
+
+    if (!s)
+    {
+        /* Load reports, and the like */
+        other_replies++;
+        return;
+    }
+
+    if (type == 'S' && !s->accepted)
+    {
+        s->accepted = TRUE;
+        accepted++;
+    }
+    else if (type == 'R')
+    {
+        fprintf(stderr, "The shard turned %s down - start it with fewer "
+            "conversations, or without a shard number\n", s->name);
+        exit(1);
+    }
+    else if (type == 'D' && !g_queue_is_empty(&s->sent))
+    {
+        gint64 *sent = g_queue_pop_head(&s->sent);
+        long rtt = now_us() - *sent;
+        g_slice_free(gint64, sent);
+
+        rtt_counts[CLAMP(rtt, 0, RTT_BUCKETS - 1)]++;
+        replies++;
+        in_flight--;
+    }
+    else
+    {
+        other_replies++;
+    }
+}
+
+/* Send up to count packets, spread round robin over the streams, as far as
+ * the ring has room. TRUE if we sent any */
+static gboolean send_audio(int count)
+{
+    static int next = 0;
+    int sent_count = 0;
+
+    for (; sent_count < count; sent_count++)
+    {
+        bench_stream *s = &streams[next];
+        if (!put_message('D', s->name, flv_packet, FLV_PACKET_LEN))
+        {
+            break;
+        }
+        next = (next + 1) % num_streams;
+
+        gint64 *sent = g_slice_new(gint64);
+        *sent = now_us();
+        g_queue_push_tail(&s->sent, sent);
+        in_flight++;
+    }
+
+    if (sent_count)
+    {
+        shm_doorbell(&seg.header->kodama_state);
+    }
+
+    return sent_count > 0;
+}
+
+/* Sleep until the shard replies or makes room, or for IDLE_MS */
+static void wait_for_shard(void)
+{
+    shm_prepare(&seg.header->peer_state);
+    if (seg.header->to_peer.tail != cursor)
+    {
+        shm_cancel(&seg.header->peer_state);
+        return;
+    }
+    shm_sleep(&seg.header->peer_state, IDLE_MS);
+}
+
+static long rtt_percentile(double p)
+{
+    long target = replies * p;
+    long seen = 0;
+
+    for (int i = 0; i < RTT_BUCKETS; i++)
+    {
+        seen += rtt_counts[i];
+        if (seen > target)
+        {
+            return i;
+        }
+    }
+
+    return RTT_BUCKETS;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = argc > 1 ? argv[1] : DEFAULT_NAME;
+    int num_convs = argc > 2 ? atoi(argv[2]) : DEFAULT_CONVERSATIONS;
+    int seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+    int window = argc > 4 ? atoi(argv[4]) : DEFAULT_WINDOW;
+
+    if (num_convs < 1 || seconds < 1 || window < 1)
+    {
+        fprintf(stderr, "Usage: %s [name] [conversations] [seconds] "
+            "[window]\n", argv[0]);
+        return 1;
+    }
+
+    rtt_counts = calloc(RTT_BUCKETS, sizeof(guint32));
+
+    attach(name);
+
+    /* Both sides of each conversation */
+    num_streams = num_convs * 2;
+    streams = calloc(num_streams, sizeof(bench_stream));
+    stream_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    gint64 start = now_us();
+    for (int i = 0; i < num_streams; i++)
+    {
+        bench_stream *s = &streams[i];
+        s->name = g_strdup_printf("bench%06d:%d", i / 2, i % 2);
+        g_queue_init(&s->sent);
+        g_hash_table_insert(stream_by_name, s->name, s);
+
+        while (!put_message('S', s->name, (unsigned char *)"", 0))
+        {
+            shm_doorbell(&seg.header->kodama_state);
+            read_replies();
+            wait_for_shard();
+        }
+    }
+    shm_doorbell(&seg.header->kodama_state);
+
+    while (accepted < num_streams)
+    {
+        if (!read_replies())
+        {
+            wait_for_shard();
+        }
+        if (now_us() - start > START_TIMEOUT_SECS * 1000000LL)
+        {
+            fprintf(stderr, "Only %d of %d streams were accepted\n", accepted,
+                num_streams);
+            return 1;
+        }
+    }
+    printf("%d conversations started - sending audio for %d seconds, %d "
+        "packets in flight\n", num_convs, seconds, window);
+
+    start = now_us();
+    gint64 end = start + seconds * 1000000LL;
+    while (now_us() < end)
+    {
+        gboolean busy = FALSE;
+        if (in_flight < window)
+        {
+            busy = send_audio(window - in_flight);
+        }
+        busy = read_replies() || busy;
+
+        if (!busy)
+        {
+            wait_for_shard();
+        }
+    }
+    double elapsed = (now_us() - start) / 1E6;
+
+    printf("%ld replies in %.1fs: %.0f/s\n", replies, elapsed,
+        replies / elapsed);
+    if (replies)
+    {
+        printf("round trip (us): p50 %ld, p90 %ld, p99 %ld, p99.9 %ld\n",
+            rtt_percentile(0.5), rtt_percentile(0.9), rtt_percentile(0.99),
+            rtt_percentile(0.999));
+    }
+    if (other_replies)
+    {
+        printf("%ld other messages\n", other_replies);
+    }
+
+    /* Leave the shard as we found it */
+    for (int i = 0; i < num_streams; i++)
+    {
+        while (!put_message('E', streams[i].name, (unsigned char *)"", 0))
+        {
+            shm_doorbell(&seg.header->kodama_state);
+            read_replies();
+            wait_for_shard();
+        }
+    }
+    shm_doorbell(&seg.header->kodama_state);
+    g_atomic_int_set(&seg.header->peer_attached, 0);
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <glib.h>
+#include <stdlib.h>
+
+#include "kodama.h"
+#include "strand.h"
+
+/// An item queued behind a busy strand, or waiting for a pool thread
+typedef struct strand_task {
+    strand *s;                  /**< Only set for tasks pushed to a pool */
+    strand_fn fn;
+    gpointer item;
+} strand_task;
+
+strand *strand_new(void)
+{
+    strand *s = malloc(sizeof(strand));
+
+    s->mutex = g_mutex_new();
+    s->idle = g_cond_new();
+    s->pending = g_queue_new();
+    s->busy = FALSE;
+
+    return s;
+}
+
+void strand_free(strand *s)
+{
+    g_return_if_fail(s != NULL);
+
+    if (s->busy || !g_queue_is_empty(s->pending))
+    {
+        g_warning("Freeing a strand which still has work to do");
+    }
+
+    g_queue_free(s->pending);
+    g_cond_free(s->idle);
+    g_mutex_free(s->mutex);
+
+    free(s);
+}
+
+gboolean strand_enqueue(strand *s, strand_fn fn, gpointer item)
+{
+    gboolean claimed;
+
+    g_mutex_lock(s->mutex);
+    claimed = !s->busy;
+    if (claimed)
+    {
+        s->busy = TRUE;
+    }
+    else
+    {
+        strand_task *task = g_slice_new(strand_task);
+        task->s = NULL;
+        task->fn = fn;
+        task->item = item;
+        g_queue_push_tail(s->pending, task);
+    }
+    g_mutex_unlock(s->mutex);
+
+    return claimed;
+}
+
+void strand_run(strand *s, strand_fn fn, gpointer item)
+{
+    while (TRUE)
+    {
+        fn(item);
+
+        g_mutex_lock(s->mutex);
+        strand_task *task = g_queue_pop_head(s->pending);
+        if (!task)
+        {
+            s->busy = FALSE;
+            g_cond_broadcast(s->idle);
+            g_mutex_unlock(s->mutex);
+
+            /* s may be freed as soon as we unlock - don't touch it again */
+            return;
+        }
+        g_mutex_unlock(s->mutex);
+
+        fn = task->fn;
+        item = task->item;
+        g_slice_free(strand_task, task);
+    }
+}
+
+void strand_submit(strand *s, strand_fn fn, gpointer item)
+{
+    if (strand_enqueue(s, fn, item))
+    {
+        strand_run(s, fn, item);
+    }
+}
+
+void strand_post(strand *s, strand_fn fn, gpointer item, GThreadPool *pool)
+{
+    if (strand_enqueue(s, fn, item))
+    {
+        strand_task *task = g_slice_new(strand_task);
+        task->s = s;
+        task->fn = fn;
+        task->item = item;
+        g_thread_pool_push(pool, task, NULL);
+    }
+}
+
+void strand_pool_func(gpointer data, gpointer user_data)
+{
+    strand_task *task = data;
+    strand *s = task->s;
+    strand_fn fn = task->fn;
+    gpointer item = task->item;
+
+    UNUSED(user_data);
+
+    g_slice_free(strand_task, task);
+    strand_run(s, fn, item);
+}
+
+void strand_wait_idle(strand *s)
+{
+    g_mutex_lock(s->mutex);
+    while (s->busy)
+    {
+        g_cond_wait(s->idle, s->mutex);
+    }
+    g_mutex_unlock(s->mutex);
+}
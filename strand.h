@@ -0,0 +1,73 @@
+#ifndef _STRAND_H_
+#define _STRAND_H_
+
+#include <glib.h>
+
+typedef void (*strand_fn)(gpointer item);
+
+/// Runs work items one at a time, in the order they were submitted. There's
+/// no thread behind a strand - whichever thread finds it idle runs it, and
+/// items submitted while it's busy are run by that same thread once it's done
+/// with its current item. Nobody ever waits for a busy strand.
+typedef struct strand {
+    GMutex *mutex;              /**< Protects pending and busy */
+    GCond *idle;                /**< Signalled when busy goes FALSE */
+    GQueue *pending;            /**< Items waiting for the current one */
+    gboolean busy;              /**< Some thread is running items */
+} strand;
+
+strand *strand_new(void);
+
+/**
+ * Free a strand. It must be idle, and nothing may submit to it again.
+ */
+void strand_free(strand *s);
+
+/**
+ * Claim a strand for an item, or queue the item if the strand is busy.
+ *
+ * @param s The strand.
+ * @param fn Function to run the item with.
+ * @param item The work item.
+ *
+ * @return TRUE if the caller now owns the strand, and must call strand_run()
+ * with the same fn and item. FALSE if the item was queued for the current
+ * owner.
+ */
+gboolean strand_enqueue(strand *s, strand_fn fn, gpointer item);
+
+/**
+ * Run an item on a strand claimed with strand_enqueue(), then run everything
+ * queued behind it. The strand is idle again when this returns, and may
+ * already have been freed.
+ */
+void strand_run(strand *s, strand_fn fn, gpointer item);
+
+/**
+ * Run an item now if the strand is idle, or after the items ahead of it if
+ * not.
+ */
+void strand_submit(strand *s, strand_fn fn, gpointer item);
+
+/**
+ * Like strand_submit(), but never runs the item on the calling thread. If the
+ * strand is idle, a thread from pool runs it; if not, the thread busy with it
+ * does. Lets one strand hand an item on to the next without waiting for it.
+ *
+ * @param pool A pool created with strand_pool_func (or a function which calls
+ * it) as its thread function.
+ */
+void strand_post(strand *s, strand_fn fn, gpointer item, GThreadPool *pool);
+
+/**
+ * Thread function for pools passed to strand_post().
+ */
+void strand_pool_func(gpointer data, gpointer user_data);
+
+/**
+ * Block until a strand is idle. Only useful once no more items can be
+ * submitted, since the strand may be claimed again right after this returns.
+ */
+void strand_wait_idle(strand *s);
+
+#endif
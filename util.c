@@ -1,3 +1,8 @@
+#ifdef __linux__
+#define _GNU_SOURCE             /* For sched_setaffinity */
+#include <sched.h>
+#endif
+
 #include <glib.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -131,3 +136,94 @@ int num_processors(void)
 {
     return sysconf(_SC_NPROCESSORS_ONLN);
 }
+
+#ifdef __linux__
+/* Read a single integer from a sysfs file. Returns -1 on failure. */
+static int read_sysfs_int(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    int val = -1;
+
+    if (!f)
+    {
+        return -1;
+    }
+    if (fscanf(f, "%d", &val) != 1)
+    {
+        val = -1;
+    }
+    fclose(f);
+
+    return val;
+}
+
+int physical_core_cpus(int *cpus, int max_cpus)
+{
+    int num_cpus = MIN(num_processors(), max_cpus);
+    int *packages = malloc(num_cpus * sizeof(int));
+    int *cores = malloc(num_cpus * sizeof(int));
+    int found = 0;
+
+    for (int cpu = 0; cpu < num_cpus; cpu++)
+    {
+        char path[128];
+
+        snprintf(path, sizeof(path),
+            "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        int package = read_sysfs_int(path);
+        snprintf(path, sizeof(path),
+            "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        int core = read_sysfs_int(path);
+
+        /* Skip hyperthread siblings of cores we already have */
+        int seen = 0;
+        for (int i = 0; i < found && package != -1 && core != -1; i++)
+        {
+            if (packages[i] == package && cores[i] == core)
+            {
+                seen = 1;
+                break;
+            }
+        }
+
+        if (!seen)
+        {
+            packages[found] = package;
+            cores[found] = core;
+            cpus[found++] = cpu;
+        }
+    }
+
+    free(packages);
+    free(cores);
+
+    return found;
+}
+
+int pin_thread_to_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    /* pid 0 is the calling thread */
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+#else
+int physical_core_cpus(int *cpus, int max_cpus)
+{
+    UNUSED(cpus);
+    UNUSED(max_cpus);
+
+    return -1;
+}
+
+int pin_thread_to_cpu(int cpu)
+{
+    UNUSED(cpu);
+
+    /* TODO: thread_policy_set can give affinity hints on the Mac */
+    return -1;
+}
+#endif
@@ -24,4 +24,24 @@ long delta(struct timeval *x, struct timeval *y);
 uint64_t cycles(void);
 int num_processors(void);
 
+/**
+ * Find one logical CPU for each physical core, so threads pinned to them won't
+ * share a core with a hyperthread sibling.
+ *
+ * @param cpus Array to fill with CPU numbers.
+ * @param max_cpus Size of cpus.
+ *
+ * @return Number of entries filled in, or -1 if we can't tell on this platform.
+ */
+int physical_core_cpus(int *cpus, int max_cpus);
+
+/**
+ * Pin the calling thread to a single CPU.
+ *
+ * @param cpu The CPU number.
+ *
+ * @return Zero on success, non-zero on failure.
+ */
+int pin_thread_to_cpu(int cpu);
+
 #endif
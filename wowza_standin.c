@@ -0,0 +1,457 @@
+/* Stands in for the wowza side of one or more kodama shards, to exercise
+ * admission control without a media server. Waits for the shards to connect
+ * (run them with --shard N --server host:port), then starts more conversations
+ * than they have room for. Each conversation goes to the least loaded shard
+ * that hasn't turned it down yet, and follows 'R' replies to the next one, the
+ * way wowza would. Prints each shard's 'L' reports as they arrive, and a
+ * summary once every conversation has been placed or refused everywhere.
+ *
+ * Only 'S' and 'E' messages are sent - there's no audio.
+ *
+ * Usage: wowza_standin [port] [shards] [conversations]
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <glib.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "imo_message.h"
+#include "kodama.h"
+
+#define DEFAULT_SHARDS (2)
+#define DEFAULT_CONVERSATIONS (1000)
+/// Bitmask of shards a conversation has tried limits us to this many
+#define MAX_SHARDS (32)
+
+/// How long to keep listening for load reports once everything is placed
+#define LINGER_SECS (12)
+
+typedef enum conv_state {
+    CONV_STARTING,              /**< Waiting for the first side's reply */
+    CONV_JOINING,               /**< First side accepted, waiting for second */
+    CONV_ACCEPTED,
+    CONV_REFUSED                /**< Every shard turned it down */
+} conv_state;
+
+typedef struct standin_conv {
+    gchar *id;
+    conv_state state;
+    int shard;                  /**< Where it's being started, or running */
+    guint32 tried;              /**< Shards which have turned it down */
+    int redirects;
+} standin_conv;
+
+typedef struct shard {
+    int fd;
+    GByteArray *in;             /**< Bytes read but not yet framed */
+    int conversations;          /**< From its last 'L' report */
+    int capacity;
+    float load;
+    int reports;
+} shard;
+
+static shard shards[MAX_SHARDS];
+static int num_shards = 0;
+static standin_conv *convs = NULL;
+static int num_convs = 0;
+static GHashTable *conv_by_id = NULL;
+
+static int unresolved = 0;
+
+static int listen_on(int port);
+static void send_message(shard *s, char type, const char *stream_name);
+static int pick_shard(standin_conv *c);
+static void start_conv(standin_conv *c);
+static void handle_reply(int shard_index, imo_message *msg);
+static void parse_load(shard *s, const unsigned char *body, int body_len);
+static int read_shard(int shard_index);
+static void lose_shard(int shard_index);
+static void print_summary(void);
+
+static int listen_on(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(fd, MAX_SHARDS))
+    {
+        perror("bind/listen");
+        exit(1);
+    }
+
+    return fd;
+}
+
+static void send_message(shard *s, char type, const char *stream_name)
+{
+    imo_message *msg = create_imo_message(type, stream_name,
+        (unsigned char *)"", 0);
+    int offset = 0;
+
+    while (offset < msg->length)
+    {
+        ssize_t n = write(s->fd, msg->text + offset, msg->length - offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            perror("write");
+            exit(1);
+        }
+        offset += n;
+    }
+
+    imo_message_destroy(msg);
+}
+
+/* The least loaded shard which hasn't turned c down, or -1 if they all have.
+ * Before the first reports arrive, every shard looks empty - spread
+ * conversations round robin until then */
+static int pick_shard(standin_conv *c)
+{
+    int best = -1;
+
+    for (int i = 0; i < num_shards; i++)
+    {
+        int candidate = (c - convs + i) % num_shards;
+        if ((c->tried & (1u << candidate)) || shards[candidate].fd == -1)
+        {
+            continue;
+        }
+        if (best == -1 || shards[candidate].load < shards[best].load)
+        {
+            best = candidate;
+        }
+    }
+
+    return best;
+}
+
+static void start_conv(standin_conv *c)
+{
+    c->shard = pick_shard(c);
+    if (c->shard == -1)
+    {
+        c->state = CONV_REFUSED;
+        unresolved--;
+        return;
+    }
+
+    gchar *name = g_strdup_printf("%s:0", c->id);
+    c->state = CONV_STARTING;
+    send_message(&shards[c->shard], 'S', name);
+    g_free(name);
+}
+
+static void handle_reply(int shard_index, imo_message *msg)
+{
+    char type;
+    const char *name;
+    int name_len;
+    const unsigned char *body;
+    int body_len;
+
+    if (imo_message_peek(msg, &type, &name, &name_len, &body, &body_len))
+    {
+        fprintf(stderr, "Malformed message from shard %d\n", shard_index);
+        return;
+    }
+
+    if (type == 'L')
+    {
+        shard *s = &shards[shard_index];
+        parse_load(s, body, body_len);
+        printf("shard %d (%.*s): %d/%d conversations, load %.2f\n",
+            shard_index, name_len, name, s->conversations, s->capacity,
+            s->load);
+        return;
+    }
+
+    /* Everything else is about one side of a conversation */
+    const char *colon = memchr(name, ':', name_len);
+    if (!colon)
+    {
+        return;
+    }
+    gchar *id = g_strndup(name, colon - name);
+    standin_conv *c = g_hash_table_lookup(conv_by_id, id);
+    g_free(id);
+    if (!c || c->shard != shard_index)
+    {
+        return;
+    }
+
+    if (type == 'R' && c->state == CONV_STARTING)
+    {
+        /* Take the shard's word for its load, without waiting for a report */
+        parse_load(&shards[shard_index], body, body_len);
+        c->tried |= 1u << shard_index;
+        c->redirects++;
+        start_conv(c);
+    }
+    else if (type == 'S' && c->state == CONV_STARTING)
+    {
+        gchar *other = g_strdup_printf("%s:1", c->id);
+        c->state = CONV_JOINING;
+        send_message(&shards[shard_index], 'S', other);
+        g_free(other);
+    }
+    else if (type == 'S' && c->state == CONV_JOINING)
+    {
+        c->state = CONV_ACCEPTED;
+        unresolved--;
+    }
+}
+
+static void parse_load(shard *s, const unsigned char *body, int body_len)
+{
+    if (!body || body_len <= 0)
+    {
+        return;
+    }
+
+    gchar *text = g_strndup((const gchar *)body, body_len);
+    gchar **pairs = g_strsplit(text, ";", 0);
+
+    for (int i = 0; pairs[i]; i++)
+    {
+        gchar **key_and_value = g_strsplit(pairs[i], "=", 2);
+
+        if (key_and_value[0] && key_and_value[1])
+        {
+            if (!strcmp("conversations", key_and_value[0]))
+            {
+                s->conversations = atoi(key_and_value[1]);
+            }
+            else if (!strcmp("capacity", key_and_value[0]))
+            {
+                s->capacity = atoi(key_and_value[1]);
+            }
+            else if (!strcmp("load", key_and_value[0]))
+            {
+                s->load = atof(key_and_value[1]);
+                s->reports++;
+            }
+        }
+
+        g_strfreev(key_and_value);
+    }
+
+    g_strfreev(pairs);
+    g_free(text);
+}
+
+/* Read what's waiting from a shard, and handle every complete message.
+ * Returns -1 if the shard hung up. */
+static int read_shard(int shard_index)
+{
+    shard *s = &shards[shard_index];
+    unsigned char buf[65536];
+
+    ssize_t n = read(s->fd, buf, sizeof(buf));
+    if (n <= 0)
+    {
+        return -1;
+    }
+    g_byte_array_append(s->in, buf, n);
+
+    while (s->in->len >= 4)
+    {
+        guint32 len_be;
+        memcpy(&len_be, s->in->data, 4);
+        guint32 len = ntohl(len_be);
+
+        if (len < 6)
+        {
+            fprintf(stderr, "Bad message length %u from shard %d\n", len,
+                shard_index);
+            return -1;
+        }
+        if (s->in->len < len)
+        {
+            break;
+        }
+
+        unsigned char *text = malloc(len);
+        memcpy(text, s->in->data, len);
+        g_byte_array_remove_range(s->in, 0, len);
+
+        imo_message *msg = create_imo_message_from_text(text, len);
+        handle_reply(shard_index, msg);
+        imo_message_destroy(msg);
+    }
+
+    return 0;
+}
+
+/* Move whatever was being started on a shard which hung up somewhere else */
+static void lose_shard(int shard_index)
+{
+    close(shards[shard_index].fd);
+    shards[shard_index].fd = -1;
+
+    for (int i = 0; i < num_convs; i++)
+    {
+        standin_conv *c = &convs[i];
+        if (c->shard == shard_index &&
+            (c->state == CONV_STARTING || c->state == CONV_JOINING))
+        {
+            c->tried |= 1u << shard_index;
+            start_conv(c);
+        }
+    }
+}
+
+static void print_summary(void)
+{
+    int accepted = 0, refused = 0, redirected = 0;
+    int per_shard[MAX_SHARDS] = {0};
+
+    for (int i = 0; i < num_convs; i++)
+    {
+        standin_conv *c = &convs[i];
+        if (c->state == CONV_ACCEPTED)
+        {
+            accepted++;
+            per_shard[c->shard]++;
+        }
+        else if (c->state == CONV_REFUSED)
+        {
+            refused++;
+        }
+        if (c->redirects)
+        {
+            redirected++;
+        }
+    }
+
+    printf("\n%d conversations: %d placed (%d after a redirect), %d refused "
+        "by every shard\n", num_convs, accepted, redirected, refused);
+    for (int i = 0; i < num_shards; i++)
+    {
+        printf("  shard %d: %d placed, last report %d/%d (load %.2f)\n", i,
+            per_shard[i], shards[i].conversations, shards[i].capacity,
+            shards[i].load);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int port = argc > 1 ? atoi(argv[1]) : PORTNUM;
+    num_shards = argc > 2 ? atoi(argv[2]) : DEFAULT_SHARDS;
+    num_convs = argc > 3 ? atoi(argv[3]) : DEFAULT_CONVERSATIONS;
+
+    if (num_shards < 1 || num_shards > MAX_SHARDS || num_convs < 1)
+    {
+        fprintf(stderr, "Usage: %s [port] [shards (1-%d)] [conversations]\n",
+            argv[0], MAX_SHARDS);
+        return 1;
+    }
+
+    int listen_fd = listen_on(port);
+    printf("Waiting for %d shards on port %d\n", num_shards, port);
+    for (int i = 0; i < num_shards; i++)
+    {
+        shard *s = &shards[i];
+        s->fd = accept(listen_fd, NULL, NULL);
+        if (s->fd < 0)
+        {
+            perror("accept");
+            return 1;
+        }
+        s->in = g_byte_array_new();
+        s->conversations = 0;
+        s->capacity = 0;
+        s->load = 0;
+        s->reports = 0;
+        printf("Shard %d connected\n", i);
+    }
+
+    convs = calloc(num_convs, sizeof(standin_conv));
+    conv_by_id = g_hash_table_new(g_str_hash, g_str_equal);
+    unresolved = num_convs;
+    for (int i = 0; i < num_convs; i++)
+    {
+        standin_conv *c = &convs[i];
+        c->id = g_strdup_printf("standin%06d", i);
+        g_hash_table_insert(conv_by_id, c->id, c);
+        start_conv(c);
+    }
+
+    struct pollfd fds[MAX_SHARDS];
+    for (int i = 0; i < num_shards; i++)
+    {
+        fds[i].fd = shards[i].fd;
+        fds[i].events = POLLIN;
+    }
+
+    /* Run until everything is placed, and then a bit longer so each shard
+     * gets to report the load we left it with */
+    GTimer *linger = NULL;
+    while (!linger || g_timer_elapsed(linger, NULL) < LINGER_SECS)
+    {
+        if (poll(fds, num_shards, 1000) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return 1;
+        }
+
+        for (int i = 0; i < num_shards; i++)
+        {
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                read_shard(i))
+            {
+                fprintf(stderr, "Shard %d hung up\n", i);
+                fds[i].fd = -1;
+                lose_shard(i);
+            }
+        }
+
+        if (!unresolved && !linger)
+        {
+            linger = g_timer_new();
+        }
+    }
+
+    print_summary();
+
+    /* Leave the shards as we found them */
+    for (int i = 0; i < num_convs; i++)
+    {
+        standin_conv *c = &convs[i];
+        if (c->state == CONV_ACCEPTED && shards[c->shard].fd != -1)
+        {
+            for (int side = 0; side < 2; side++)
+            {
+                gchar *name = g_strdup_printf("%s:%d", c->id, side);
+                send_message(&shards[c->shard], 'E', name);
+                g_free(name);
+            }
+        }
+    }
+
+    return 0;
+}